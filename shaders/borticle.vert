@@ -3,18 +3,22 @@
 layout(location = 0) in vec3 vertex;
 layout(location = 1) in vec4 positions;
 layout(location = 2) in vec4 colors;
+layout(location = 3) in vec4 prev_positions;
 
 uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
+uniform float alpha; // interpolation between prev_positions and positions
+uniform float point_scale; // camera distance of the z = 0 plane (3D), 1 for orthographic
 
 out vec4 color;
 
 void main() {
     color = colors;
 
-    gl_PointSize = positions.w;
-
-    vec4 pos = vec4(positions.xyz, 1.0);
+    vec4 pos = vec4(mix(prev_positions.xyz, positions.xyz, alpha), 1.0);
     gl_Position = projection * view * model * pos;
+
+    // perspective: size as seen on the z = 0 plane, orthographic: w == 1
+    gl_PointSize = positions.w * point_scale / gl_Position.w;
 }
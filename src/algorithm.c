@@ -0,0 +1,98 @@
+#include <stdlib.h>
+
+#include "algorithm.h"
+#include "state.h"
+
+#include "log.h"
+
+static const Algorithm *m_algorithms[ALGO_MAX] = {0};
+
+static int _index(unsigned int flag) {
+    if (!flag || (flag & (flag - 1))) {
+        return -1; // none or more than one bit
+    }
+    return __builtin_ctz(flag);
+}
+
+static bool _added(const Algorithm **active, size_t len, unsigned int flag) {
+    for (size_t i = 0; i < len; i++) {
+        if (active[i]->flag == flag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// --- public
+
+/**
+ * Registers an algorithm for its state->algorithms bit, replacing a previous registration.
+ * Registration happens on startup, before the simulation thread runs.
+ */
+void algo_register(const Algorithm *algo) {
+    EXIT_IF(algo == NULL, "no algorithm");
+
+    int index = _index(algo->flag);
+    EXIT_IF_F(index < 0 || index >= ALGO_MAX, "invalid flag %u of algorithm '%s'", algo->flag, algo->name);
+
+    m_algorithms[index] = algo;
+}
+
+/**
+ * Registers the algorithms in src/algorithms/, called by state_create()
+ */
+void algo_register_builtin() {
+    algo_register(&algo_default);
+    algo_register(&algo_nomadic);
+    algo_register(&algo_barnes_hut);
+    algo_register(&algo_direct);
+    algo_register(&algo_fmm);
+}
+
+const Algorithm *algo_get(unsigned int flag) {
+    int index = _index(flag);
+    return (index < 0 || index >= ALGO_MAX) ? NULL : m_algorithms[index];
+}
+
+/**
+ * Resolves the algorithms enabled in state->algorithms in bit order, returns the count.
+ * ALGO_NONE (default) only runs on its own, Barnes-Hut and fast multipole are replaced by direct summation below state->direct_max borticles,
+ * fast multipole by Barnes-Hut in 3D.
+ */
+size_t algo_active(State *state, const Algorithm **active, size_t max) {
+    size_t len = 0;
+
+    for (int i = 0; i < ALGO_MAX && len < max; i++) {
+        const Algorithm *algo = m_algorithms[i];
+        if (!algo || !(state->algorithms & algo->flag)) {
+            continue;
+        }
+        if (algo->flag == ALGO_NONE && state->algorithms != ALGO_NONE) {
+            continue;
+        }
+        if (algo->flag == ALGO_FMM && state->dims == 3 && m_algorithms[_index(ALGO_BARNES_HUT)]) {
+            algo = m_algorithms[_index(ALGO_BARNES_HUT)]; // 2D only
+        }
+        if ((algo->flag == ALGO_BARNES_HUT || algo->flag == ALGO_FMM) && state->pop_len < state->direct_max && m_algorithms[_index(ALGO_DIRECT)]) {
+            algo = m_algorithms[_index(ALGO_DIRECT)];
+        }
+        if (_added(active, len, algo->flag)) {
+            continue;
+        }
+        active[len++] = algo;
+    }
+
+    return len;
+}
+
+unsigned int algo_requires(const Algorithm **active, size_t len) {
+    unsigned int requires = 0;
+    for (size_t i = 0; i < len; i++) {
+        requires |= active[i]->requires;
+    }
+    return requires;
+}
+
+float *algo_param(State *state, const AlgoParam *param) {
+    return (float*) ((char*) state + param->offset);
+}
@@ -0,0 +1,74 @@
+#ifndef __ALGORITHM_H__
+#define __ALGORITHM_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "rng.h"
+
+typedef struct State State;
+typedef struct Borticle Borticle;
+
+////
+// Algorithm registry
+//
+// An algorithm is a module in src/algorithms/ exporting a const Algorithm, registered on startup.
+// Per step the active algorithms are resolved once, then each runs
+//   prepare() -> update() over ranges of the population -> finish()
+// Handlers may be NULL. update() of parallel algorithms is split over worker threads (@see parallel.h).
+////
+
+#define ALGO_MAX 32 // one per state->algorithms bit
+#define ALGO_PARAMS_MAX 4
+#define ALGO_BATCH 256 // borticles per parallel update() range
+
+/**
+ * Structures built by the step pipeline before the handlers run, only if an active algorithm requires them
+ */
+typedef enum {
+    ALGO_REQUIRES_QTREE = 1 << 0, // state->tree
+} AlgoRequirement;
+
+/**
+ * Tunable float field of State
+ */
+typedef struct AlgoParam {
+    const char *name;
+    size_t offset; // offsetof(State, <field>)
+    float min, max;
+} AlgoParam;
+
+typedef struct Algorithm {
+    const char *name;
+    unsigned int flag; // Algotithm bit
+    unsigned int requires; // AlgoRequirement bits
+
+    AlgoParam params[ALGO_PARAMS_MAX];
+    size_t params_len;
+
+    bool parallel; // update() may run concurrently on disjoint ranges
+
+    void (*init)(State *state, Borticle *bort, size_t index, Rng *rng); // called per new borticle
+    void (*prepare)(State *state);                                       // per step setup
+    void (*update)(State *state, size_t start, size_t end);              // per step, range of the population
+    void (*finish)(State *state);                                        // per step teardown
+} Algorithm;
+
+extern const Algorithm algo_default;
+extern const Algorithm algo_nomadic;
+extern const Algorithm algo_barnes_hut;
+void barnes_hut_stats(unsigned long *visits, unsigned long *interactions);
+extern const Algorithm algo_direct;
+extern const Algorithm algo_fmm;
+void fmm_stats(unsigned long *m2l, unsigned long *p2p);
+
+void algo_register(const Algorithm *algo);
+void algo_register_builtin();
+
+const Algorithm *algo_get(unsigned int flag);
+size_t algo_active(State *state, const Algorithm **active, size_t max);
+unsigned int algo_requires(const Algorithm **active, size_t len);
+
+float *algo_param(State *state, const AlgoParam *param);
+
+#endif
@@ -1,124 +1,1057 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
 #include "borticle.h"
 #include "qtree/qtree.h"
+#include "qtree/otree.h"
 #include "state.h"
+#include "algorithm.h"
+#include "gravity.h"
+#include "parallel.h"
+
+#include "utils.h"
+#include "log.h"
+#include "profiler.h"
+
+////
+// Barnes-Hut gravity
+//
+// Per step:
+//   prepare: aggregate node masses and second moments, gather the population into structure of arrays (Bodies)
+//   update:  per body, collect the accepted nodes (interaction list), then sum their accelerations
+//            in a branch free loop over contiguous arrays
+//            bodies are split into one cost zone per thread: consecutive in tree order, with equal sums
+//            of the node visits they had in the previous step (clustered regions cost far more per body)
+//   finish:  leapfrog integration, scatter back into the population (@see gravity.h)
+//
+// With state->bh_quadrupole accepted nodes add their quadrupole term, which allows a larger theta for the same accuracy
+// With state->bh_reuse the tree is walked once per group (subtree of up to BH_GROUP borticles) for all of its members,
+// the lists hold node pointers and are reused on the refit tree (fresh masses and moments, same opening decisions)
+// until bh_reuse steps passed or a borticle moved further than bh_reuse_drift
+// With state->bh_far_every (per borticle walks) the walk runs every bh_far_every steps only: the sum of its accepted nodes
+// (far field) is cached per body, the leaves it reached (near field) are kept as population indices and summed on every step
+// In 3D (state->dims) the same walk runs on the octree, monopoles only
+//
+// @see https://www.cs.princeton.edu/courses/archive/fall03/cs126/assignments/barnes-hut.html
+////
+
+/**
+ * Accepted nodes (or leaves) for one body, with traceless quadrupole tensors if collected with quadrupoles
+ */
+typedef struct Interactions {
+    size_t len;
+    size_t max;
+    float *x, *y, *z, *m;
+    float *qxx, *qxy, *qyy;
+} Interactions;
+
+// scratch, filled from the population on every step
+static Bodies m_bodies = {0};
+
+/**
+ * Partition of the population into zones of equal cost
+ */
+typedef struct CostZones {
+    size_t len; // population length the costs were recorded for
+    size_t max;
+    unsigned int *cost;  // node visits per body (population index) in the previous step
+    unsigned int *order; // population indices in tree order
+    bool *placed;        // in order[]
+    size_t zones[PARALLEL_MAX_THREADS + 1]; // zone z: order[zones[z]] .. order[zones[z + 1] - 1]
+    size_t zones_len;
+} CostZones;
+
+static CostZones m_zones = {0};
+
+#define BH_GROUP 16 // max borticles per group sharing an interaction list
+#define BH_GROUP_BATCH 8 // groups per parallel range
+
+/**
+ * Subtree of up to BH_GROUP borticles and the nodes acting on all of them
+ */
+typedef struct Group {
+    QNode *node;
+    size_t len; // members, their leaves lead points[]
+    QNode **points; // leaves and monopole nodes
+    size_t points_len, points_max;
+    QNode **cells;  // nodes with quadrupoles
+    size_t cells_len, cells_max;
+    unsigned long visits; // of the walk building the lists
+} Group;
+
+typedef struct GroupLists {
+    Group *groups;
+    size_t len, max;
+    unsigned int *loose; // bodies without a leaf (outside of the tree bounds), walked per body
+    size_t loose_len;
+    bool *placed;
+    float *anchor_x, *anchor_y; // positions the lists were built for
+    size_t bodies_max;
+    unsigned int age; // steps the lists were used
+    bool fresh;       // (re)build in this step
+    float theta;      // opening parameters the lists were collected with
+    bool quadrupole;
+} GroupLists;
+
+static GroupLists m_groups = {0};
+
+// scratch interaction lists per worker thread, kept over the steps (the pool threads are persistent)
+static _Thread_local Interactions m_points = {0};
+static _Thread_local Interactions m_cells = {0};
+
+/**
+ * Population indices of the leaves reached by the walks of one cost zone
+ */
+typedef struct NearList {
+    unsigned int *index;
+    size_t len, max;
+} NearList;
+
+/**
+ * Multi-rate split of the per body walks, valid as long as the cost zones are not rebuilt
+ */
+typedef struct FarField {
+    size_t len; // population length of the cache
+    size_t max;
+    float *ax, *ay; // far field acceleration (without G) per body
+    unsigned int *near_start, *near_len; // per body: range in near[zone]
+    NearList near[PARALLEL_MAX_THREADS];
+    unsigned long built; // step of the last walk
+    unsigned long step;  // step of the last update
+    float theta;
+    bool quadrupole;
+    float softening; // of the cached far field
+    bool walk; // in this step
+} FarField;
+
+static FarField m_far = {0};
+
+// counters of the last step, summed over the worker threads
+static atomic_ulong m_visits = 0;
+static atomic_ulong m_interactions = 0;
+
+static float *_realloc_floats(float *ptr, size_t len) {
+    ptr = realloc(ptr, len * sizeof(float));
+    EXIT_IF(ptr == NULL, "failed to (re)allocate for Interactions");
+    return ptr;
+}
+
+static void _interactions_grow(Interactions *list) {
+    list->max = (list->max) ? list->max * 2 : 256;
+    list->x = _realloc_floats(list->x, list->max);
+    list->y = _realloc_floats(list->y, list->max);
+    list->z = _realloc_floats(list->z, list->max);
+    list->m = _realloc_floats(list->m, list->max);
+    list->qxx = _realloc_floats(list->qxx, list->max);
+    list->qxy = _realloc_floats(list->qxy, list->max);
+    list->qyy = _realloc_floats(list->qyy, list->max);
+}
+
+static void _interactions_push(Interactions *list, vec2 pos, float mass) {
+    if (list->len >= list->max) {
+        _interactions_grow(list);
+    }
+    list->x[list->len] = pos.x;
+    list->y[list->len] = pos.y;
+    list->m[list->len] = mass;
+    list->len++;
+}
+
+/**
+ * Pushes a node with the traceless quadrupole Q = sum(m * (3 * d * d^T - |d|^2 * I)) of its second moments (in plane, Qzz is not needed)
+ */
+static void _interactions_push_node(Interactions *list, QNode *node) {
+    if (list->len >= list->max) {
+        _interactions_grow(list);
+    }
+    list->qxx[list->len] = 2.f * node->qxx - node->qyy;
+    list->qxy[list->len] = 3.f * node->qxy;
+    list->qyy[list->len] = 2.f * node->qyy - node->qxx;
+    _interactions_push(list, node->com, node->mass);
+}
+
+static void _interactions_push_3d(Interactions *list, vec3_t pos, float mass) {
+    if (list->len >= list->max) {
+        _interactions_grow(list);
+    }
+    list->x[list->len] = pos.x;
+    list->y[list->len] = pos.y;
+    list->z[list->len] = pos.z;
+    list->m[list->len] = mass;
+    list->len++;
+}
+
+static void _collect_entries(QNode *leaf, const Borticle *self, Interactions *points) {
+    for (QNode *entry = qnode_entries(leaf); entry; entry = entry->next) {
+        if (entry->data != self) {
+            _interactions_push(points, entry->pos, entry->mass);
+        }
+    }
+}
+
+/**
+ * Collects the nodes acting on a body: a node is accepted if size / distance < theta
+ * and the body is not inside it, otherwise its children are visited.
+ * Leaves go to points, accepted nodes to cells if given (quadrupole), otherwise also to points (monopole).
+ * Leaf buckets are accepted like nodes if buckets is set (fresh tree: a body is inside of its own leaf), otherwise go to points per entry.
+ */
+static unsigned long _collect(QNode *node, const Borticle *self, float x, float y, float theta2, bool buckets, Interactions *points, Interactions *cells) {
+    if (!node || node->mass <= 0.f) {
+        return 0;
+    }
+
+    bool leaf = qnode_isleaf(node);
+    if (leaf && (!node->bucket || !buckets)) {
+        _collect_entries(node, self, points);
+        return 1;
+    }
+
+    float dx = node->com.x - x;
+    float dy = node->com.y - y;
+    float size = node->self_se.x - node->self_nw.x;
+
+    bool inside = x >= node->self_nw.x && x <= node->self_se.x && y >= node->self_nw.y && y <= node->self_se.y;
+    if (!inside && size * size < theta2 * (dx * dx + dy * dy)) {
+        if (cells) {
+            _interactions_push_node(cells, node);
+        } else {
+            _interactions_push(points, node->com, node->mass);
+        }
+        return 1;
+    }
+
+    if (leaf) {
+        _collect_entries(node, self, points);
+        return 1;
+    }
+
+    return 1
+        + _collect(node->nw, self, x, y, theta2, buckets, points, cells)
+        + _collect(node->ne, self, x, y, theta2, buckets, points, cells)
+        + _collect(node->sw, self, x, y, theta2, buckets, points, cells)
+        + _collect(node->se, self, x, y, theta2, buckets, points, cells);
+}
+
+/**
+ * _collect() on the octree
+ */
+static unsigned long _collect_3d(ONode *node, const Borticle *self, vec3_t pos, float theta2, Interactions *points) {
+    if (!node || node->mass <= 0.f) {
+        return 0;
+    }
+
+    // a bucket is accepted as a whole like a node if far enough (the octree is rebuilt every step, a body is inside of its own leaf)
+    bool leaf = onode_isleaf(node);
+    if (leaf && !node->bucket) {
+        if (node->data != self) {
+            _interactions_push_3d(points, node->com, node->mass);
+        }
+        return 1;
+    }
+
+    float dx = node->com.x - pos.x;
+    float dy = node->com.y - pos.y;
+    float dz = node->com.z - pos.z;
+    float size = node->self_max.x - node->self_min.x;
+
+    bool inside = pos.x >= node->self_min.x && pos.x <= node->self_max.x
+        && pos.y >= node->self_min.y && pos.y <= node->self_max.y
+        && pos.z >= node->self_min.z && pos.z <= node->self_max.z;
+    if (!inside && size * size < theta2 * (dx * dx + dy * dy + dz * dz)) {
+        _interactions_push_3d(points, node->com, node->mass);
+        return 1;
+    }
+
+    if (leaf) {
+        for (ONode *entry = onode_entries(node); entry; entry = entry->next) {
+            if (entry->data != self) {
+                _interactions_push_3d(points, entry->pos, entry->mass);
+            }
+        }
+        return 1;
+    }
+
+    unsigned long visits = 1;
+    for (int i = 0; i < OCT_CHILDREN; i++) {
+        visits += _collect_3d(node->children[i], self, pos, theta2, points);
+    }
+    return visits;
+}
+
+static void _near_push(NearList *near, unsigned int i) {
+    if (near->len >= near->max) {
+        near->max = (near->max) ? near->max * 2 : 1024;
+        near->index = realloc(near->index, near->max * sizeof(unsigned int));
+        EXIT_IF(near->index == NULL, "failed to (re)allocate for NearList");
+    }
+    near->index[near->len++] = i;
+}
+
+static void _collect_near(QNode *leaf, const Borticle *self, const Borticle *population, NearList *near) {
+    for (QNode *entry = qnode_entries(leaf); entry; entry = entry->next) {
+        if (entry->data != self) {
+            _near_push(near, (unsigned int) ((const Borticle*) entry->data - population));
+        }
+    }
+}
+
+/**
+ * _collect() for the multi-rate split: leaves go to near (population indices), accepted nodes always to cells
+ */
+static unsigned long _collect_split(QNode *node, const Borticle *self, const Borticle *population, float x, float y, float theta2, bool buckets, NearList *near, Interactions *cells) {
+    if (!node || node->mass <= 0.f) {
+        return 0;
+    }
+
+    bool leaf = qnode_isleaf(node);
+    if (leaf && (!node->bucket || !buckets)) {
+        _collect_near(node, self, population, near);
+        return 1;
+    }
+
+    float dx = node->com.x - x;
+    float dy = node->com.y - y;
+    float size = node->self_se.x - node->self_nw.x;
+
+    bool inside = x >= node->self_nw.x && x <= node->self_se.x && y >= node->self_nw.y && y <= node->self_se.y;
+    if (!inside && size * size < theta2 * (dx * dx + dy * dy)) {
+        _interactions_push_node(cells, node);
+        return 1;
+    }
+
+    if (leaf) {
+        _collect_near(node, self, population, near);
+        return 1;
+    }
+
+    return 1
+        + _collect_split(node->nw, self, population, x, y, theta2, buckets, near, cells)
+        + _collect_split(node->ne, self, population, x, y, theta2, buckets, near, cells)
+        + _collect_split(node->sw, self, population, x, y, theta2, buckets, near, cells)
+        + _collect_split(node->se, self, population, x, y, theta2, buckets, near, cells);
+}
+
+/**
+ * Softened acceleration (without G) at x,y from the point masses (monopoles) list[start .. end - 1]
+ */
+static vec2 _accelerate_range(const Interactions *list, size_t start, size_t end, float x, float y, float eps2) {
+    const float *lx = list->x;
+    const float *ly = list->y;
+    const float *lm = list->m;
+    float ax = 0.f;
+    float ay = 0.f;
+
+    for (size_t k = start; k < end; k++) {
+        float dx = lx[k] - x;
+        float dy = ly[k] - y;
+        float r2 = dx * dx + dy * dy + eps2;
+        float inv = 1.f / sqrtf(r2);
+        float s = (r2 > 0.f) ? lm[k] * inv * inv * inv : 0.f; // coincident (bucket entries without softening)
+        ax += dx * s;
+        ay += dy * s;
+    }
+
+    return (vec2) {ax, ay};
+}
+
+static vec2 _accelerate(const Interactions *list, float x, float y, float eps2) {
+    return _accelerate_range(list, 0, list->len, x, y, eps2);
+}
 
 /**
- * Applies Newton's law of universal gravitation
- *
- * @see https://en.wikipedia.org/wiki/Newton%27s_law_of_universal_gravitation
+ * Softened acceleration (without G) at x,y from the bodies at the given (population) indices, at their current positions
  */
-static float _calculate_gravitational_force(float mass1, float mass2, float radius, float grav_const) {
-    if (fabsf(radius) == 0.f) {
-        return 0.f;
+static vec2 _accelerate_near(const Bodies *bodies, const unsigned int *index, size_t len, float x, float y, float eps2) {
+    float ax = 0.f;
+    float ay = 0.f;
+
+    for (size_t k = 0; k < len; k++) {
+        size_t j = index[k];
+        float dx = bodies->x[j] - x;
+        float dy = bodies->y[j] - y;
+        float r2 = dx * dx + dy * dy + eps2;
+        float inv = 1.f / sqrtf(r2);
+        float s = (r2 > 0.f) ? bodies->m[j] * inv * inv * inv : 0.f; // coincident (bucket entries without softening)
+        ax += dx * s;
+        ay += dy * s;
     }
-    return grav_const * ((mass1 * mass2) / (radius * radius));
+
+    return (vec2) {ax, ay};
+}
+
+/**
+ * _accelerate() in 3D
+ */
+static vec3_t _accelerate_3d(const Interactions *list, vec3_t pos, float eps2) {
+    const float *lx = list->x;
+    const float *ly = list->y;
+    const float *lz = list->z;
+    const float *lm = list->m;
+    vec3_t acc = {0.f, 0.f, 0.f};
+
+    for (size_t k = 0; k < list->len; k++) {
+        float dx = lx[k] - pos.x;
+        float dy = ly[k] - pos.y;
+        float dz = lz[k] - pos.z;
+        float r2 = dx * dx + dy * dy + dz * dz + eps2;
+        float inv = 1.f / sqrtf(r2);
+        float s = (r2 > 0.f) ? lm[k] * inv * inv * inv : 0.f; // coincident (bucket entries without softening)
+        acc.x += dx * s;
+        acc.y += dy * s;
+        acc.z += dz * s;
+    }
+
+    return acc;
 }
 
 /**
- * Compute the forces excerted on the particles, using the Barnes-Hut Approximation
- * @see https://www.cs.princeton.edu/courses/archive/fall03/cs126/assignments/barnes-hut.html
+ * Softened acceleration (without G) at x,y from monopole + quadrupole terms, d = com - (x,y):
+ *   a = m * d / r^3 - Q * d / r^5 + 5/2 * (d^T * Q * d) * d / r^7
  */
-static void _calculate_force(Borticle *bort, QNode *node, vec2 *delta, float theta, float grav_g, int *count) {
-    float force = 0.f;
+static vec2 _accelerate_quadrupole(const Interactions *list, float x, float y, float eps2) {
+    const float *lx = list->x;
+    const float *ly = list->y;
+    const float *lm = list->m;
+    const float *qxx = list->qxx;
+    const float *qxy = list->qxy;
+    const float *qyy = list->qyy;
+    float ax = 0.f;
+    float ay = 0.f;
+
+    for (size_t k = 0; k < list->len; k++) {
+        float dx = lx[k] - x;
+        float dy = ly[k] - y;
+        float r2 = dx * dx + dy * dy + eps2;
+        float inv = (r2 > 0.f) ? 1.f / sqrtf(r2) : 0.f; // coincident (bucket entries without softening)
+        float inv2 = inv * inv;
+        float inv3 = inv * inv2;
+        float inv5 = inv3 * inv2;
+
+        float qdx = qxx[k] * dx + qxy[k] * dy;
+        float qdy = qxy[k] * dx + qyy[k] * dy;
+        float dqd = dx * qdx + dy * qdy;
+
+        float s = lm[k] * inv3 + 2.5f * dqd * inv5 * inv2;
+        ax += dx * s - qdx * inv5;
+        ay += dy * s - qdy * inv5;
+    }
+
+    return (vec2) {ax, ay};
+}
+
+static void _zones_reserve(CostZones *cz, size_t len) {
+    if (len > cz->max) {
+        cz->cost = realloc(cz->cost, len * sizeof(unsigned int));
+        cz->order = realloc(cz->order, len * sizeof(unsigned int));
+        cz->placed = realloc(cz->placed, len * sizeof(bool));
+        EXIT_IF(!cz->cost || !cz->order || !cz->placed, "failed to (re)allocate for CostZones");
+        cz->max = len;
+    }
 
-    if(!bort || !node) {
+    // unknown costs: uniform
+    if (len != cz->len) {
+        for (size_t i = 0; i < len; i++) {
+            cz->cost[i] = 1;
+        }
+        cz->len = len;
+    }
+}
+
+static void _zones_place(CostZones *cz, size_t *n, const Borticle *bort, const Borticle *population) {
+    size_t i = (size_t) (bort - population);
+    if (!cz->placed[i]) {
+        cz->placed[i] = true;
+        cz->order[(*n)++] = (unsigned int) i;
+    }
+}
+
+/**
+ * Appends the leaves in tree (Morton) order
+ */
+static void _zones_order(CostZones *cz, size_t *n, QNode *node, const Borticle *population) {
+    if (!node) {
         return;
     }
+    if (qnode_isleaf(node)) {
+        for (QNode *entry = qnode_entries(node); entry; entry = entry->next) {
+            _zones_place(cz, n, entry->data, population);
+        }
+        return;
+    }
+    _zones_order(cz, n, node->nw, population);
+    _zones_order(cz, n, node->ne, population);
+    _zones_order(cz, n, node->sw, population);
+    _zones_order(cz, n, node->se, population);
+}
 
-    Borticle *targ = (Borticle*) node->data;
-    if (targ && bort->id == targ->id) {
+static void _zones_order_3d(CostZones *cz, size_t *n, ONode *node, const Borticle *population) {
+    if (!node) {
+        return;
+    }
+    if (onode_isleaf(node)) {
+        for (ONode *entry = onode_entries(node); entry; entry = entry->next) {
+            _zones_place(cz, n, entry->data, population);
+        }
         return;
     }
+    for (int i = 0; i < OCT_CHILDREN; i++) {
+        _zones_order_3d(cz, n, node->children[i], population);
+    }
+}
 
-    // calculate distance
-    vec2 sub = (vec2) {bort->pos.x - node->com.x, bort->pos.y - node->com.y};
-    float radius = sqrtf(sub.x * sub.x + sub.y * sub.y);
+/**
+ * Orders the population along the tree and cuts it into one zone per thread with equal summed costs.
+ * Bodies not in the tree (outside of the bounds) go last.
+ */
+static void _zones_build(CostZones *cz, State *state) {
+    size_t len = state->pop_len;
+    size_t n = 0;
+
+    _zones_reserve(cz, len);
+    memset(cz->placed, 0, len * sizeof(bool));
 
-    // leaf nodes: direct comparsion (node->mass == bort->size);
-    if (targ) {
-        force = _calculate_gravitational_force(bort->size, targ->size, radius, grav_g);
-        delta->x += (bort->pos.x < targ->pos.x) ? force : -force;
-        delta->y += (bort->pos.y < targ->pos.y) ? force : -force;
-       return;
+    if (state->dims == 3 && state->otree) {
+        _zones_order_3d(cz, &n, state->otree->root, state->population);
+    } else if (state->dims != 3 && state->tree) {
+        _zones_order(cz, &n, state->tree->root, state->population);
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!cz->placed[i]) {
+            cz->order[n++] = (unsigned int) i;
+        }
     }
 
-    // check if we can use the node mass for far away regions
-    float height = node->self_se.y - node->self_nw.y;
-    float res = (radius == 0.f) ? 0.f : (height / radius); // using node height
+    unsigned long total = 0;
+    for (size_t i = 0; i < len; i++) {
+        total += cz->cost[i];
+    }
 
-    // far away nodes: use center of mass and skip child nodes
-    if (res < theta) {
-        force = _calculate_gravitational_force(bort->size, node->mass, radius, grav_g) ;
-        delta->x += (bort->pos.x < node->com.x) ? force : -force;
-        delta->y += (bort->pos.y < node->com.y) ? force : -force;
-        return;
+    size_t zones = parallel_threads();
+    unsigned long sum = 0;
+    size_t k = 0;
+
+    cz->zones[0] = 0;
+    for (size_t z = 1; z < zones; z++) {
+        unsigned long target = total * z / zones;
+        while (k < len && sum < target) {
+            sum += cz->cost[cz->order[k++]];
+        }
+        cz->zones[z] = k;
     }
+    cz->zones[zones] = len;
+    cz->zones_len = zones;
+}
 
-    // nearby nodes: traverse into child nodes
-    _calculate_force(bort, node->ne, delta, theta, grav_g, count);
-    _calculate_force(bort, node->nw, delta, theta, grav_g, count);
-    _calculate_force(bort, node->sw, delta, theta, grav_g, count);
-    _calculate_force(bort, node->se, delta, theta, grav_g, count);
+static void _node_ptrs_push(QNode ***list, size_t *len, size_t *max, QNode *node) {
+    if (*len >= *max) {
+        *max = (*max) ? *max * 2 : 64;
+        *list = realloc(*list, *max * sizeof(QNode*));
+        EXIT_IF(*list == NULL, "failed to (re)allocate for Group");
+    }
+    (*list)[(*len)++] = node;
 }
 
-static void _update_size(State *state, Borticle *bort, size_t index) {}
+static Group *_groups_push(GroupLists *gl, QNode *node) {
+    if (gl->len >= gl->max) {
+        size_t max = (gl->max) ? gl->max * 2 : 256;
+        gl->groups = realloc(gl->groups, max * sizeof(Group));
+        EXIT_IF(gl->groups == NULL, "failed to (re)allocate for GroupLists");
+        memset(gl->groups + gl->max, 0, (max - gl->max) * sizeof(Group));
+        gl->max = max;
+    }
+    Group *g = &gl->groups[gl->len++];
+    g->node = node;
+    g->len = 0;
+    g->points_len = 0;
+    g->cells_len = 0;
+    g->visits = 0;
+    return g;
+}
 
-static void _update_position(State *state, Borticle *bort, size_t index) {
-    if(!bort || !state->tree) {
-        return;
+/**
+ * Returns the borticles below node, the largest subtrees of up to BH_GROUP become groups
+ */
+static size_t _groups_find(GroupLists *gl, QNode *node) {
+    if (!node || qnode_isempty(node)) {
+        return 0;
+    }
+    if (qnode_isleaf(node)) {
+        return node->count;
     }
 
-    int count = 0;
-    vec2 delta = {0.f};
-    _calculate_force(bort, state->tree->root, &delta, state->bh_theta, state->grav_g, &count);
+    QNode *child[4] = {node->nw, node->ne, node->sw, node->se};
+    size_t count[4];
+    size_t len = 0;
+    for (int i = 0; i < 4; i++) {
+        count[i] = _groups_find(gl, child[i]);
+        len += count[i];
+    }
 
-    bort->pos.x += delta.x;
-    bort->pos.y += delta.y;
-    // printf("(%d), {%f, %f} => {%f, %f} (%d)\n", bort->id, bort->pos.x, bort->pos.y, delta.x, delta.y, count);
+    if (len > BH_GROUP) {
+        for (int i = 0; i < 4; i++) {
+            if (count[i] && count[i] <= BH_GROUP) {
+                _groups_push(gl, child[i]);
+            }
+        }
+    }
+    return len;
 }
 
-static void _update_color(State *state, Borticle *bort, size_t index) {}
+/**
+ * Pushes the leaf entries of the group subtree (members) to points
+ */
+static void _group_members(Group *g, QNode *node, const Borticle *population, bool *placed) {
+    if (!node) {
+        return;
+    }
+    if (qnode_isleaf(node)) {
+        for (QNode *entry = qnode_entries(node); entry; entry = entry->next) {
+            _node_ptrs_push(&g->points, &g->points_len, &g->points_max, entry);
+            placed[(const Borticle*) entry->data - population] = true;
+            g->len++;
+        }
+        return;
+    }
+    _group_members(g, node->nw, population, placed);
+    _group_members(g, node->ne, population, placed);
+    _group_members(g, node->sw, population, placed);
+    _group_members(g, node->se, population, placed);
+}
+
+/**
+ * Collects the nodes acting on every point of the group box: accepted if size / (distance of the com to the box) < theta
+ * and the node does not overlap the box, the group's own subtree is skipped (members lead points)
+ */
+static void _group_collect(Group *g, QNode *node, float theta2, bool quadrupole) {
+    if (!node || node->mass <= 0.f || node == g->node) {
+        return;
+    }
+    g->visits++;
+
+    bool leaf = qnode_isleaf(node);
+    if (leaf && !node->bucket) {
+        _node_ptrs_push(&g->points, &g->points_len, &g->points_max, node);
+        return;
+    }
+
+    vec2 min = g->node->self_nw;
+    vec2 max = g->node->self_se;
+    float dx = fmaxf(fmaxf(min.x - node->com.x, node->com.x - max.x), 0.f);
+    float dy = fmaxf(fmaxf(min.y - node->com.y, node->com.y - max.y), 0.f);
+    float size = node->self_se.x - node->self_nw.x;
+
+    bool overlaps = node->self_nw.x <= max.x && node->self_se.x >= min.x && node->self_nw.y <= max.y && node->self_se.y >= min.y;
+    if (!overlaps && size * size < theta2 * (dx * dx + dy * dy)) {
+        if (quadrupole) {
+            _node_ptrs_push(&g->cells, &g->cells_len, &g->cells_max, node);
+        } else {
+            _node_ptrs_push(&g->points, &g->points_len, &g->points_max, node);
+        }
+        return;
+    }
 
-void bort_init_barnes_hut(State *state, Borticle *bort, size_t index) {
-    // state is required and wont be tested here
-    if (!bort) {
+    // buckets close by: per entry (members are never in another group's leaf)
+    if (leaf) {
+        for (QNode *entry = node->bucket; entry; entry = entry->next) {
+            _node_ptrs_push(&g->points, &g->points_len, &g->points_max, entry);
+        }
         return;
     }
 
-    bort->color = (rgba) {
-        rand_range_f(0.f, 1.f),
-        rand_range_f(0.f, 1.f),
-        rand_range_f(0.f, 1.f),
-        1.f
-    };
+    _group_collect(g, node->nw, theta2, quadrupole);
+    _group_collect(g, node->ne, theta2, quadrupole);
+    _group_collect(g, node->sw, theta2, quadrupole);
+    _group_collect(g, node->se, theta2, quadrupole);
+}
 
-    bort->pos = (vec3_t) {
-        rand_range_f(0.f, (float)state->width),
-        rand_range_f(0.f, (float)state->height),
-        0.f
-    };
+/**
+ * Splits the fresh tree into groups, bodies not reached through a leaf are walked per body.
+ * Group lists are collected in parallel by update()
+ */
+static void _groups_build(GroupLists *gl, State *state) {
+    size_t n = state->pop_len;
+
+    if (n > gl->bodies_max) {
+        gl->loose = realloc(gl->loose, n * sizeof(unsigned int));
+        gl->placed = realloc(gl->placed, n * sizeof(bool));
+        gl->anchor_x = realloc(gl->anchor_x, n * sizeof(float));
+        gl->anchor_y = realloc(gl->anchor_y, n * sizeof(float));
+        EXIT_IF(!gl->loose || !gl->placed || !gl->anchor_x || !gl->anchor_y, "failed to (re)allocate for GroupLists");
+        gl->bodies_max = n;
+    }
+
+    gl->len = 0;
+    QNode *root = (state->tree) ? state->tree->root : NULL;
+    if (_groups_find(gl, root) <= BH_GROUP && root && !qnode_isempty(root)) {
+        _groups_push(gl, root);
+    }
 
-    bort->vel = (vec3_t) {
-        rand_range_f(-1.f, 1.f),
-        rand_range_f(-1.f, 1.f),
-        0.f
-    };
+    memset(gl->placed, 0, n * sizeof(bool));
+    for (size_t k = 0; k < gl->len; k++) {
+        _group_members(&gl->groups[k], gl->groups[k].node, state->population, gl->placed);
+    }
+
+    gl->loose_len = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!gl->placed[i]) {
+            gl->loose[gl->loose_len++] = (unsigned int) i;
+        }
+    }
+
+    memcpy(gl->anchor_x, m_bodies.x, n * sizeof(float));
+    memcpy(gl->anchor_y, m_bodies.y, n * sizeof(float));
+    gl->age = 0;
+    gl->fresh = true;
+    gl->theta = state->bh_theta;
+    gl->quadrupole = state->bh_quadrupole;
+}
+
+/**
+ * Walks the tree for the groups if the lists are fresh, then sums the (current) node values for all members,
+ * excluding the own leaf
+ */
+static void _group_batch(void *ctx, size_t start, size_t end) {
+    State *state = (State*) ctx;
+    GroupLists *gl = &m_groups;
+    Bodies *bodies = &m_bodies;
+    Interactions *points = &m_points;
+    Interactions *cells = &m_cells;
+    unsigned long visits = 0;
+    unsigned long interactions = 0;
 
-    bort->acc = (vec3_t) {
-        rand_range_f(0.1f, 1.f),
-        rand_range_f(0.1f, 1.f),
-        0.f
-    };
+    float theta2 = state->bh_theta * state->bh_theta;
+    float eps2 = state->softening * state->softening;
+
+    for (size_t k = start; k < end; k++) {
+        Group *g = &gl->groups[k];
+        if (gl->fresh) {
+            g->points_len = g->len;
+            g->cells_len = 0;
+            g->visits = 0;
+            _group_collect(g, state->tree->root, theta2, state->bh_quadrupole);
+            visits += g->visits;
+        }
+
+        points->len = 0;
+        cells->len = 0;
+        for (size_t p = 0; p < g->points_len; p++) {
+            _interactions_push(points, g->points[p]->com, g->points[p]->mass);
+        }
+        for (size_t c = 0; c < g->cells_len; c++) {
+            _interactions_push_node(cells, g->cells[c]);
+        }
+
+        for (size_t m = 0; m < g->len; m++) {
+            size_t i = (size_t) ((Borticle*) g->points[m]->data - state->population);
+            float x = bodies->x[i];
+            float y = bodies->y[i];
+
+            vec2 acc = _accelerate_range(points, 0, m, x, y, eps2);
+            vec2 rest = _accelerate_range(points, m + 1, points->len, x, y, eps2);
+            acc.x += rest.x;
+            acc.y += rest.y;
+            if (cells->len) {
+                vec2 far = _accelerate_quadrupole(cells, x, y, eps2);
+                acc.x += far.x;
+                acc.y += far.y;
+            }
+            bodies->ax[i] = acc.x * state->grav_g;
+            bodies->ay[i] = acc.y * state->grav_g;
+            bodies->az[i] = 0.f;
+            interactions += points->len - 1 + cells->len;
+        }
+    }
+
+    atomic_fetch_add_explicit(&m_visits, visits, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m_interactions, interactions, memory_order_relaxed);
+}
+
+/**
+ * After integration: keep the lists (and the tree topology) for the next step unless they are too old or borticles moved too far
+ */
+static void _groups_age(GroupLists *gl, State *state) {
+    Bodies *bodies = &m_bodies;
+    float drift2 = state->bh_reuse_drift * state->bh_reuse_drift;
+    bool keep = ++gl->age < state->bh_reuse;
+
+    for (size_t i = 0; i < bodies->len && keep; i++) {
+        float dx = bodies->x[i] - gl->anchor_x[i];
+        float dy = bodies->y[i] - gl->anchor_y[i];
+        keep = dx * dx + dy * dy <= drift2;
+    }
+
+    state->tree_refit = keep;
+}
+
+static bool _grouped(State *state) {
+    return state->bh_reuse > 0 && state->dims == 2;
+}
 
-    bort->size = rand_range_f(0.1f, 6.f);
+static bool _multirate(State *state) {
+    return state->bh_far_every > 1 && state->dims == 2 && !_grouped(state);
 }
 
-void bort_update_barnes_hut(State *state, Borticle *bort, size_t index) {
-    // sstate is required and wont be tested here
-    if(!bort) {
+/**
+ * Decides whether this step walks the tree (and rebuilds the cost zones): every bh_far_every steps,
+ * or if the cache does not belong to the previous step, population, walk parameters or softening
+ */
+static void _far_prepare(FarField *ff, State *state) {
+    size_t n = state->pop_len;
+
+    if (n > ff->max) {
+        ff->ax = realloc(ff->ax, n * sizeof(float));
+        ff->ay = realloc(ff->ay, n * sizeof(float));
+        ff->near_start = realloc(ff->near_start, n * sizeof(unsigned int));
+        ff->near_len = realloc(ff->near_len, n * sizeof(unsigned int));
+        EXIT_IF(!ff->ax || !ff->ay || !ff->near_start || !ff->near_len, "failed to (re)allocate for FarField");
+        ff->max = n;
+    }
+
+    ff->walk = n != ff->len
+        || state->step != ff->step + 1
+        || state->step - ff->built >= state->bh_far_every
+        || state->bh_theta != ff->theta
+        || state->bh_quadrupole != ff->quadrupole
+        || state->softening != ff->softening;
+
+    if (ff->walk) {
+        _zones_build(&m_zones, state);
+        ff->len = n;
+        ff->built = state->step;
+        ff->theta = state->bh_theta;
+        ff->quadrupole = state->bh_quadrupole;
+        ff->softening = state->softening;
+    }
+    ff->step = state->step;
+}
+
+static void _prepare(State *state) {
+    prof_begin(PROF_MASS);
+    qtree_aggregate(state->tree);
+    otree_aggregate(state->otree);
+    prof_end(PROF_MASS);
+
+    bodies_gather(&m_bodies, state);
+
+    // lists point into the tree: rebuild them unless the tree was refit (not rebuilt) since and the opening parameters are the same
+    if (_grouped(state)) {
+        m_groups.fresh = false;
+        if (!state->tree || !state->tree->refits || m_groups.bodies_max < state->pop_len
+            || state->bh_theta != m_groups.theta || state->bh_quadrupole != m_groups.quadrupole) {
+            _groups_build(&m_groups, state);
+        }
+        _zones_reserve(&m_zones, state->pop_len); // costs of the loose bodies
+    } else if (_multirate(state)) {
+        _far_prepare(&m_far, state);
+    } else {
+        _zones_build(&m_zones, state);
+    }
+
+    atomic_store_explicit(&m_visits, 0, memory_order_relaxed);
+    atomic_store_explicit(&m_interactions, 0, memory_order_relaxed);
+}
+
+/**
+ * Computes the accelerations of the given bodies (population indices) and records their costs
+ */
+static void _update(State *state, const unsigned int *index, size_t len) {
+    Bodies *bodies = &m_bodies;
+    Interactions *points = &m_points;
+    Interactions *cells = &m_cells;
+    unsigned long visits = 0;
+    unsigned long interactions = 0;
+
+    float theta2 = state->bh_theta * state->bh_theta;
+    float eps2 = state->softening * state->softening;
+    bool quadrupole = state->bh_quadrupole;
+    bool buckets = state->tree && !state->tree->refits;
+
+    for (size_t k = 0; k < len; k++) {
+        size_t i = index[k];
+        float x = bodies->x[i];
+        float y = bodies->y[i];
+
+        points->len = 0;
+        cells->len = 0;
+        unsigned long cost = 0;
+        if (state->tree) {
+            cost = _collect(state->tree->root, &state->population[i], x, y, theta2, buckets, points, (quadrupole) ? cells : NULL);
+        }
+        m_zones.cost[i] = (unsigned int) cost + 1;
+        visits += cost;
+
+        interactions += points->len + cells->len;
+        vec2 acc = _accelerate(points, x, y, eps2);
+        if (cells->len) {
+            vec2 far = _accelerate_quadrupole(cells, x, y, eps2);
+            acc.x += far.x;
+            acc.y += far.y;
+        }
+        bodies->ax[i] = acc.x * state->grav_g;
+        bodies->ay[i] = acc.y * state->grav_g;
+        bodies->az[i] = 0.f;
+    }
+
+    atomic_fetch_add_explicit(&m_visits, visits, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m_interactions, interactions, memory_order_relaxed);
+}
+
+/**
+ * _update() on the octree (state->dims == 3)
+ */
+static void _update_3d(State *state, const unsigned int *index, size_t len) {
+    Bodies *bodies = &m_bodies;
+    Interactions *points = &m_points;
+    unsigned long visits = 0;
+    unsigned long interactions = 0;
+
+    float theta2 = state->bh_theta * state->bh_theta;
+    float eps2 = state->softening * state->softening;
+
+    for (size_t k = 0; k < len; k++) {
+        size_t i = index[k];
+        vec3_t pos = {bodies->x[i], bodies->y[i], bodies->z[i]};
+
+        points->len = 0;
+        unsigned long cost = 0;
+        if (state->otree) {
+            cost = _collect_3d(state->otree->root, &state->population[i], pos, theta2, points);
+        }
+        m_zones.cost[i] = (unsigned int) cost + 1;
+        visits += cost;
+
+        interactions += points->len;
+        vec3_t acc = _accelerate_3d(points, pos, eps2);
+        bodies->ax[i] = acc.x * state->grav_g;
+        bodies->ay[i] = acc.y * state->grav_g;
+        bodies->az[i] = acc.z * state->grav_g;
+    }
+
+    atomic_fetch_add_explicit(&m_visits, visits, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m_interactions, interactions, memory_order_relaxed);
+}
+
+/**
+ * Multi-rate update of a cost zone: walks the tree for its bodies (caching the far field and the near indices)
+ * if the walk is due, then sums the near field at the current positions
+ */
+static void _update_split(State *state, size_t zone) {
+    Bodies *bodies = &m_bodies;
+    FarField *ff = &m_far;
+    NearList *near = &ff->near[zone];
+    Interactions *cells = &m_cells;
+    unsigned long visits = 0;
+    unsigned long interactions = 0;
+
+    const unsigned int *index = m_zones.order + m_zones.zones[zone];
+    size_t len = m_zones.zones[zone + 1] - m_zones.zones[zone];
+
+    float theta2 = state->bh_theta * state->bh_theta;
+    float eps2 = state->softening * state->softening;
+    bool buckets = state->tree && !state->tree->refits;
+
+    if (ff->walk) {
+        near->len = 0;
+    }
+
+    for (size_t k = 0; k < len; k++) {
+        size_t i = index[k];
+        float x = bodies->x[i];
+        float y = bodies->y[i];
+
+        if (ff->walk) {
+            cells->len = 0;
+            ff->near_start[i] = (unsigned int) near->len;
+
+            unsigned long cost = 0;
+            if (state->tree) {
+                cost = _collect_split(state->tree->root, &state->population[i], state->population, x, y, theta2, buckets, near, cells);
+            }
+            m_zones.cost[i] = (unsigned int) cost + 1;
+            visits += cost;
+
+            ff->near_len[i] = (unsigned int) (near->len - ff->near_start[i]);
+            vec2 far = (state->bh_quadrupole) ? _accelerate_quadrupole(cells, x, y, eps2) : _accelerate(cells, x, y, eps2);
+            ff->ax[i] = far.x;
+            ff->ay[i] = far.y;
+            interactions += cells->len;
+        }
+
+        vec2 acc = _accelerate_near(bodies, near->index + ff->near_start[i], ff->near_len[i], x, y, eps2);
+        interactions += ff->near_len[i];
+
+        bodies->ax[i] = (acc.x + ff->ax[i]) * state->grav_g;
+        bodies->ay[i] = (acc.y + ff->ay[i]) * state->grav_g;
+        bodies->az[i] = 0.f;
+    }
+
+    atomic_fetch_add_explicit(&m_visits, visits, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m_interactions, interactions, memory_order_relaxed);
+}
+
+static void _zone_batch(void *ctx, size_t start, size_t end) {
+    State *state = (State*) ctx;
+    CostZones *cz = &m_zones;
+
+    for (size_t z = start; z < end; z++) {
+        const unsigned int *index = cz->order + cz->zones[z];
+        size_t len = cz->zones[z + 1] - cz->zones[z];
+        if (_multirate(state)) {
+            _update_split(state, z);
+        } else if (state->dims == 3) {
+            _update_3d(state, index, len);
+        } else {
+            _update(state, index, len);
+        }
+    }
+}
+
+/**
+ * Runs the cost zones, one per thread, or the groups (parallel over zones or groups, not over the population range)
+ */
+static void _dispatch(State *state, size_t start, size_t end) {
+    if (_grouped(state)) {
+        parallel_for(m_groups.len, BH_GROUP_BATCH, _group_batch, state);
+        _update(state, m_groups.loose, m_groups.loose_len);
         return;
     }
-    _update_size(state, bort, index);
-    _update_position(state, bort, index);
-    _update_color(state, bort, index);
+    parallel_for(m_zones.zones_len, 1, _zone_batch, state);
 }
+
+static void _finish(State *state) {
+    bodies_integrate(&m_bodies, state);
+    if (_grouped(state)) {
+        _groups_age(&m_groups, state);
+    } else if (_multirate(state)) {
+        // the near field reads positions only: refit instead of rebuilding unless the next step walks
+        state->tree_refit = state->step + 1 - m_far.built < state->bh_far_every;
+    }
+}
+
+/**
+ * Node visits and accepted interactions (nodes and leaves) of the last step
+ */
+void barnes_hut_stats(unsigned long *visits, unsigned long *interactions) {
+    *visits = atomic_load(&m_visits);
+    *interactions = atomic_load(&m_interactions);
+}
+
+const Algorithm algo_barnes_hut = {
+    .name = "barnes_hut",
+    .flag = ALGO_BARNES_HUT,
+    .requires = ALGO_REQUIRES_QTREE,
+    .params = {
+        {"grav_g", offsetof(State, grav_g), 0.f, 20.f},
+        {"bh_theta", offsetof(State, bh_theta), .5f, 2.f},
+        {"softening", offsetof(State, softening), 0.f, 20.f},
+    },
+    .params_len = 3,
+    .parallel = false, // parallel over cost zones within update()
+    .init = gravity_init,
+    .prepare = _prepare,
+    .update = _dispatch,
+    .finish = _finish,
+};
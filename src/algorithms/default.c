@@ -1,5 +1,6 @@
 #include "borticle.h"
 #include "state.h"
+#include "algorithm.h"
 
 static void _update_size(State *state, Borticle *bort, size_t index) {}
 
@@ -10,8 +11,8 @@ static void _update_position(State *state, Borticle *bort, size_t index) {
     bort->vel.x = (dirx * bort->acc.x);
     bort->vel.y = (diry * bort->acc.y);
 
-    bort->pos.x += bort->vel.x;
-    bort->pos.y += bort->vel.y;
+    bort->pos.x += bort->vel.x * state->dt;
+    bort->pos.y += bort->vel.y * state->dt;
     if (
            bort->pos.x < 0
         || bort->pos.x > state->width
@@ -21,45 +22,55 @@ static void _update_position(State *state, Borticle *bort, size_t index) {
         // reset
         bort->pos.x = state->width / 2.f;
         bort->pos.y = state->height / 2.f;
-        bort->vel.x = rand_range_f(-10.f, 10.f);
-        bort->vel.y = rand_range_f(-10.f, 10.f);
+        bort->vel.x = rng_range_f(&state->rng, -10.f, 10.f);
+        bort->vel.y = rng_range_f(&state->rng, -10.f, 10.f);
     }
     //printf("%d {%f,%f}\n", bort->id, bort->pos.x, bort->pos.y);
 }
 
 static void _update_color(State *state, Borticle *bort, size_t index) {}
 
-void bort_init_default(State *state, Borticle *bort, size_t index) {
+static void _init(State *state, Borticle *bort, size_t index, Rng *rng) {
     // state is required and wont be tested here
     if(!bort) {
         return;
     }
 
     bort->color = (rgba) {
-        rand_range_f(0.f, 1.f),
-        rand_range_f(0.f, 1.f),
-        rand_range_f(0.f, 1.f),
+        rng_range_f(rng, 0.f, 1.f),
+        rng_range_f(rng, 0.f, 1.f),
+        rng_range_f(rng, 0.f, 1.f),
         1.f
     };
     bort->vel = (vec3_t) {
-        rand_range_f(-10.f, 10.f),
-        rand_range_f(-10.f, 10.f),
+        rng_range_f(rng, -10.f, 10.f),
+        rng_range_f(rng, -10.f, 10.f),
         0.f
     };
+    // speed in pixels per second
     bort->acc = (vec3_t) {
-        rand_range_f(0.1f, 5.f),
-        rand_range_f(0.1f, 5.f),
+        rng_range_f(rng, 5.f, 150.f),
+        rng_range_f(rng, 5.f, 150.f),
         0.f
     };
-    bort->size = rand_range_f(0.1f, 6.f);
+    bort->size = rng_range_f(rng, 0.1f, 6.f);
 }
 
-void bort_update_default(State *state, Borticle *bort, size_t index) {
-    // state is required and wont be tested here
-    if(!bort) {
-        return;
+/**
+ * Updates the borticles in [start, end)
+ */
+static void _update(State *state, size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+        Borticle *bort = &state->population[i];
+        _update_size(state, bort, i);
+        _update_position(state, bort, i);
+        _update_color(state, bort, i);
     }
-    _update_size(state, bort, index);
-    _update_position(state, bort, index);
-    _update_color(state, bort, index);
 }
+
+const Algorithm algo_default = {
+    .name = "default",
+    .flag = ALGO_NONE,
+    .init = _init,
+    .update = _update,
+};
@@ -0,0 +1,44 @@
+#include <stddef.h>
+
+#include "borticle.h"
+#include "state.h"
+#include "algorithm.h"
+#include "gravity.h"
+
+////
+// Direct summation gravity: exact O(N^2) all pairs, shares init and integration with Barnes-Hut.
+// Reference for the tree approximations and faster than the tree for small populations (@see state->direct_max).
+////
+
+// scratch, filled from the population on every step
+static Bodies m_bodies = {0};
+
+static void _prepare(State *state) {
+    bodies_gather(&m_bodies, state);
+}
+
+/**
+ * Computes the accelerations of the bodies in [start, end)
+ */
+static void _update(State *state, size_t start, size_t end) {
+    gravity_direct(&m_bodies, start, end, state->grav_g, state->softening * state->softening);
+}
+
+static void _finish(State *state) {
+    bodies_integrate(&m_bodies, state);
+}
+
+const Algorithm algo_direct = {
+    .name = "direct",
+    .flag = ALGO_DIRECT,
+    .params = {
+        {"grav_g", offsetof(State, grav_g), 0.f, 20.f},
+        {"softening", offsetof(State, softening), 0.f, 20.f},
+    },
+    .params_len = 2,
+    .parallel = true,
+    .init = gravity_init,
+    .prepare = _prepare,
+    .update = _update,
+    .finish = _finish,
+};
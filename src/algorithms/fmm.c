@@ -0,0 +1,544 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "borticle.h"
+#include "qtree/qtree.h"
+#include "state.h"
+#include "algorithm.h"
+#include "gravity.h"
+#include "parallel.h"
+
+#include "utils.h"
+#include "log.h"
+#include "profiler.h"
+
+////
+// Fast multipole gravity (Cartesian expansions on the quadtree)
+//
+// Per step:
+//   prepare: aggregate node masses and second moments (M2M, qtree_aggregate()), flatten the tree into cells with
+//            bodies in tree order, leaves hold up to FMM_LEAF bodies
+//   update:  per task cell, in parallel: dual tree traversal against the root, well separated cell pairs add the
+//            multipole (monopole + quadrupole) of the source to the local expansion of the target (M2L),
+//            near leaf pairs sum directly (P2P). Then local expansions are shifted down to the leaves (L2L)
+//            and evaluated at the bodies (L2P).
+//   finish:  leapfrog integration, scatter back into the population (@see gravity.h)
+//
+// Local expansion about the target com: a(c + h) = a + J * h + 1/2 * T : h h
+// Cells are well separated if (r_a + r_b) < theta * |com_a - com_b|, r: bounding radius about the com.
+// The traversal is one sided (each task only writes to its own subtree), so pairs are visited from both ends.
+//
+// @see W. Dehnen, A hierarchical O(N) force calculation algorithm (J. Comput. Phys. 179, 2002)
+////
+
+#define FMM_LEAF 16   // max bodies per leaf cell
+#define FMM_TASKS 256 // min cells to split the traversal over
+
+/**
+ * Local expansion: acceleration, its jacobian and second derivatives (symmetric)
+ */
+typedef struct Local {
+    float ax, ay;
+    float jxx, jxy, jyy;
+    float txxx, txxy, txyy, tyyy;
+} Local;
+
+typedef struct Cell {
+    float x, y, m;       // com, mass
+    float sxx, sxy, syy; // second moments about com
+    float r;             // bounding radius about com
+    vec2 nw, se;         // box
+    uint32_t child, nchild; // children are contiguous
+    uint32_t start, end; // bodies [start, end) in tree order
+    Local local;
+} Cell;
+
+/**
+ * Flattened tree, bodies sorted in tree order
+ */
+typedef struct FmmTree {
+    Cell *cells;
+    size_t len;
+    size_t max;
+
+    size_t *tasks;
+    size_t tasks_len;
+
+    size_t *order; // tree order -> bodies index
+    bool *placed;  // bodies index -> in the tree
+    float *x, *y, *m;
+    float *ax, *ay;
+    size_t body_len;
+    size_t body_max;
+
+    float theta, eps2;
+} FmmTree;
+
+// scratch, filled from the population on every step
+static Bodies m_bodies = {0};
+static FmmTree m_tree = {0};
+
+// counters of the last step, summed over the worker threads
+static atomic_ulong m_m2l = 0;
+static atomic_ulong m_p2p = 0;
+
+static void *_realloc(void *ptr, size_t len) {
+    ptr = realloc(ptr, len);
+    EXIT_IF(ptr == NULL, "failed to (re)allocate for FmmTree");
+    return ptr;
+}
+
+static void _reserve_bodies(FmmTree *t, size_t len) {
+    if (len <= t->body_max) {
+        return;
+    }
+    t->order = _realloc(t->order, len * sizeof(size_t));
+    t->placed = _realloc(t->placed, len * sizeof(bool));
+    t->x = _realloc(t->x, len * sizeof(float));
+    t->y = _realloc(t->y, len * sizeof(float));
+    t->m = _realloc(t->m, len * sizeof(float));
+    t->ax = _realloc(t->ax, len * sizeof(float));
+    t->ay = _realloc(t->ay, len * sizeof(float));
+    t->body_max = len;
+}
+
+/**
+ * Appends len cells, returns the index of the first
+ */
+static size_t _cells_push(FmmTree *t, size_t len) {
+    if (t->len + len > t->max) {
+        t->max = (t->max) ? t->max * 2 : 1024;
+        t->max = (t->max < t->len + len) ? t->len + len : t->max;
+        t->cells = _realloc(t->cells, t->max * sizeof(Cell));
+    }
+    size_t first = t->len;
+    t->len += len;
+    return first;
+}
+
+static bool _isleaf(const Cell *cell) {
+    return !cell->nchild || cell->end - cell->start <= FMM_LEAF;
+}
+
+/**
+ * Copies a (non empty) node and its subtree into cells, index is already allocated
+ */
+static void _flatten(FmmTree *t, size_t index, QNode *node, const Bodies *bodies, const Borticle *population) {
+    float hx = (node->self_se.x - node->self_nw.x) * .5f;
+    float hy = (node->self_se.y - node->self_nw.y) * .5f;
+    float dx = node->com.x - (node->self_nw.x + hx);
+    float dy = node->com.y - (node->self_nw.y + hy);
+
+    Cell *cell = &t->cells[index];
+    *cell = (Cell) {
+        .x = node->com.x, .y = node->com.y, .m = node->mass,
+        .sxx = node->qxx, .sxy = node->qxy, .syy = node->qyy,
+        .r = sqrtf(dx * dx + dy * dy) + sqrtf(hx * hx + hy * hy),
+        .nw = node->self_nw, .se = node->self_se,
+        .start = t->body_len,
+    };
+
+    if (qnode_isleaf(node)) {
+        for (QNode *entry = qnode_entries(node); entry; entry = entry->next) {
+            size_t i = (const Borticle*) entry->data - population;
+            size_t k = t->body_len++;
+            t->order[k] = i;
+            t->placed[i] = true;
+            t->x[k] = bodies->x[i];
+            t->y[k] = bodies->y[i];
+            t->m[k] = entry->mass;
+        }
+        t->cells[index].end = t->body_len;
+        return;
+    }
+
+    QNode *children[4] = {node->nw, node->ne, node->sw, node->se};
+    uint32_t nchild = 0;
+    for (int c = 0; c < 4; c++) {
+        nchild += !qnode_isempty(children[c]);
+    }
+
+    size_t first = _cells_push(t, nchild); // invalidates cell
+    t->cells[index].child = first;
+    t->cells[index].nchild = nchild;
+
+    for (int c = 0; c < 4; c++) {
+        if (!qnode_isempty(children[c])) {
+            _flatten(t, first++, children[c], bodies, population);
+        }
+    }
+    t->cells[index].end = t->body_len;
+}
+
+/**
+ * Splits the root until there are FMM_TASKS cells (or only leaves), each task is a disjoint subtree
+ */
+static void _split_tasks(FmmTree *t) {
+    size_t max = FMM_TASKS * 4;
+    t->tasks = _realloc(t->tasks, max * 2 * sizeof(size_t));
+    size_t *cur = t->tasks;
+    size_t *next = t->tasks + max;
+    size_t len = 1;
+    cur[0] = 0;
+
+    while (len < FMM_TASKS) {
+        size_t next_len = 0;
+        bool split = false;
+
+        for (size_t i = 0; i < len; i++) {
+            Cell *cell = &t->cells[cur[i]];
+            if (_isleaf(cell)) {
+                next[next_len++] = cur[i];
+                continue;
+            }
+            for (uint32_t c = 0; c < cell->nchild; c++) {
+                next[next_len++] = cell->child + c;
+            }
+            split = true;
+        }
+
+        size_t *swap = cur;
+        cur = next;
+        next = swap;
+        len = next_len;
+        if (!split) {
+            break;
+        }
+    }
+
+    if (cur != t->tasks) {
+        memcpy(t->tasks, cur, len * sizeof(size_t));
+    }
+    t->tasks_len = len;
+}
+
+/**
+ * Boxes share interior, such cells are never well separated (e.g. ancestors)
+ */
+static bool _overlaps(const Cell *a, const Cell *b) {
+    return a->nw.x < b->se.x && b->nw.x < a->se.x && a->nw.y < b->se.y && b->nw.y < a->se.y;
+}
+
+/**
+ * Adds the field of source b to the local expansion of a, r = com_a - com_b, rho^2 = |r|^2 + eps^2:
+ *   a  = m * D1 + 1/2 * S : D3, J = m * D2, T = m * D3 with Dn the derivatives of 1/rho
+ */
+static void _m2l(Cell *a, const Cell *b, float eps2) {
+    float x = a->x - b->x;
+    float y = a->y - b->y;
+    float r2 = x * x + y * y + eps2;
+    float i1 = 1.f / sqrtf(r2);
+    float i2 = i1 * i1;
+    float i3 = i1 * i2;
+    float i5 = i3 * i2;
+    float i7 = i5 * i2;
+
+    float d2xx = 3.f * x * x * i5 - i3;
+    float d2xy = 3.f * x * y * i5;
+    float d2yy = 3.f * y * y * i5 - i3;
+
+    float d3xxx = -15.f * x * x * x * i7 + 9.f * x * i5;
+    float d3xxy = -15.f * x * x * y * i7 + 3.f * y * i5;
+    float d3xyy = -15.f * x * y * y * i7 + 3.f * x * i5;
+    float d3yyy = -15.f * y * y * y * i7 + 9.f * y * i5;
+
+    float m = b->m;
+    Local *l = &a->local;
+
+    l->ax += -m * x * i3 + .5f * (b->sxx * d3xxx + 2.f * b->sxy * d3xxy + b->syy * d3xyy);
+    l->ay += -m * y * i3 + .5f * (b->sxx * d3xxy + 2.f * b->sxy * d3xyy + b->syy * d3yyy);
+
+    l->jxx += m * d2xx;
+    l->jxy += m * d2xy;
+    l->jyy += m * d2yy;
+
+    l->txxx += m * d3xxx;
+    l->txxy += m * d3xxy;
+    l->txyy += m * d3xyy;
+    l->tyyy += m * d3yyy;
+}
+
+/**
+ * Direct sum of the bodies of b onto the bodies of a
+ */
+static void _p2p(FmmTree *t, const Cell *a, const Cell *b, float eps2) {
+    const float *bx = t->x;
+    const float *by = t->y;
+    const float *bm = t->m;
+
+    for (uint32_t i = a->start; i < a->end; i++) {
+        float xi = bx[i];
+        float yi = by[i];
+        float ax = 0.f;
+        float ay = 0.f;
+
+        for (uint32_t j = b->start; j < b->end; j++) {
+            float dx = bx[j] - xi;
+            float dy = by[j] - yi;
+            float r2 = dx * dx + dy * dy + eps2;
+            float inv = 1.f / sqrtf(r2);
+            float s = (r2 > 0.f) ? bm[j] * inv * inv * inv : 0.f; // self (without softening)
+            ax += dx * s;
+            ay += dy * s;
+        }
+
+        t->ax[i] += ax;
+        t->ay[i] += ay;
+    }
+}
+
+/**
+ * One sided dual tree traversal: adds the field of cell b to cell a (and its subtree)
+ */
+static void _interact(FmmTree *t, size_t ia, size_t ib, unsigned long *m2l, unsigned long *p2p) {
+    Cell *a = &t->cells[ia];
+    Cell *b = &t->cells[ib];
+
+    if (ia == ib) {
+        if (_isleaf(a)) {
+            _p2p(t, a, a, t->eps2);
+            *p2p += (a->end - a->start) * (a->end - a->start);
+            return;
+        }
+        for (uint32_t i = 0; i < a->nchild; i++) {
+            for (uint32_t j = 0; j < a->nchild; j++) {
+                _interact(t, a->child + i, a->child + j, m2l, p2p);
+            }
+        }
+        return;
+    }
+
+    float dx = a->x - b->x;
+    float dy = a->y - b->y;
+    float r = a->r + b->r;
+    if (r * r < t->theta * t->theta * (dx * dx + dy * dy) && !_overlaps(a, b)) {
+        _m2l(a, b, t->eps2);
+        (*m2l)++;
+        return;
+    }
+
+    bool leaf_a = _isleaf(a);
+    bool leaf_b = _isleaf(b);
+
+    if (leaf_a && leaf_b) {
+        _p2p(t, a, b, t->eps2);
+        *p2p += (a->end - a->start) * (b->end - b->start);
+        return;
+    }
+
+    if (leaf_b || (!leaf_a && a->r > b->r)) {
+        for (uint32_t i = 0; i < a->nchild; i++) {
+            _interact(t, a->child + i, ib, m2l, p2p);
+        }
+    } else {
+        for (uint32_t j = 0; j < b->nchild; j++) {
+            _interact(t, ia, b->child + j, m2l, p2p);
+        }
+    }
+}
+
+/**
+ * Evaluates a local expansion at offset h from its center
+ */
+static vec2 _local_eval(const Local *l, float hx, float hy) {
+    return (vec2) {
+        l->ax + l->jxx * hx + l->jxy * hy + .5f * (l->txxx * hx * hx + 2.f * l->txxy * hx * hy + l->txyy * hy * hy),
+        l->ay + l->jxy * hx + l->jyy * hy + .5f * (l->txxy * hx * hx + 2.f * l->txyy * hx * hy + l->tyyy * hy * hy),
+    };
+}
+
+/**
+ * Shifts the local expansion of a cell into its children (L2L), evaluates it at the bodies of leaves (L2P)
+ */
+static void _downward(FmmTree *t, size_t index) {
+    Cell *cell = &t->cells[index];
+    const Local *l = &cell->local;
+
+    if (_isleaf(cell)) {
+        for (uint32_t i = cell->start; i < cell->end; i++) {
+            vec2 acc = _local_eval(l, t->x[i] - cell->x, t->y[i] - cell->y);
+            t->ax[i] += acc.x;
+            t->ay[i] += acc.y;
+        }
+        return;
+    }
+
+    for (uint32_t c = 0; c < cell->nchild; c++) {
+        Cell *child = &t->cells[cell->child + c];
+        float hx = child->x - cell->x;
+        float hy = child->y - cell->y;
+        Local *cl = &child->local;
+
+        vec2 acc = _local_eval(l, hx, hy);
+        cl->ax += acc.x;
+        cl->ay += acc.y;
+        cl->jxx += l->jxx + l->txxx * hx + l->txxy * hy;
+        cl->jxy += l->jxy + l->txxy * hx + l->txyy * hy;
+        cl->jyy += l->jyy + l->txyy * hx + l->tyyy * hy;
+        cl->txxx += l->txxx;
+        cl->txxy += l->txxy;
+        cl->txyy += l->txyy;
+        cl->tyyy += l->tyyy;
+
+        _downward(t, cell->child + c);
+    }
+}
+
+/**
+ * Acceleration at a point outside the tree bounds: multipoles of well separated cells, direct sum otherwise
+ */
+static vec2 _walk_point(FmmTree *t, size_t index, float x, float y) {
+    const Cell *cell = &t->cells[index];
+    float dx = cell->x - x;
+    float dy = cell->y - y;
+    float r2 = dx * dx + dy * dy + t->eps2;
+
+    if (cell->r * cell->r < t->theta * t->theta * (dx * dx + dy * dy)) {
+        float inv = 1.f / sqrtf(r2);
+        float inv2 = inv * inv;
+        float inv3 = inv * inv2;
+        float inv5 = inv3 * inv2;
+
+        // traceless quadrupole, @see barnes_hut.c
+        float qxx = 2.f * cell->sxx - cell->syy;
+        float qxy = 3.f * cell->sxy;
+        float qyy = 2.f * cell->syy - cell->sxx;
+        float qdx = qxx * dx + qxy * dy;
+        float qdy = qxy * dx + qyy * dy;
+        float dqd = dx * qdx + dy * qdy;
+
+        float s = cell->m * inv3 + 2.5f * dqd * inv5 * inv2;
+        return (vec2) {dx * s - qdx * inv5, dy * s - qdy * inv5};
+    }
+
+    vec2 acc = {0.f, 0.f};
+    if (_isleaf(cell)) {
+        for (uint32_t j = cell->start; j < cell->end; j++) {
+            float jx = t->x[j] - x;
+            float jy = t->y[j] - y;
+            float jr2 = jx * jx + jy * jy + t->eps2;
+            float inv = 1.f / sqrtf(jr2);
+            float s = (jr2 > 0.f) ? t->m[j] * inv * inv * inv : 0.f;
+            acc.x += jx * s;
+            acc.y += jy * s;
+        }
+        return acc;
+    }
+
+    for (uint32_t c = 0; c < cell->nchild; c++) {
+        vec2 child = _walk_point(t, cell->child + c, x, y);
+        acc.x += child.x;
+        acc.y += child.y;
+    }
+    return acc;
+}
+
+static void _task_batch(void *ctx, size_t start, size_t end) {
+    FmmTree *t = (FmmTree*) ctx;
+    unsigned long m2l = 0;
+    unsigned long p2p = 0;
+
+    for (size_t k = start; k < end; k++) {
+        _interact(t, t->tasks[k], 0, &m2l, &p2p);
+        _downward(t, t->tasks[k]);
+    }
+
+    atomic_fetch_add_explicit(&m_m2l, m2l, memory_order_relaxed);
+    atomic_fetch_add_explicit(&m_p2p, p2p, memory_order_relaxed);
+}
+
+static void _prepare(State *state) {
+    FmmTree *t = &m_tree;
+
+    prof_begin(PROF_MASS);
+    qtree_aggregate(state->tree);
+    prof_end(PROF_MASS);
+
+    bodies_gather(&m_bodies, state);
+
+    _reserve_bodies(t, m_bodies.len);
+    memset(t->placed, 0, m_bodies.len * sizeof(bool));
+    t->len = 0;
+    t->body_len = 0;
+    t->tasks_len = 0;
+    t->theta = state->fmm_theta;
+    t->eps2 = state->softening * state->softening;
+
+    if (state->tree && !qnode_isempty(state->tree->root)) {
+        _cells_push(t, 1);
+        _flatten(t, 0, state->tree->root, &m_bodies, state->population);
+        _split_tasks(t);
+    }
+
+    memset(t->ax, 0, t->body_len * sizeof(float));
+    memset(t->ay, 0, t->body_len * sizeof(float));
+    for (size_t c = 0; c < t->len; c++) {
+        t->cells[c].local = (Local) {0};
+    }
+
+    atomic_store_explicit(&m_m2l, 0, memory_order_relaxed);
+    atomic_store_explicit(&m_p2p, 0, memory_order_relaxed);
+}
+
+/**
+ * Runs the traversal over all task cells (parallel over cells, not over the population range)
+ */
+static void _update(State *state, size_t start, size_t end) {
+    FmmTree *t = &m_tree;
+    Bodies *bodies = &m_bodies;
+
+    parallel_for(t->tasks_len, 1, _task_batch, t);
+
+    for (size_t i = start; i < end; i++) {
+        bodies->ax[i] = 0.f;
+        bodies->ay[i] = 0.f;
+        bodies->az[i] = 0.f; // 2D only
+    }
+    for (size_t k = 0; k < t->body_len; k++) {
+        bodies->ax[t->order[k]] = t->ax[k] * state->grav_g;
+        bodies->ay[t->order[k]] = t->ay[k] * state->grav_g;
+    }
+
+    // outside of the tree bounds
+    for (size_t i = start; i < end; i++) {
+        if (t->placed[i] || !t->len) {
+            continue;
+        }
+        vec2 acc = _walk_point(t, 0, bodies->x[i], bodies->y[i]);
+        bodies->ax[i] = acc.x * state->grav_g;
+        bodies->ay[i] = acc.y * state->grav_g;
+    }
+}
+
+static void _finish(State *state) {
+    bodies_integrate(&m_bodies, state);
+}
+
+/**
+ * Cell-cell multipole interactions (M2L) and direct body pairs (P2P) of the last step
+ */
+void fmm_stats(unsigned long *m2l, unsigned long *p2p) {
+    *m2l = atomic_load(&m_m2l);
+    *p2p = atomic_load(&m_p2p);
+}
+
+const Algorithm algo_fmm = {
+    .name = "fmm",
+    .flag = ALGO_FMM,
+    .requires = ALGO_REQUIRES_QTREE,
+    .params = {
+        {"grav_g", offsetof(State, grav_g), 0.f, 20.f},
+        {"fmm_theta", offsetof(State, fmm_theta), .1f, 1.f},
+        {"softening", offsetof(State, softening), 0.f, 20.f},
+    },
+    .params_len = 3,
+    .parallel = false, // parallel over cells within update()
+    .init = gravity_init,
+    .prepare = _prepare,
+    .update = _update,
+    .finish = _finish,
+};
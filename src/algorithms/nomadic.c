@@ -1,5 +1,6 @@
 #include "borticle.h"
 #include "state.h"
+#include "algorithm.h"
 
 static void _update_size(State *state, Borticle *bort, size_t index) {}
 
@@ -17,52 +18,62 @@ static void _update_position(State *state, Borticle *bort, size_t index) {
     bort->vel.x = (dirx * bort->acc.x);
     bort->vel.y = (diry * bort->acc.y);
 
-    bort->pos.x += bort->vel.x;
-    bort->pos.y += bort->vel.y;
+    bort->pos.x += bort->vel.x * state->dt;
+    bort->pos.y += bort->vel.y * state->dt;
 }
 
 static void _update_color(State *state, Borticle *bort, size_t index) {}
 
-void bort_init_nomadic(State *state, Borticle *bort, size_t index) {
+static void _init(State *state, Borticle *bort, size_t index, Rng *rng) {
     // state is required and wont be tested here
     if (!bort) {
         return;
     }
 
     bort->color = (rgba) {
-        rand_range_f(0.f, 1.f),
-        rand_range_f(0.f, 1.f),
-        rand_range_f(0.f, 1.f),
+        rng_range_f(rng, 0.f, 1.f),
+        rng_range_f(rng, 0.f, 1.f),
+        rng_range_f(rng, 0.f, 1.f),
         1.f
     };
 
     bort->pos = (vec3_t) {
-        rand_range_f(0.f, (float)state->width),
-        rand_range_f(0.f, (float)state->height),
+        rng_range_f(rng, 0.f, (float)state->width),
+        rng_range_f(rng, 0.f, (float)state->height),
         0.f
     };
 
     bort->vel = (vec3_t) {
-        rand_range_f(-1.f, 1.f),
-        rand_range_f(-1.f, 1.f),
+        rng_range_f(rng, -1.f, 1.f),
+        rng_range_f(rng, -1.f, 1.f),
         0.f
     };
 
+    // speed in pixels per second
     bort->acc = (vec3_t) {
-        rand_range_f(0.1f, 1.f),
-        rand_range_f(0.1f, 1.f),
+        rng_range_f(rng, 5.f, 30.f),
+        rng_range_f(rng, 5.f, 30.f),
         0.f
     };
 
-    bort->size = rand_range_f(0.1f, 6.f);
+    bort->size = rng_range_f(rng, 0.1f, 6.f);
 }
 
-void bort_update_nomadic(State *state, Borticle *bort, size_t index) {
-    // sstate is required and wont be tested here
-    if(!bort) {
-        return;
+/**
+ * Updates the borticles in [start, end)
+ */
+static void _update(State *state, size_t start, size_t end) {
+    for (size_t i = start; i < end; i++) {
+        Borticle *bort = &state->population[i];
+        _update_size(state, bort, i);
+        _update_position(state, bort, i);
+        _update_color(state, bort, i);
     }
-    _update_size(state, bort, index);
-    _update_position(state, bort, index);
-    _update_color(state, bort, index);
 }
+
+const Algorithm algo_nomadic = {
+    .name = "nomadic",
+    .flag = ALGO_NOMADIC,
+    .init = _init,
+    .update = _update,
+};
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "state.h"
+#include "borticle.h"
+#include "algorithm.h"
+#include "gravity.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "bench.h"
+
+#include "utils.h"
+#include "log.h"
+
+typedef struct DirectCtx {
+    Bodies *bodies;
+    float grav_g;
+    float eps2;
+} DirectCtx;
+
+static void _direct_batch(void *ctx, size_t start, size_t end) {
+    DirectCtx *direct = (DirectCtx*) ctx;
+    gravity_direct(direct->bodies, start, end, direct->grav_g, direct->eps2);
+}
+
+/**
+ * Average of the latest samples of a profiler phase (up to PROF_SAMPLES)
+ */
+static double _avg_ms(ProfPhase phase, unsigned long steps) {
+    float ms[PROF_SAMPLES];
+    size_t len = prof_samples(phase, ms, (steps < PROF_SAMPLES) ? steps : PROF_SAMPLES);
+
+    double sum = 0.0;
+    for (size_t i = 0; i < len; i++) {
+        sum += ms[i];
+    }
+    return (len) ? sum / len : 0.0;
+}
+
+static int _cmp_float(const void *a, const void *b) {
+    float fa = *(const float*) a;
+    float fb = *(const float*) b;
+    return (fa > fb) - (fa < fb);
+}
+
+/**
+ * Relative acceleration errors of the population against the reference (sorted into err), returns the rms error
+ */
+static double _accuracy(const State *state, const Bodies *ref, float *err) {
+    size_t n = state->pop_len;
+    double ref_norm = 0.0;
+    double diff = 0.0;
+
+    for (size_t i = 0; i < n; i++) {
+        double dx = state->population[i].acc.x - ref->ax[i];
+        double dy = state->population[i].acc.y - ref->ay[i];
+        double norm = sqrt((double) ref->ax[i] * ref->ax[i] + (double) ref->ay[i] * ref->ay[i]);
+        ref_norm += norm * norm;
+        diff += dx * dx + dy * dy;
+        err[i] = (norm > 0.0) ? (float) (sqrt(dx * dx + dy * dy) / norm) : 0.f;
+    }
+    qsort(err, n, sizeof(float), _cmp_float);
+
+    return (ref_norm > 0.0) ? sqrt(diff / ref_norm) : 0.0;
+}
+
+// --- public
+
+/**
+ * Tree solvers accuracy vs speed: for each theta Barnes-Hut (monopole and quadrupole) and fast multipole (theta as
+ * fmm_theta) run from the initial population for `steps` steps. Writes one CSV row per run:
+ *   ms per step, of the tree build and of the force phase (averaged over the steps),
+ *   per borticle: node visits and interactions (Barnes-Hut) or cell-cell expansions and direct pairs (fast multipole),
+ *   relative acceleration error against direct summation (rms, median, p99),
+ *   the latter three measured on the first step.
+ */
+void bench_theta(FILE *fp, State *state, const float *thetas, size_t len, unsigned long steps) {
+    EXIT_IF(state == NULL, "no state");
+
+    size_t n = state->pop_len;
+    if (!n || !steps) {
+        LOG_ERROR("bench_theta: no borticles or steps");
+        return;
+    }
+
+    unsigned int algorithms = state->algorithms;
+    unsigned int direct_max = state->direct_max;
+    float theta = state->bh_theta;
+    float fmm_theta = state->fmm_theta;
+    bool quadrupole = state->bh_quadrupole;
+    unsigned int reuse = state->bh_reuse;
+    unsigned int every = state->bh_far_every;
+
+    // plain per borticle walks on every step: no cached interaction lists or far fields across the population resets
+    state->direct_max = 0;
+    state->bh_reuse = 0;
+    state->bh_far_every = 1;
+
+    Borticle *initial = malloc(n * sizeof(Borticle));
+    float *err = malloc(n * sizeof(float));
+    EXIT_IF(initial == NULL || err == NULL, "failed to allocate for bench_theta");
+    memcpy(initial, state->population, n * sizeof(Borticle));
+
+    // reference accelerations at the initial positions
+    Bodies ref = {0};
+    bodies_gather(&ref, state);
+    DirectCtx direct = {&ref, state->grav_g, state->softening * state->softening};
+
+    double start = time_monotonic();
+    parallel_for(n, ALGO_BATCH, _direct_batch, &direct);
+    double direct_ms = (time_monotonic() - start) * 1e3;
+
+    fprintf(fp, "# borticles: %zu, steps: %lu, threads: %u, direct summation: %.3f ms/step\n", n, steps, parallel_threads(), direct_ms);
+    fprintf(fp, "algorithm,theta,quadrupole,ms_step,ms_tree,ms_forces,visits,interactions,err_rms,err_median,err_p99\n");
+
+    // per theta: Barnes-Hut monopole, Barnes-Hut quadrupole, fast multipole
+    for (size_t k = 0; k < len * 3; k++) {
+        size_t t = k / 3;
+        memcpy(state->population, initial, n * sizeof(Borticle));
+        state->algorithms = (k % 3 == 2) ? ALGO_FMM : ALGO_BARNES_HUT;
+        state->bh_theta = thetas[t];
+        state->fmm_theta = thetas[t];
+        state->bh_quadrupole = k % 3 == 1;
+
+        // first step: accuracy and tree statistics
+        start = time_monotonic();
+        bort_update(state);
+        double elapsed = time_monotonic() - start;
+
+        unsigned long visits, interactions;
+        if (state->algorithms == ALGO_FMM) {
+            fmm_stats(&visits, &interactions);
+        } else {
+            barnes_hut_stats(&visits, &interactions);
+        }
+
+        double rms = _accuracy(state, &ref, err);
+
+        // remaining steps: timing only
+        start = time_monotonic();
+        for (unsigned long s = 1; s < steps; s++) {
+            bort_update(state);
+        }
+        elapsed += time_monotonic() - start;
+
+        fprintf(fp, "%s,%.3f,%d,%.4f,%.4f,%.4f,%.1f,%.1f,%.6f,%.6f,%.6f\n",
+            (state->algorithms == ALGO_FMM) ? algo_fmm.name : algo_barnes_hut.name,
+            thetas[t],
+            state->bh_quadrupole || state->algorithms == ALGO_FMM,
+            elapsed * 1e3 / steps,
+            _avg_ms(PROF_TREE_BUILD, steps),
+            _avg_ms(PROF_FORCES, steps),
+            (double) visits / n,
+            (double) interactions / n,
+            rms,
+            err[n / 2],
+            err[(size_t) (n * 0.99)]
+        );
+    }
+
+    // restore
+    memcpy(state->population, initial, n * sizeof(Borticle));
+    state->algorithms = algorithms;
+    state->direct_max = direct_max;
+    state->bh_theta = theta;
+    state->fmm_theta = fmm_theta;
+    state->bh_quadrupole = quadrupole;
+    state->bh_reuse = reuse;
+    state->bh_far_every = every;
+
+    bodies_destroy(&ref);
+    freez(initial);
+    freez(err);
+}
+
+/**
+ * Multi-rate Barnes-Hut: for each bh_far_every (with the current theta and quadrupole setting) a run from the initial population
+ * for `steps` steps, rounded up to a multiple of it. Writes one CSV row per run:
+ *   ms per step, of the tree build and of the force phase (averaged over the steps),
+ *   relative acceleration error against direct summation (rms, median, p99) on the last step, where the cached far field is the oldest.
+ */
+void bench_far_every(FILE *fp, State *state, const unsigned int *far_every, size_t len, unsigned long steps) {
+    EXIT_IF(state == NULL, "no state");
+
+    size_t n = state->pop_len;
+    if (!n || !steps) {
+        LOG_ERROR("bench_far_every: no borticles or steps");
+        return;
+    }
+
+    unsigned int algorithms = state->algorithms;
+    unsigned int direct_max = state->direct_max;
+    unsigned int reuse = state->bh_reuse;
+    unsigned int every = state->bh_far_every;
+    unsigned long step = state->step;
+
+    state->algorithms = ALGO_BARNES_HUT;
+    state->direct_max = 0;
+    state->bh_reuse = 0;
+
+    Borticle *initial = malloc(n * sizeof(Borticle));
+    float *err = malloc(n * sizeof(float));
+    EXIT_IF(initial == NULL || err == NULL, "failed to allocate for bench_far_every");
+    memcpy(initial, state->population, n * sizeof(Borticle));
+
+    Bodies ref = {0};
+    DirectCtx direct = {&ref, state->grav_g, state->softening * state->softening};
+
+    fprintf(fp, "# borticles: %zu, theta: %.3f, quadrupole: %d, threads: %u\n", n, state->bh_theta, state->bh_quadrupole, parallel_threads());
+    fprintf(fp, "far_every,steps,ms_step,ms_tree,ms_forces,err_rms,err_median,err_p99\n");
+
+    for (size_t k = 0; k < len; k++) {
+        unsigned long run = (steps + far_every[k] - 1) / far_every[k] * far_every[k];
+        memcpy(state->population, initial, n * sizeof(Borticle));
+        state->bh_far_every = far_every[k];
+        state->step = 0; // walks on the first step
+
+        // all but the last step: timing only
+        double elapsed = 0.0;
+        double start = time_monotonic();
+        for (unsigned long s = 1; s < run; s++) {
+            bort_update(state);
+        }
+        elapsed += time_monotonic() - start;
+
+        // reference accelerations at the positions of the last step
+        bodies_gather(&ref, state);
+        parallel_for(n, ALGO_BATCH, _direct_batch, &direct);
+
+        start = time_monotonic();
+        bort_update(state);
+        elapsed += time_monotonic() - start;
+
+        double rms = _accuracy(state, &ref, err);
+
+        fprintf(fp, "%u,%lu,%.4f,%.4f,%.4f,%.6f,%.6f,%.6f\n",
+            far_every[k],
+            run,
+            elapsed * 1e3 / run,
+            _avg_ms(PROF_TREE_BUILD, run),
+            _avg_ms(PROF_FORCES, run),
+            rms,
+            err[n / 2],
+            err[(size_t) (n * 0.99)]
+        );
+    }
+
+    // restore
+    memcpy(state->population, initial, n * sizeof(Borticle));
+    state->algorithms = algorithms;
+    state->direct_max = direct_max;
+    state->bh_reuse = reuse;
+    state->bh_far_every = every;
+    state->step = step;
+
+    bodies_destroy(&ref);
+    freez(initial);
+    freez(err);
+}
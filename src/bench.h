@@ -0,0 +1,16 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stdio.h>
+#include <stddef.h>
+
+typedef struct State State;
+
+////
+// Benchmarks (headless)
+////
+
+void bench_theta(FILE *fp, State *state, const float *thetas, size_t len, unsigned long steps);
+void bench_far_every(FILE *fp, State *state, const unsigned int *far_every, size_t len, unsigned long steps);
+
+#endif
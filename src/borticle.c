@@ -1,21 +1,32 @@
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
 
 #include <glad/glad.h>
 
 #include "utils.h"
 #include "log.h"
+#include "profiler.h"
+#include "trace.h"
+#include "parallel.h"
 
 #include "state.h"
+#include "algorithm.h"
 
 #include "shader.h"
 #include "borticle.h"
+#include "sim.h"
 
 #include "qtree/qtree.h"
 
 typedef enum {
     BUF_VERTEXES,
     BUF_POSITIONS,
+    BUF_PREV_POSITIONS,
     BUF_COLORS,
     BUF_NUM,
 } BufferObjects;
@@ -31,9 +42,32 @@ void bort_init_matrices(ShaderInfo *shader, float model[4][4], float view[4][4],
     shader->loc_model      = shader_set_uniform_mat4(shader->program, "model", model);
     shader->loc_view       = shader_set_uniform_mat4(shader->program, "view", view);
     shader->loc_projection = shader_set_uniform_mat4(shader->program, "projection", projection);
+    shader->loc_alpha      = glGetUniformLocation(shader->program, "alpha");
     glUseProgram(0);
 }
 
+/**
+ * View and projection of the window. 2D: orthographic in window coordinates (y down).
+ * 3D: perspective camera at z = -dist looking toward +z at the window center, y down. The z = 0 plane fills the window
+ * with the same orientation as in 2D (the eye on the +z side would mirror x). point_scale: camera distance of that plane, 1 in 2D
+ */
+void bort_camera(State *state, mat4_t *view, mat4_t *projection, float *point_scale) {
+    float w = (float) state->width;
+    float h = (float) state->height;
+
+    if (state->dims != 3) {
+        *view = m4_identity();
+        *projection = m4_ortho(0.f, w, h, 0.f, 0.f, 1.f);
+        *point_scale = 1.f;
+        return;
+    }
+
+    float dist = (h / 2) / tanf(30.f * (float) M_PI / 180.f);
+    *view = m4_look_at(vec3(w / 2, h / 2, -dist), vec3(w / 2, h / 2, 0.f), vec3(0.f, -1.f, 0.f));
+    *projection = m4_perspective(60.f, w / h, 1.f, dist * 4);
+    *point_scale = dist;
+}
+
 void bort_init_shaders_data(ShaderInfo *shader, State *state) {
     float cx  = (float) state->width / 2;
     float cy  = (float) state->height / 2;
@@ -59,13 +93,17 @@ void bort_init_shaders_data(ShaderInfo *shader, State *state) {
     glBindBuffer(GL_ARRAY_BUFFER, shader->vbo[BUF_VERTEXES]);
     glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 
-    // - set up positions data (empty)
+    // - set up positions data (empty), sized for pop_max as the population may grow at runtime
     glBindBuffer(GL_ARRAY_BUFFER, shader->vbo[BUF_POSITIONS]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vec4) * state->pop_len, NULL, GL_DYNAMIC_DRAW);    // NULL (empty) buffer
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vec4) * state->pop_max, NULL, GL_DYNAMIC_DRAW);    // NULL (empty) buffer
+
+    // - set up previous positions data (empty)
+    glBindBuffer(GL_ARRAY_BUFFER, shader->vbo[BUF_PREV_POSITIONS]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vec4) * state->pop_max, NULL, GL_DYNAMIC_DRAW);    // NULL (empty) buffer
 
     // - set up colors data (empty)
     glBindBuffer(GL_ARRAY_BUFFER, shader->vbo[BUF_COLORS]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(rgba) * state->pop_len, NULL, GL_STREAM_DRAW);    // NULL (empty) buffer
+    glBufferData(GL_ARRAY_BUFFER, sizeof(rgba) * state->pop_max, NULL, GL_STREAM_DRAW);    // NULL (empty) buffer
 
     // 3. cleanup
 
@@ -77,6 +115,8 @@ void bort_init_shaders_data(ShaderInfo *shader, State *state) {
 /**
  * Initializes a segment population of borticles from a certain offset to state_>pop_len
  * Note that state->population MUST be already allocated with the proper length.
+ * Each borticle draws from its own random stream (state->seed, index), so the result does not depend on
+ * the segments or the order in which they are initialized.
  */
 void bort_init(State *state, unsigned int start, unsigned int end) {
     Borticle *bort;
@@ -95,56 +135,45 @@ void bort_init(State *state, unsigned int start, unsigned int end) {
     float hw = (float) state->width / 2;
     float hh = (float) state->height / 2;
 
+    Rng rng;
+
+    const Algorithm *active[ALGO_MAX];
+    size_t active_len = algo_active(state, active, ALGO_MAX);
+
     for (unsigned int i = start; i < end; i++) {
         bort = &state->population[i];
+        rng_seed(&rng, state->seed, i);
 
         bort->id = i;
         bort->pos = (vec3_t) {hw, hh, 0.f};
         bort->color = (rgba) {1.f, 1.f, 1.f, 1.f};
 
-        if (state->algorithms == ALGO_NONE) {
-            bort_init_default(state, bort, i);
+        for (size_t a = 0; a < active_len; a++) {
+            if (active[a]->init) {
+                active[a]->init(state, bort, i, &rng);
+            }
         }
+    }
+}
 
-        if (state->algorithms & ALGO_NOMADIC) {
-            bort_init_nomadic(state, bort, i);
-        }
+typedef struct AlgoBatch {
+    const Algorithm *algo;
+    State *state;
+} AlgoBatch;
 
-        if (state->algorithms & ALGO_BARNES_HUT) {
-            bort_init_barnes_hut(state, bort, i);
-        }
-    }
+static void _update_batch(void *ctx, size_t start, size_t end) {
+    AlgoBatch *batch = (AlgoBatch*) ctx;
+    batch->algo->update(batch->state, start, end);
 }
 
 /**
- * Updates a poplation of borticles
+ * Packs the vbo data of [start, end)
  */
-void bort_update(State *state) {
-    Borticle *bort;
-    unsigned int i;
-
-    // build qtree and prepare vbos for drawing
-
-    for (i = 0; i < state->pop_len; i++) {
-        bort = &state->population[i];
-        if (!bort) {
-            LOG_WARN_F("no borticle stored in population slot %d", i);
-            continue;
-        }
+static void _pack_batch(void *ctx, size_t start, size_t end) {
+    State *state = (State*) ctx;
 
-        // insert boricle into qtree
-
-        int res = qtree_insert(
-            state->tree,
-            bort,
-            (vec2) {
-                bort->pos.x,
-                bort->pos.y
-            },
-            bort->size
-        );
-
-        // update vertex data for vbos
+    for (size_t i = start; i < end; i++) {
+        Borticle *bort = &state->population[i];
 
         state->positions[i] = (vec4) {
             bort->pos.x,
@@ -154,37 +183,227 @@ void bort_update(State *state) {
         };
 
         state->colors[i] = bort->color;
-        // printf("--  %i:%i, %f (%ld)\n", i, bort->id, bort->size, state->pop_len);
     }
+}
 
-    // apply algorithms (changes are drawn in nect cycle)
+typedef struct BoundsBatch {
+    const Borticle *population;
+    pthread_mutex_t lock;
+    float min[4], max[4]; // x, y, z, -
+} BoundsBatch;
 
-    for (i = 0; i < state->pop_len; i++) {
-        bort = &state->population[i];
+/**
+ * Min/max of the positions in [start, end), merged into the batch result
+ */
+static void _bounds_batch(void *ctx, size_t start, size_t end) {
+    BoundsBatch *batch = (BoundsBatch*) ctx;
+    const Borticle *pop = batch->population;
+    float min[4], max[4];
+
+#if defined(__SSE__)
+    // pos is followed by vel within Borticle, so a 4 lane load stays in bounds, the 4th lane is ignored
+    // operand order: minps/maxps return the second operand if one is NaN
+    __m128 vmin = _mm_set1_ps(INFINITY);
+    __m128 vmax = _mm_set1_ps(-INFINITY);
+    for (size_t i = start; i < end; i++) {
+        __m128 p = _mm_loadu_ps(&pop[i].pos.x);
+        vmin = _mm_min_ps(p, vmin);
+        vmax = _mm_max_ps(p, vmax);
+    }
+    _mm_storeu_ps(min, vmin);
+    _mm_storeu_ps(max, vmax);
+#else
+    for (int k = 0; k < 3; k++) {
+        min[k] = INFINITY;
+        max[k] = -INFINITY;
+    }
+    for (size_t i = start; i < end; i++) {
+        min[0] = fminf(min[0], pop[i].pos.x);
+        min[1] = fminf(min[1], pop[i].pos.y);
+        min[2] = fminf(min[2], pop[i].pos.z);
+        max[0] = fmaxf(max[0], pop[i].pos.x);
+        max[1] = fmaxf(max[1], pop[i].pos.y);
+        max[2] = fmaxf(max[2], pop[i].pos.z);
+    }
+#endif
 
-        if (!bort) {
-            continue;
-        }
+    pthread_mutex_lock(&batch->lock);
+    for (int k = 0; k < 3; k++) {
+        batch->min[k] = fminf(batch->min[k], min[k]);
+        batch->max[k] = fmaxf(batch->max[k], max[k]);
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/**
+ * Cube root bounds around all positions (parallel min/max reduction), independent of the window size.
+ * z is ignored in 2D. Falls back to the world size for an empty or diverged (non finite) population.
+ */
+static void _tree_bounds(State *state, vec3_t *min, vec3_t *max) {
+    BoundsBatch batch = {
+        .population = state->population,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .min = {INFINITY, INFINITY, INFINITY, 0.f},
+        .max = {-INFINITY, -INFINITY, -INFINITY, 0.f},
+    };
+    parallel_for(state->pop_len, BOUNDS_BATCH, _bounds_batch, &batch);
+
+    float w = batch.max[0] - batch.min[0];
+    float h = batch.max[1] - batch.min[1];
+    float d = (state->dims == 3) ? batch.max[2] - batch.min[2] : 0.f;
+    if (!state->pop_len || !isfinite(w) || !isfinite(h) || !isfinite(d)) {
+        float depth = (state->dims == 3) ? (float) state->height / 2.f : 1.f;
+        *min = (vec3_t) {0.f, 0.f, -depth};
+        *max = (vec3_t) {(float) state->width, (float) state->height, depth};
+        return;
+    }
+
+    // square (cube), padded so that points on the max edges are inside after rounding
+    float half = fmaxf(fmaxf(w, h), d) * .5f * (1.f + 1e-4f) + 1e-3f;
+    float cx = batch.min[0] + w * .5f;
+    float cy = batch.min[1] + h * .5f;
+    float cz = (state->dims == 3) ? batch.min[2] + d * .5f : 0.f;
+    *min = (vec3_t) {cx - half, cy - half, cz - half};
+    *max = (vec3_t) {cx + half, cy + half, cz + half};
+}
+
+/**
+ * (Re)builds the octree (3D) from the current borticle positions
+ */
+static void _build_octree(State *state) {
+    otree_destroy(state->otree);
+
+    vec3_t min, max;
+    _tree_bounds(state, &min, &max);
+    state->otree = otree_create(min, max);
+
+    for (unsigned int i = 0; i < state->pop_len; i++) {
+        Borticle *bort = &state->population[i];
+        otree_insert(state->otree, bort, (vec3_t) {bort->pos.x, bort->pos.y, bort->pos.z}, bort->size);
+    }
+}
+
+/**
+ * (Re)builds state->tree (2D) or state->otree (3D) from the current borticle positions, the root spans the population
+ */
+void bort_build_tree(State *state) {
+    prof_begin(PROF_TREE_BUILD);
+    if (state->dims == 3) {
+        _build_octree(state);
+        prof_end(PROF_TREE_BUILD);
+        return;
+    }
+
+    qtree_destroy(state->tree);
 
-        if (state->algorithms == ALGO_NONE) {
-            bort_update_default(state, bort, i);
+    vec3_t min, max;
+    _tree_bounds(state, &min, &max);
+    state->tree = qtree_create((vec2) {min.x, min.y}, (vec2) {max.x, max.y});
+
+    for (unsigned int i = 0; i < state->pop_len; i++) {
+        Borticle *bort = &state->population[i];
+        qtree_insert(state->tree, bort, (vec2) {bort->pos.x, bort->pos.y}, bort->size);
+    }
+    prof_end(PROF_TREE_BUILD);
+}
+
+static int _refit_node(QNode *node, void *ctx) {
+    if (qnode_isleaf(node)) {
+        Borticle *bort = (Borticle*) node->data;
+        node->pos = node->com = (vec2) {bort->pos.x, bort->pos.y};
+        for (QNode *entry = node->bucket; entry; entry = entry->next) {
+            bort = (Borticle*) entry->data;
+            entry->pos = entry->com = (vec2) {bort->pos.x, bort->pos.y};
         }
+    }
+    return QVISIT_CONTINUE;
+}
 
-        if (state->algorithms & ALGO_NOMADIC) {
-            bort_update_nomadic(state, bort, i);
+/**
+ * Moves the leaves of the current quadtree to their borticles' positions, the topology and node bounds are kept.
+ * Masses and moments of the pointer nodes (and the com of leaf buckets) are stale until qtree_aggregate().
+ */
+static void _refit_tree(State *state) {
+    prof_begin(PROF_TREE_BUILD);
+    qnode_visit(state->tree->root, _refit_node, NULL, NULL);
+    state->tree->refits++;
+    prof_end(PROF_TREE_BUILD);
+}
+
+/**
+ * Fills the vbo data (state->positions, state->colors) from the population
+ */
+void bort_pack(State *state) {
+    parallel_for(state->pop_len, PACK_BATCH, _pack_batch, state);
+}
+
+/**
+ * Updates a poplation of borticles (one simulation step)
+ */
+void bort_update(State *state) {
+    const Algorithm *active[ALGO_MAX];
+    size_t active_len = algo_active(state, active, ALGO_MAX);
+
+    // prepare vbos for drawing
+    bort_pack(state);
+
+    // build the qtree only if an algorithm reads it, otherwise drop the stale one:
+    // picking and the overlay rebuild it on demand (bort_build_tree())
+    // an algorithm may ask to keep the tree topology for the next step (it caches node pointers)
+    bool refit = state->tree_refit && state->tree && state->dims == 2;
+    state->tree_refit = false;
+
+    if (algo_requires(active, active_len) & ALGO_REQUIRES_QTREE) {
+        if (refit) {
+            _refit_tree(state);
+        } else {
+            bort_build_tree(state);
         }
+    } else {
+        qtree_destroy(state->tree);
+        state->tree = NULL;
+        otree_destroy(state->otree);
+        state->otree = NULL;
+    }
 
-        if (state->algorithms & ALGO_BARNES_HUT) {
-            bort_update_barnes_hut(state, bort, i);
+    // apply algorithms (changes are drawn in nect cycle)
+    // update() is recorded as PROF_FORCES (summed over the algorithms), prepare() and finish() record their own phases
+    // note: default and nomadic integrate within update()
+
+    uint64_t forces = 0;
+    for (size_t a = 0; a < active_len; a++) {
+        const Algorithm *algo = active[a];
+
+        if (algo->prepare) {
+            algo->prepare(state);
+        }
+        if (algo->update) {
+            trace_begin(prof_phases[PROF_FORCES]);
+            uint64_t start = time_monotonic_ns();
+            if (algo->parallel) {
+                AlgoBatch batch = {algo, state};
+                parallel_for(state->pop_len, ALGO_BATCH, _update_batch, &batch);
+            } else {
+                algo->update(state, 0, state->pop_len);
+            }
+            forces += time_monotonic_ns() - start;
+            trace_end(prof_phases[PROF_FORCES]);
+        }
+        if (algo->finish) {
+            algo->finish(state);
         }
     }
+    prof_record(PROF_FORCES, forces);
+
+    state->step++;
 }
 
 /**
- * prepares drawing to window
+ * prepares drawing to window, vbo data is taken from the latest completed simulation frame
+ * and interpolated by alpha between the previous (0.f) and the latest step (1.f)
  */
-void bort_draw_2D(ShaderInfo *shader, State *state) {
-    if (!shader) {
+void bort_draw_2D(ShaderInfo *shader, State *state, Frame *frame, float alpha) {
+    if (!shader || !frame) {
         return;
     }
     if (!state->ui_borticles) {
@@ -196,29 +415,43 @@ void bort_draw_2D(ShaderInfo *shader, State *state) {
     glVertexAttribDivisor(0, 0); // vertex
     glVertexAttribDivisor(1, 1); // positions
     glVertexAttribDivisor(2, 1); // colors
+    glVertexAttribDivisor(3, 1); // previous positions
+
+    glUniform1f(shader->loc_alpha, alpha);
 
     // vertex
     glEnableVertexAttribArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, shader->vbo[BUF_VERTEXES]);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid*)0); // 3 points, float data, no rgba
 
+    prof_begin(PROF_UPLOAD);
+
     // positions
     glEnableVertexAttribArray(1);
     glBindBuffer(GL_ARRAY_BUFFER, shader->vbo[BUF_POSITIONS]);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vec4) * state->pop_len, &state->positions[0]);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vec4) * frame->len, &frame->positions[0]);
     glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
     // colors
     glEnableVertexAttribArray(2);
     glBindBuffer(GL_ARRAY_BUFFER, shader->vbo[BUF_COLORS]);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(rgba) * state->pop_len, &state->colors[0]);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(rgba) * frame->len, &frame->colors[0]);
     glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
 
-    glDrawArraysInstanced(GL_POINTS, 0, 1, state->pop_len);
+    // previous positions
+    glEnableVertexAttribArray(3);
+    glBindBuffer(GL_ARRAY_BUFFER, shader->vbo[BUF_PREV_POSITIONS]);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vec4) * frame->len, &frame->prev_positions[0]);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+
+    prof_end(PROF_UPLOAD);
+
+    glDrawArraysInstanced(GL_POINTS, 0, 1, frame->len);
 
     glDisableVertexAttribArray(0);
     glDisableVertexAttribArray(1);
     glDisableVertexAttribArray(2);
+    glDisableVertexAttribArray(3);
 
     glBindVertexArray(0);
     glUseProgram(0);
@@ -8,7 +8,11 @@
 #include "utils.h"
 #include "shader.h"
 
+#define BOUNDS_BATCH 16384 // borticles per parallel range of the tree bounds reduction
+#define PACK_BATCH 16384 // borticles per parallel range of the vbo packing
+
 typedef struct State State;
+typedef struct Frame Frame;
 
 typedef struct Borticle {
     unsigned int id;
@@ -22,12 +26,15 @@ void bort_print(FILE *fp, Borticle *bort);
 // shaders
 void bort_init_shaders(ShaderInfo *shader);
 void bort_init_matrices(ShaderInfo *shader, float model[4][4], float view[4][4], float projection[4][4]);
+void bort_camera(State *state, mat4_t *view, mat4_t *projection, float *point_scale);
 void bort_init_shaders_data(ShaderInfo *shader, State *state);
 void bort_cleanup_shaders(ShaderInfo *shader);
 
 // population
 void bort_init(State *state, unsigned int start, unsigned int end);
 void bort_update(State *state);
-void bort_draw_2D(ShaderInfo *shader, State *state);
+void bort_pack(State *state);
+void bort_build_tree(State *state);
+void bort_draw_2D(ShaderInfo *shader, State *state, Frame *frame, float alpha);
 
 #endif
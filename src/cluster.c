@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "state.h"
+#include "borticle.h"
+#include "cluster.h"
+#include "parallel.h"
+
+#include "utils.h"
+#include "log.h"
+#include "trace.h"
+
+#define CLUSTER_BINS 4096 // histogram bins of the slab cuts
+#define CLUSTER_LET_THETA 0.5f // remote nodes are sent at a stricter theta: the receiving tree groups them again
+
+typedef enum {
+    CLUSTER_STEP = 1,
+    CLUSTER_STOP = 2,
+} ClusterCommand;
+
+/**
+ * rank 0 -> workers, once per step
+ */
+typedef struct ClusterControl {
+    uint32_t cmd;
+    uint32_t reset; // population changed on rank 0: workers drop their borticles, rank 0 reseeds
+    uint32_t algorithms;
+    uint32_t direct_max;
+    uint32_t bh_quadrupole;
+    float dt;
+    float grav_g;
+    float bh_theta;
+    float fmm_theta;
+    float softening;
+    float cuts[CLUSTER_MAX_RANKS + 1]; // slab r: cuts[r] <= x < cuts[r + 1]
+} ClusterControl;
+
+typedef struct ClusterBox {
+    vec2 min, max;
+    uint32_t len; // 0: no borticles, bounds are undefined
+} ClusterBox;
+
+/**
+ * Far node or leaf of a locally essential tree
+ */
+typedef struct ClusterMass {
+    float x, y, m;
+} ClusterMass;
+
+////
+// Framed messages
+////
+
+#define FRAME_HEADER sizeof(uint64_t)
+
+static void _buf_reserve(ClusterBuffer *buf, size_t size) {
+    if (size <= buf->max) {
+        return;
+    }
+    size_t max = (buf->max) ? buf->max : 4096;
+    while (max < size) {
+        max *= 2;
+    }
+    buf->data = realloc(buf->data, max);
+    EXIT_IF(buf->data == NULL, "failed to (re)allocate for ClusterBuffer");
+    buf->max = max;
+}
+
+static void _buf_reset(ClusterBuffer *buf) {
+    _buf_reserve(buf, FRAME_HEADER);
+    buf->len = FRAME_HEADER;
+}
+
+static void _buf_append(ClusterBuffer *buf, const void *data, size_t size) {
+    _buf_reserve(buf, buf->len + size);
+    memcpy(buf->data + buf->len, data, size);
+    buf->len += size;
+}
+
+static void *_buf_payload(ClusterBuffer *buf, size_t size, size_t *count) {
+    *count = (buf->len - FRAME_HEADER) / size;
+    return buf->data + FRAME_HEADER;
+}
+
+/**
+ * Sends out[r] to and receives in[r] from every peer r, interleaved over non-blocking sockets
+ * (peers exchange at the same time, blocking writes would deadlock on full socket buffers).
+ * Returns -1 if a peer is gone.
+ */
+static int _exchange(Cluster *c) {
+    struct pollfd pfd[CLUSTER_MAX_RANKS];
+    unsigned int peer[CLUSTER_MAX_RANKS];
+
+    for (unsigned int r = 0; r < c->ranks; r++) {
+        if (r == c->rank) {
+            continue;
+        }
+        ClusterBuffer *out = &c->out[r];
+        if (!out->len) {
+            _buf_reset(out);
+        }
+        uint64_t size = out->len - FRAME_HEADER;
+        memcpy(out->data, &size, FRAME_HEADER);
+        out->done = 0;
+
+        _buf_reset(&c->in[r]);
+        c->in[r].done = 0;
+    }
+
+    while (true) {
+        nfds_t n = 0;
+        for (unsigned int r = 0; r < c->ranks; r++) {
+            if (r == c->rank) {
+                continue;
+            }
+            short events = 0;
+            if (c->out[r].done < c->out[r].len) {
+                events |= POLLOUT;
+            }
+            if (c->in[r].done < c->in[r].len) {
+                events |= POLLIN;
+            }
+            if (events) {
+                pfd[n] = (struct pollfd) {c->fds[r], events, 0};
+                peer[n++] = r;
+            }
+        }
+        if (!n) {
+            return 0;
+        }
+
+        if (poll(pfd, n, -1) < 0) {
+            EXIT_IF_F(errno != EINTR, "cluster: poll failed (%d)", errno);
+            continue;
+        }
+
+        for (nfds_t k = 0; k < n; k++) {
+            ClusterBuffer *out = &c->out[peer[k]];
+            ClusterBuffer *in = &c->in[peer[k]];
+
+            if (pfd[k].revents & POLLOUT) {
+                ssize_t sent = send(pfd[k].fd, out->data + out->done, out->len - out->done, MSG_NOSIGNAL);
+                if (sent < 0 && errno != EAGAIN && errno != EINTR) {
+                    return -1;
+                }
+                out->done += (sent > 0) ? (size_t) sent : 0;
+            }
+
+            if (pfd[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t got = recv(pfd[k].fd, in->data + in->done, in->len - in->done, 0);
+                if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR)) {
+                    return -1;
+                }
+                in->done += (got > 0) ? (size_t) got : 0;
+
+                // header complete: expect the payload
+                if (in->done == FRAME_HEADER && in->len == FRAME_HEADER) {
+                    uint64_t size;
+                    memcpy(&size, in->data, FRAME_HEADER);
+                    _buf_reserve(in, FRAME_HEADER + size);
+                    in->len = FRAME_HEADER + size;
+                }
+            }
+        }
+    }
+}
+
+static void _reset_all(Cluster *c) {
+    for (unsigned int r = 0; r < c->ranks; r++) {
+        _buf_reset(&c->out[r]);
+    }
+}
+
+////
+// Domain decomposition
+////
+
+static unsigned int _slab(const ClusterControl *ctl, unsigned int ranks, float x) {
+    unsigned int r = 0;
+    while (r + 1 < ranks && x >= ctl->cuts[r + 1]) {
+        r++;
+    }
+    return r;
+}
+
+/**
+ * Cuts the population into slabs of equal counts along x (histogram quantiles)
+ */
+static void _cuts(ClusterControl *ctl, unsigned int ranks, const State *state) {
+    float min = INFINITY;
+    float max = -INFINITY;
+    for (unsigned int i = 0; i < state->pop_len; i++) {
+        float x = state->population[i].pos.x;
+        if (isfinite(x)) {
+            min = fminf(min, x);
+            max = fmaxf(max, x);
+        }
+    }
+
+    ctl->cuts[0] = -INFINITY;
+    for (unsigned int r = 1; r <= ranks; r++) {
+        ctl->cuts[r] = INFINITY;
+    }
+    if (!(max > min)) {
+        return; // all on rank 0
+    }
+
+    static unsigned int bins[CLUSTER_BINS];
+    memset(bins, 0, sizeof(bins));
+
+    float scale = CLUSTER_BINS / (max - min);
+    unsigned long len = 0;
+    for (unsigned int i = 0; i < state->pop_len; i++) {
+        float x = state->population[i].pos.x;
+        if (isfinite(x)) {
+            int b = (int) ((x - min) * scale);
+            bins[(b < CLUSTER_BINS) ? b : CLUSTER_BINS - 1]++;
+            len++;
+        }
+    }
+
+    unsigned long sum = 0;
+    unsigned int r = 1;
+    for (int b = 0; b < CLUSTER_BINS && r < ranks; b++) {
+        sum += bins[b];
+        while (r < ranks && sum >= len * r / ranks) {
+            ctl->cuts[r++] = min + (b + 1) / scale;
+        }
+    }
+}
+
+/**
+ * Resizes the local population, grows geometrically (the ghosts change every step)
+ */
+static void _local_resize(Cluster *c, unsigned int len) {
+    State *local = c->local;
+    if (len > local->pop_max) {
+        local->pop_max = len + len / 2;
+        state_resize(local, local->pop_max);
+    }
+    local->pop_len = len;
+}
+
+/**
+ * Far nodes (as seen from all of box) as point masses, otherwise descends down to the leaves
+ */
+static void _let(QNode *node, const ClusterBox *box, float theta2, ClusterBuffer *out) {
+    if (!node || node->mass <= 0.f) {
+        return;
+    }
+
+    ClusterMass mass = {node->com.x, node->com.y, node->mass};
+    if (qnode_isleaf(node)) {
+        _buf_append(out, &mass, sizeof(mass));
+        return;
+    }
+
+    float dx = fmaxf(fmaxf(box->min.x - node->com.x, node->com.x - box->max.x), 0.f);
+    float dy = fmaxf(fmaxf(box->min.y - node->com.y, node->com.y - box->max.y), 0.f);
+    float size = node->self_se.x - node->self_nw.x;
+    if (size * size < theta2 * (dx * dx + dy * dy)) {
+        _buf_append(out, &mass, sizeof(mass));
+        return;
+    }
+
+    _let(node->nw, box, theta2, out);
+    _let(node->ne, box, theta2, out);
+    _let(node->sw, box, theta2, out);
+    _let(node->se, box, theta2, out);
+}
+
+/**
+ * One step of the local population, run by all ranks after the control message
+ */
+static int _step(Cluster *c, const ClusterControl *ctl) {
+    State *local = c->local;
+    size_t count;
+
+    local->algorithms = ctl->algorithms;
+    local->direct_max = ctl->direct_max;
+    local->bh_quadrupole = ctl->bh_quadrupole;
+    local->dt = ctl->dt;
+    local->grav_g = ctl->grav_g;
+    local->bh_theta = ctl->bh_theta;
+    local->fmm_theta = ctl->fmm_theta;
+    local->softening = ctl->softening;
+
+    if (ctl->reset && c->rank != 0) {
+        local->pop_len = 0;
+    }
+
+    // migrate
+    trace_begin("cluster migrate");
+    _reset_all(c);
+    unsigned int own = 0;
+    for (unsigned int i = 0; i < local->pop_len; i++) {
+        Borticle *bort = &local->population[i];
+        unsigned int r = _slab(ctl, c->ranks, bort->pos.x);
+        if (r == c->rank) {
+            local->population[own++] = *bort;
+        } else {
+            _buf_append(&c->out[r], bort, sizeof(Borticle));
+        }
+    }
+    if (_exchange(c) < 0) {
+        return -1;
+    }
+    for (unsigned int r = 0; r < c->ranks; r++) {
+        if (r == c->rank) {
+            continue;
+        }
+        Borticle *in = _buf_payload(&c->in[r], sizeof(Borticle), &count);
+        _local_resize(c, own + count);
+        memcpy(&local->population[own], in, count * sizeof(Borticle));
+        own += count;
+    }
+    _local_resize(c, own);
+    trace_end("cluster migrate");
+
+    // bounding boxes
+    trace_begin("cluster let");
+    ClusterBox box = {{INFINITY, INFINITY}, {-INFINITY, -INFINITY}, 0};
+    for (unsigned int i = 0; i < own; i++) {
+        vec3_t pos = local->population[i].pos;
+        if (isfinite(pos.x) && isfinite(pos.y)) {
+            box.min = (vec2) {fminf(box.min.x, pos.x), fminf(box.min.y, pos.y)};
+            box.max = (vec2) {fmaxf(box.max.x, pos.x), fmaxf(box.max.y, pos.y)};
+            box.len++;
+        }
+    }
+    _reset_all(c);
+    for (unsigned int r = 0; r < c->ranks; r++) {
+        if (r != c->rank) {
+            _buf_append(&c->out[r], &box, sizeof(box));
+        }
+    }
+    if (_exchange(c) < 0) {
+        return -1;
+    }
+    ClusterBox boxes[CLUSTER_MAX_RANKS];
+    for (unsigned int r = 0; r < c->ranks; r++) {
+        if (r != c->rank) {
+            boxes[r] = *(ClusterBox*) _buf_payload(&c->in[r], sizeof(ClusterBox), &count);
+        }
+    }
+
+    // locally essential trees
+    _reset_all(c);
+    if (box.len) {
+        QTree *tree = qtree_create((vec2) {box.min.x - 1.f, box.min.y - 1.f}, (vec2) {box.max.x + 1.f, box.max.y + 1.f});
+        for (unsigned int i = 0; i < own; i++) {
+            Borticle *bort = &local->population[i];
+            qtree_insert(tree, bort, (vec2) {bort->pos.x, bort->pos.y}, bort->size);
+        }
+        qtree_aggregate(tree);
+
+        float theta = ctl->bh_theta * CLUSTER_LET_THETA;
+        float theta2 = theta * theta;
+        for (unsigned int r = 0; r < c->ranks; r++) {
+            if (r != c->rank && boxes[r].len) {
+                _let(tree->root, &boxes[r], theta2, &c->out[r]);
+            }
+        }
+        qtree_destroy(tree);
+    }
+    if (_exchange(c) < 0) {
+        return -1;
+    }
+    trace_end("cluster let");
+
+    // ghosts: received masses after the own borticles
+    unsigned int len = own;
+    for (unsigned int r = 0; r < c->ranks; r++) {
+        if (r == c->rank) {
+            continue;
+        }
+        ClusterMass *mass = _buf_payload(&c->in[r], sizeof(ClusterMass), &count);
+        _local_resize(c, len + count);
+        for (size_t k = 0; k < count; k++) {
+            local->population[len++] = (Borticle) {
+                .id = UINT_MAX,
+                .pos = {mass[k].x, mass[k].y, 0.f},
+                .size = mass[k].m,
+            };
+        }
+    }
+
+    bort_update(local);
+
+    // drop the ghosts (the trees point at them)
+    local->pop_len = own;
+    qtree_destroy(local->tree);
+    local->tree = NULL;
+
+    return 0;
+}
+
+/**
+ * Worker process main loop, returns when rank 0 stops the cluster (or is gone)
+ */
+static void _worker(Cluster *c) {
+    ClusterControl ctl;
+    size_t count;
+
+    while (true) {
+        _reset_all(c);
+        if (_exchange(c) < 0) {
+            return;
+        }
+        ClusterControl *in = _buf_payload(&c->in[0], sizeof(ClusterControl), &count);
+        if (!count) {
+            return;
+        }
+        ctl = *in;
+        if (ctl.cmd == CLUSTER_STOP) {
+            return;
+        }
+        if (_step(c, &ctl) < 0) {
+            return;
+        }
+
+        // gather
+        _reset_all(c);
+        _buf_append(&c->out[0], c->local->population, c->local->pop_len * sizeof(Borticle));
+        if (_exchange(c) < 0) {
+            return;
+        }
+    }
+}
+
+static State *_local_create(State *state) {
+    State *local = state_create();
+    local->width = state->width;
+    local->height = state->height;
+    local->dims = state->dims;
+    local->pop_max = 0;
+    local->seed = state->seed;
+    return local;
+}
+
+// --- public
+
+/**
+ * Forks ranks - 1 worker processes (call before creating any threads). Returns the cluster on rank 0, workers never return.
+ * The worker pool of each rank gets parallel_threads() / ranks threads.
+ */
+Cluster *cluster_create(State *state, unsigned int ranks) {
+    if (ranks < 2) {
+        return NULL;
+    }
+    if (ranks > CLUSTER_MAX_RANKS) {
+        LOG_WARN_F("cluster: ranks capped to %d", CLUSTER_MAX_RANKS);
+        ranks = CLUSTER_MAX_RANKS;
+    }
+    if (state->dims != 2) {
+        LOG_ERROR("cluster: 3D mode is not supported, running in a single process");
+        return NULL;
+    }
+
+    Cluster *c = calloc(1, sizeof(Cluster));
+    EXIT_IF(c == NULL, "failed to allocate Cluster");
+    c->ranks = ranks;
+
+    // fds[a][b]: rank a's end of the a-b socketpair
+    int fds[CLUSTER_MAX_RANKS][CLUSTER_MAX_RANKS];
+    for (unsigned int a = 0; a < ranks; a++) {
+        fds[a][a] = -1;
+        for (unsigned int b = a + 1; b < ranks; b++) {
+            int pair[2];
+            EXIT_IF_F(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0, "cluster: socketpair failed (%d)", errno);
+            fds[a][b] = pair[0];
+            fds[b][a] = pair[1];
+        }
+    }
+
+    // no worker threads across fork()
+    unsigned int threads = parallel_threads() / ranks;
+    parallel_init((threads) ? threads : 1);
+
+    fflush(NULL);
+    for (unsigned int k = 1; k < ranks; k++) {
+        pid_t pid = fork();
+        EXIT_IF_F(pid < 0, "cluster: fork failed (%d)", errno);
+        if (pid == 0) {
+            c->rank = k;
+            break;
+        }
+        c->pids[k] = pid;
+    }
+
+    // keep the own ends
+    for (unsigned int a = 0; a < ranks; a++) {
+        for (unsigned int b = 0; b < ranks; b++) {
+            if (a != b && a != c->rank) {
+                close(fds[a][b]);
+            }
+        }
+    }
+    for (unsigned int r = 0; r < ranks; r++) {
+        c->fds[r] = fds[c->rank][r];
+        if (c->fds[r] >= 0) {
+            fcntl(c->fds[r], F_SETFL, fcntl(c->fds[r], F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    c->local = _local_create(state);
+
+    if (c->rank != 0) {
+        _worker(c);
+        cluster_destroy(c);
+        fflush(NULL);
+        _exit(0);
+    }
+
+    LOG_INFO_F("cluster: %u ranks, %u threads each", ranks, parallel_threads());
+    return c;
+}
+
+/**
+ * Rank 0: stops and reaps the workers
+ */
+void cluster_destroy(Cluster *c) {
+    if (!c) {
+        return;
+    }
+
+    if (c->rank == 0) {
+        ClusterControl ctl = {.cmd = CLUSTER_STOP};
+        _reset_all(c);
+        for (unsigned int r = 1; r < c->ranks; r++) {
+            _buf_append(&c->out[r], &ctl, sizeof(ctl));
+        }
+        _exchange(c);
+
+        for (unsigned int r = 1; r < c->ranks; r++) {
+            waitpid(c->pids[r], NULL, 0);
+        }
+    }
+
+    for (unsigned int r = 0; r < c->ranks; r++) {
+        if (c->fds[r] >= 0) {
+            close(c->fds[r]);
+        }
+        freez(c->out[r].data);
+        freez(c->in[r].data);
+    }
+    state_destroy(c->local);
+    freez(c);
+}
+
+/**
+ * Rank 0: runs one step over all ranks and gathers the population back into state (by borticle id)
+ */
+void cluster_step(Cluster *c, State *state) {
+    ClusterControl ctl = {
+        .cmd = CLUSTER_STEP,
+        .reset = state->pop_len != c->total,
+        .algorithms = state->algorithms,
+        .direct_max = state->direct_max,
+        .bh_quadrupole = state->bh_quadrupole,
+        .dt = state->dt,
+        .grav_g = state->grav_g,
+        .bh_theta = state->bh_theta,
+        .fmm_theta = state->fmm_theta,
+        .softening = state->softening,
+    };
+    _cuts(&ctl, c->ranks, state);
+
+    // (re)seed: rank 0 holds all, the migration hands them out
+    if (ctl.reset) {
+        _local_resize(c, state->pop_len);
+        memcpy(c->local->population, state->population, state->pop_len * sizeof(Borticle));
+        c->total = state->pop_len;
+    }
+
+    _reset_all(c);
+    for (unsigned int r = 1; r < c->ranks; r++) {
+        _buf_append(&c->out[r], &ctl, sizeof(ctl));
+    }
+    EXIT_IF(_exchange(c) < 0, "cluster: lost a worker");
+    EXIT_IF(_step(c, &ctl) < 0, "cluster: lost a worker");
+
+    // gather
+    trace_begin("cluster gather");
+    _reset_all(c);
+    EXIT_IF(_exchange(c) < 0, "cluster: lost a worker");
+
+    for (unsigned int r = 0; r < c->ranks; r++) {
+        size_t count = c->local->pop_len;
+        Borticle *in = c->local->population;
+        if (r != 0) {
+            in = _buf_payload(&c->in[r], sizeof(Borticle), &count);
+        }
+        for (size_t k = 0; k < count; k++) {
+            if (in[k].id < state->pop_len) {
+                state->population[in[k].id] = in[k];
+            }
+        }
+    }
+    trace_end("cluster gather");
+
+    // the tree of the last step is stale
+    qtree_destroy(state->tree);
+    state->tree = NULL;
+
+    bort_pack(state);
+    state->step++;
+}
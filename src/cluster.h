@@ -0,0 +1,53 @@
+#ifndef __CLUSTER_H__
+#define __CLUSTER_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct State State;
+
+////
+// Cluster: domain decomposition over local processes
+//
+// Rank 0 forks ranks - 1 worker processes, each pair of ranks is connected by a Unix socketpair.
+// Every rank owns the borticles of a slab along x (cut at population quantiles by rank 0 per step).
+// Per step, all ranks in lockstep:
+//   control:  rank 0 sends the step parameters and slab cuts
+//   migrate:  borticles which left their slab move to the owning rank
+//   let:      each rank sends every other rank its locally essential tree: the nodes of its own tree
+//             that are far enough from the receiver's bounding box (as point masses), leaves otherwise
+//   step:     own borticles + received masses (ghosts) run through bort_update(), ghosts are dropped
+//   gather:   workers send their borticles to rank 0, which renders / records the full population
+//
+// Every exchange is a collective: each rank sends one framed message to and receives one from every peer
+////
+
+#define CLUSTER_MAX_RANKS 16
+
+typedef struct ClusterBuffer {
+    char *data;
+    size_t len;
+    size_t max;
+    size_t done; // bytes sent or received (framing included)
+} ClusterBuffer;
+
+typedef struct Cluster {
+    unsigned int rank;
+    unsigned int ranks;
+    int fds[CLUSTER_MAX_RANKS];    // socket to each peer, -1 for the own rank
+    pid_t pids[CLUSTER_MAX_RANKS]; // rank 0: worker processes
+
+    State *local;       // own borticles (+ ghosts within a step)
+    unsigned int total; // rank 0: population length the ranks were seeded with
+
+    ClusterBuffer out[CLUSTER_MAX_RANKS];
+    ClusterBuffer in[CLUSTER_MAX_RANKS];
+} Cluster;
+
+Cluster *cluster_create(State *state, unsigned int ranks);
+void cluster_destroy(Cluster *cluster);
+
+void cluster_step(Cluster *cluster, State *state);
+
+#endif
@@ -0,0 +1,294 @@
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GRAVITY_X86 1
+#endif
+
+#include "state.h"
+#include "gravity.h"
+
+#include "utils.h"
+#include "log.h"
+#include "profiler.h"
+#include "parallel.h"
+
+static float *_realloc_floats(float *ptr, size_t len) {
+    ptr = realloc(ptr, len * sizeof(float));
+    EXIT_IF(ptr == NULL, "failed to (re)allocate for Bodies");
+    return ptr;
+}
+
+static void _reserve(Bodies *bodies, size_t len) {
+    if (len <= bodies->max) {
+        return;
+    }
+    bodies->x = _realloc_floats(bodies->x, len);
+    bodies->y = _realloc_floats(bodies->y, len);
+    bodies->z = _realloc_floats(bodies->z, len);
+    bodies->m = _realloc_floats(bodies->m, len);
+    bodies->vx = _realloc_floats(bodies->vx, len);
+    bodies->vy = _realloc_floats(bodies->vy, len);
+    bodies->vz = _realloc_floats(bodies->vz, len);
+    bodies->ax = _realloc_floats(bodies->ax, len);
+    bodies->ay = _realloc_floats(bodies->ay, len);
+    bodies->az = _realloc_floats(bodies->az, len);
+    bodies->max = len;
+}
+
+/**
+ * Sums the accelerations of the sources [j0, j1) onto the targets [start, end)
+ */
+static void _direct_block(Bodies *b, size_t start, size_t end, size_t j0, size_t j1, float eps2) {
+    const float *bx = b->x;
+    const float *by = b->y;
+    const float *bz = b->z;
+    const float *bm = b->m;
+
+    for (size_t i = start; i < end; i++) {
+        float xi = bx[i];
+        float yi = by[i];
+        float zi = bz[i];
+        float ax = 0.f;
+        float ay = 0.f;
+        float az = 0.f;
+
+        for (size_t j = j0; j < j1; j++) {
+            float dx = bx[j] - xi;
+            float dy = by[j] - yi;
+            float dz = bz[j] - zi;
+            float r2 = dx * dx + dy * dy + dz * dz + eps2;
+            float inv = 1.f / sqrtf(r2);
+            float s = (r2 > 0.f) ? bm[j] * inv * inv * inv : 0.f; // self (without softening)
+            ax += dx * s;
+            ay += dy * s;
+            az += dz * s;
+        }
+
+        b->ax[i] += ax;
+        b->ay[i] += ay;
+        b->az[i] += az;
+    }
+}
+
+#ifdef GRAVITY_X86
+
+/**
+ * _direct_block() with 8 sources per iteration, compiled for avx regardless of the build flags and only called
+ * if the cpu supports it
+ */
+__attribute__((target("avx")))
+static void _direct_block_avx(Bodies *b, size_t start, size_t end, size_t j0, size_t j1, float eps2) {
+    const float *bx = b->x;
+    const float *by = b->y;
+    const float *bz = b->z;
+    const float *bm = b->m;
+
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.f);
+    __m256 e = _mm256_set1_ps(eps2);
+
+    for (size_t i = start; i < end; i++) {
+        __m256 xi = _mm256_set1_ps(bx[i]);
+        __m256 yi = _mm256_set1_ps(by[i]);
+        __m256 zi = _mm256_set1_ps(bz[i]);
+        __m256 vax = zero;
+        __m256 vay = zero;
+        __m256 vaz = zero;
+
+        size_t j = j0;
+        for (; j + 8 <= j1; j += 8) {
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(&bx[j]), xi);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(&by[j]), yi);
+            __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(&bz[j]), zi);
+            __m256 r2 = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)), e);
+            __m256 inv = _mm256_div_ps(one, _mm256_sqrt_ps(r2));
+            __m256 s = _mm256_mul_ps(_mm256_loadu_ps(&bm[j]), _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv)));
+            s = _mm256_and_ps(s, _mm256_cmp_ps(r2, zero, _CMP_GT_OQ));
+            vax = _mm256_add_ps(vax, _mm256_mul_ps(dx, s));
+            vay = _mm256_add_ps(vay, _mm256_mul_ps(dy, s));
+            vaz = _mm256_add_ps(vaz, _mm256_mul_ps(dz, s));
+        }
+
+        float sx[8], sy[8], sz[8];
+        _mm256_storeu_ps(sx, vax);
+        _mm256_storeu_ps(sy, vay);
+        _mm256_storeu_ps(sz, vaz);
+        float ax = sx[0] + sx[1] + sx[2] + sx[3] + sx[4] + sx[5] + sx[6] + sx[7];
+        float ay = sy[0] + sy[1] + sy[2] + sy[3] + sy[4] + sy[5] + sy[6] + sy[7];
+        float az = sz[0] + sz[1] + sz[2] + sz[3] + sz[4] + sz[5] + sz[6] + sz[7];
+
+        // remainder
+        for (; j < j1; j++) {
+            float dx = bx[j] - bx[i];
+            float dy = by[j] - by[i];
+            float dz = bz[j] - bz[i];
+            float r2 = dx * dx + dy * dy + dz * dz + eps2;
+            float inv = 1.f / sqrtf(r2);
+            float s = (r2 > 0.f) ? bm[j] * inv * inv * inv : 0.f;
+            ax += dx * s;
+            ay += dy * s;
+            az += dz * s;
+        }
+
+        b->ax[i] += ax;
+        b->ay[i] += ay;
+        b->az[i] += az;
+    }
+}
+
+#endif
+
+// --- public
+
+/**
+ * Random position, size and color inside the world, (almost) at rest
+ */
+void gravity_init(State *state, Borticle *bort, size_t index, Rng *rng) {
+    // state is required and wont be tested here
+    if (!bort) {
+        return;
+    }
+
+    bort->color = (rgba) {
+        rng_range_f(rng, 0.f, 1.f),
+        rng_range_f(rng, 0.f, 1.f),
+        rng_range_f(rng, 0.f, 1.f),
+        1.f
+    };
+
+    // 3D: a cube of depth height around the screen plane
+    float depth = (state->dims == 3) ? (float) state->height / 2.f : 0.f;
+    bort->pos = (vec3_t) {
+        rng_range_f(rng, 0.f, (float)state->width),
+        rng_range_f(rng, 0.f, (float)state->height),
+        (depth > 0.f) ? rng_range_f(rng, -depth, depth) : 0.f
+    };
+
+    // px/s
+    bort->vel = (vec3_t) {
+        rng_range_f(rng, -1.f, 1.f),
+        rng_range_f(rng, -1.f, 1.f),
+        (depth > 0.f) ? rng_range_f(rng, -1.f, 1.f) : 0.f
+    };
+
+    // computed on the first step
+    bort->acc = (vec3_t) {0.f, 0.f, 0.f};
+
+    bort->size = rng_range_f(rng, 0.1f, 6.f);
+}
+
+typedef struct BodiesBatch {
+    Bodies *bodies;
+    State *state;
+} BodiesBatch;
+
+static void _gather_batch(void *ctx, size_t start, size_t end) {
+    BodiesBatch *batch = (BodiesBatch*) ctx;
+    Bodies *bodies = batch->bodies;
+
+    for (size_t i = start; i < end; i++) {
+        Borticle *bort = &batch->state->population[i];
+        bodies->x[i] = bort->pos.x;
+        bodies->y[i] = bort->pos.y;
+        bodies->z[i] = bort->pos.z;
+        bodies->m[i] = bort->size;
+        bodies->vx[i] = bort->vel.x;
+        bodies->vy[i] = bort->vel.y;
+        bodies->vz[i] = bort->vel.z;
+    }
+}
+
+static void _integrate_batch(void *ctx, size_t start, size_t end) {
+    BodiesBatch *batch = (BodiesBatch*) ctx;
+    Bodies *bodies = batch->bodies;
+    float dt = batch->state->dt;
+
+    for (size_t i = start; i < end; i++) {
+        bodies->vx[i] += bodies->ax[i] * dt;
+        bodies->vy[i] += bodies->ay[i] * dt;
+        bodies->vz[i] += bodies->az[i] * dt;
+        bodies->x[i] += bodies->vx[i] * dt;
+        bodies->y[i] += bodies->vy[i] * dt;
+        bodies->z[i] += bodies->vz[i] * dt;
+    }
+
+    for (size_t i = start; i < end; i++) {
+        Borticle *bort = &batch->state->population[i];
+        bort->pos.x = bodies->x[i];
+        bort->pos.y = bodies->y[i];
+        bort->pos.z = bodies->z[i];
+        bort->vel.x = bodies->vx[i];
+        bort->vel.y = bodies->vy[i];
+        bort->vel.z = bodies->vz[i];
+        bort->acc.x = bodies->ax[i];
+        bort->acc.y = bodies->ay[i];
+        bort->acc.z = bodies->az[i];
+    }
+}
+
+/**
+ * Copies positions, velocities and masses (sizes) of the population
+ */
+void bodies_gather(Bodies *bodies, State *state) {
+    _reserve(bodies, state->pop_len);
+    bodies->len = state->pop_len;
+
+    BodiesBatch batch = {bodies, state};
+    parallel_for(bodies->len, BODIES_BATCH, _gather_batch, &batch);
+}
+
+/**
+ * Leapfrog (kick-drift) and scatter back into the population, velocities are stored at half steps:
+ *   v(t + dt/2) = v(t - dt/2) + a(t) * dt, x(t + dt) = x(t) + v(t + dt/2) * dt
+ */
+void bodies_integrate(Bodies *bodies, State *state) {
+    prof_begin(PROF_INTEGRATE);
+    BodiesBatch batch = {bodies, state};
+    parallel_for(bodies->len, BODIES_BATCH, _integrate_batch, &batch);
+    prof_end(PROF_INTEGRATE);
+}
+
+void bodies_destroy(Bodies *bodies) {
+    freez(bodies->x);
+    freez(bodies->y);
+    freez(bodies->z);
+    freez(bodies->m);
+    freez(bodies->vx);
+    freez(bodies->vy);
+    freez(bodies->vz);
+    freez(bodies->ax);
+    freez(bodies->ay);
+    freez(bodies->az);
+    *bodies = (Bodies) {0};
+}
+
+/**
+ * Exact all pairs accelerations of the targets [start, end) from all bodies, written to bodies->ax, ay.
+ * Sources are processed in tiles of GRAVITY_TILE so they stay in cache for all targets.
+ */
+void gravity_direct(Bodies *bodies, size_t start, size_t end, float grav_g, float eps2) {
+    for (size_t i = start; i < end; i++) {
+        bodies->ax[i] = 0.f;
+        bodies->ay[i] = 0.f;
+        bodies->az[i] = 0.f;
+    }
+
+    for (size_t j0 = 0; j0 < bodies->len; j0 += GRAVITY_TILE) {
+        size_t j1 = (j0 + GRAVITY_TILE < bodies->len) ? j0 + GRAVITY_TILE : bodies->len;
+#ifdef GRAVITY_X86
+        if (__builtin_cpu_supports("avx")) {
+            _direct_block_avx(bodies, start, end, j0, j1, eps2);
+            continue;
+        }
+#endif
+        _direct_block(bodies, start, end, j0, j1, eps2);
+    }
+
+    for (size_t i = start; i < end; i++) {
+        bodies->ax[i] *= grav_g;
+        bodies->ay[i] *= grav_g;
+        bodies->az[i] *= grav_g;
+    }
+}
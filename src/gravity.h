@@ -0,0 +1,41 @@
+#ifndef __GRAVITY_H__
+#define __GRAVITY_H__
+
+#include <stddef.h>
+
+#include "rng.h"
+
+typedef struct State State;
+typedef struct Borticle Borticle;
+
+////
+// Shared gravity kernels (Barnes-Hut, direct summation)
+//
+// Units: px, s. Accelerations are softened: G * m * d / (|d|^2 + eps^2)^(3/2)
+// Bodies are 3D, z stays 0 in 2D runs (state->dims)
+////
+
+/**
+ * Population as structure of arrays, gathered from and scattered back to state->population on every step
+ */
+typedef struct Bodies {
+    size_t len;
+    size_t max;
+    float *x, *y, *z, *m;
+    float *vx, *vy, *vz;
+    float *ax, *ay, *az;
+} Bodies;
+
+void gravity_init(State *state, Borticle *bort, size_t index, Rng *rng);
+
+#define BODIES_BATCH 16384 // bodies per parallel range of gather and integrate
+
+void bodies_gather(Bodies *bodies, State *state);
+void bodies_integrate(Bodies *bodies, State *state);
+void bodies_destroy(Bodies *bodies);
+
+#define GRAVITY_TILE 512 // source bodies per block (x, y, z, m: 8KB, stays in L1)
+
+void gravity_direct(Bodies *bodies, size_t start, size_t end, float grav_g, float eps2);
+
+#endif
@@ -0,0 +1,325 @@
+////
+// clear && make clean && make headless && ./bin/borticles-headless -p 100000 -n 100
+////
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string.h>
+#include <unistd.h> // getopt
+
+#include <time.h>
+
+#include "qtree/qtree.h"
+
+#include "log.h"
+#include "utils.h"
+#include "profiler.h"
+#include "trace.h"
+#include "parallel.h"
+#include "cluster.h"
+
+#include "state.h"
+#include "borticle.h"
+#include "snapshot.h"
+#include "recorder.h"
+#include "bench.h"
+
+// ui.o is linked as well
+#define MATH_3D_IMPLEMENTATION
+#include "external/math_3d.h"
+
+#define RAYGUI_IMPLEMENTATION
+#include "external/raygui.h"
+
+#define BENCH_THETAS_MAX 32
+
+typedef struct Options {
+    unsigned long steps;
+    char *load;
+    char *save;
+    char *record;
+    unsigned int record_stride;
+    float thetas[BENCH_THETAS_MAX];
+    size_t thetas_len;
+    unsigned int far_every[BENCH_THETAS_MAX];
+    size_t far_every_len;
+    unsigned int ranks;
+} Options;
+
+static void _configure(State *state, Options *opts, int argc, char **argv) {
+    int opt, ival;
+    float fval;
+    unsigned int pop_len = POP_MAX;
+    uint64_t seed = (uint64_t) time(NULL);
+
+    // default
+    state->algorithms = ALGO_BARNES_HUT;
+
+    char usage[] = "usage: %s [-h] [-n steps] [-r simulation rate (steps/sec)] [-g gravity constant] [-s seed] [-p particles:number] [-a algorithms <int,int, ...>] [-j threads] [-M processes] [-d direct summation below population] [-q Barnes-Hut quadrupoles] [-K Barnes-Hut reuse interaction lists for steps] [-F Barnes-Hut far field every steps] [-3 3D mode] [-l load snapshot file] [-o save snapshot file] [-t record trajectory file] [-e record every nth step] [-T trace file (chrome://tracing json)] [-b theta sweep <float,float, ...> (csv)] [-B far field every sweep <int,int, ...> (csv)]\n";
+    while ((opt = getopt(argc, argv, "n:r:g:s:p:a:l:o:t:e:T:j:M:d:qK:F:3b:B:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                opts->steps = strtoul(optarg, NULL, 10);
+            break;
+
+            case 'r':
+                ival = atoi(optarg);
+                if (!ival || ival < 0) {
+                    fprintf(stderr, "invalid 'r' option value\n");
+                    exit(1);
+                }
+
+                state->dt = 1.f / ival;
+            break;
+
+            case 'g':
+                fval = atof(optarg);
+                if (fval < 0.f) {
+                    fprintf(stderr, "invalid 'g' option value\n");
+                    exit(1);
+                }
+
+                state->grav_g = fval;
+            break;
+
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+            break;
+
+            case 'p':
+                ival = atoi(optarg);
+                if (!ival || ival < 0) {
+                    fprintf(stderr, "invalid '%c' option value\n", opt);
+                    exit(1);
+                }
+
+                pop_len = ival;
+            break;
+
+            case 'a': {
+                state->algorithms = 0; // reset
+                char *pt;
+                pt = strtok (optarg, ",");
+                while (pt != NULL) {
+                    int ival = atoi(pt);
+
+                    if (ival < 0 || ival >= ALGO_LEN) {
+                        fprintf(stderr, "invalid 'a' option value\n");
+                        exit(1);
+                    }
+                    state->algorithms |= (1 << ival);
+                    pt = strtok (NULL, ",");
+                }
+            }
+            break;
+
+            case 'l':
+                opts->load = optarg;
+            break;
+
+            case 'o':
+                opts->save = optarg;
+            break;
+
+            case 't':
+                opts->record = optarg;
+            break;
+
+            case 'e':
+                ival = atoi(optarg);
+                if (!ival || ival < 0) {
+                    fprintf(stderr, "invalid 'e' option value\n");
+                    exit(1);
+                }
+
+                opts->record_stride = ival;
+            break;
+
+            case 'j':
+                ival = atoi(optarg);
+                if (ival < 0) {
+                    fprintf(stderr, "invalid 'j' option value\n");
+                    exit(1);
+                }
+
+                parallel_init(ival);
+            break;
+
+            case 'M':
+                ival = atoi(optarg);
+                if (ival < 1 || ival > CLUSTER_MAX_RANKS) {
+                    fprintf(stderr, "invalid 'M' option value\n");
+                    exit(1);
+                }
+
+                opts->ranks = ival;
+            break;
+
+            case 'd':
+                ival = atoi(optarg);
+                if (ival < 0) {
+                    fprintf(stderr, "invalid 'd' option value\n");
+                    exit(1);
+                }
+
+                state->direct_max = ival;
+            break;
+
+            case 'K':
+                ival = atoi(optarg);
+                if (ival < 0) {
+                    fprintf(stderr, "invalid 'K' option value\n");
+                    exit(1);
+                }
+
+                state->bh_reuse = ival;
+            break;
+
+            case 'F':
+                ival = atoi(optarg);
+                if (ival < 1) {
+                    fprintf(stderr, "invalid 'F' option value\n");
+                    exit(1);
+                }
+
+                state->bh_far_every = ival;
+            break;
+
+            case 'q':
+                state->bh_quadrupole = true;
+            break;
+
+            case '3':
+                state->dims = 3;
+            break;
+
+            case 'b': {
+                char *pt = strtok(optarg, ",");
+                while (pt != NULL && opts->thetas_len < BENCH_THETAS_MAX) {
+                    fval = atof(pt);
+                    if (fval <= 0.f) {
+                        fprintf(stderr, "invalid 'b' option value\n");
+                        exit(1);
+                    }
+                    opts->thetas[opts->thetas_len++] = fval;
+                    pt = strtok(NULL, ",");
+                }
+            }
+            break;
+
+            case 'B': {
+                char *pt = strtok(optarg, ",");
+                while (pt != NULL && opts->far_every_len < BENCH_THETAS_MAX) {
+                    ival = atoi(pt);
+                    if (ival < 1) {
+                        fprintf(stderr, "invalid 'B' option value\n");
+                        exit(1);
+                    }
+                    opts->far_every[opts->far_every_len++] = ival;
+                    pt = strtok(NULL, ",");
+                }
+            }
+            break;
+
+            case 'T':
+                trace_init(optarg, TRACE_MAX_EVENTS);
+            break;
+
+            case 'h':
+
+            case '?':
+                fprintf(stderr, usage, argv[0]);
+                exit(0);
+            break;
+        }
+    }
+
+    // no window, no vbo limits
+    if (pop_len > state->pop_max) {
+        state->pop_max = pop_len;
+    }
+
+    state_set_seed(state, seed);
+
+    if (opts->load) {
+        double start = time_monotonic();
+        if (snapshot_load(state, opts->load) != 0) {
+            exit(1);
+        }
+        LOG_INFO_F("loaded snapshot '%s' (%d borticles) in %.3f ms", opts->load, state->pop_len, (time_monotonic() - start) * 1e3);
+    } else {
+        state_set_pop_len(state, pop_len);
+    }
+}
+
+int main(int argc, char **argv) {
+    Options opts = {100, NULL, NULL, NULL, 1, {0}, 0, {0}, 0, 1};
+
+    State *state = state_create();
+    _configure(state, &opts, argc, argv);
+
+    trace_thread_name("simulation");
+
+    // csv to stdout
+    if (opts.thetas_len || opts.far_every_len) {
+        if (opts.thetas_len) {
+            bench_theta(stdout, state, opts.thetas, opts.thetas_len, opts.steps);
+        }
+        if (opts.far_every_len) {
+            bench_far_every(stdout, state, opts.far_every, opts.far_every_len, opts.steps);
+        }
+        trace_write();
+        trace_destroy();
+        parallel_shutdown();
+        state_destroy(state);
+        return 0;
+    }
+
+    state_print(stdout, state);
+
+    Cluster *cluster = cluster_create(state, opts.ranks);
+    Recorder *recorder = (opts.record) ? recorder_create(opts.record, state, opts.record_stride) : NULL;
+
+    double start = time_monotonic();
+    for (unsigned long i = 0; i < opts.steps; i++) {
+        prof_begin(PROF_STEP);
+        if (cluster) {
+            cluster_step(cluster, state);
+        } else {
+            bort_update(state);
+        }
+        recorder_push(recorder, state);
+        prof_end(PROF_STEP);
+    }
+    double elapsed = time_monotonic() - start;
+
+    recorder_destroy(recorder);
+    cluster_destroy(cluster);
+
+    fprintf(stdout, "\n%lu steps, %d borticles: %.3f s (%.3f ms/step)\n\n", opts.steps, state->pop_len, elapsed, (opts.steps) ? elapsed * 1e3 / opts.steps : 0.0);
+
+    // the last PROF_SAMPLES steps
+    ProfStats stats;
+    fprintf(stdout, "%-12s %9s %9s %9s\n", "phase (ms)", "cur", "avg", "p99");
+    for (int i = 0; i < PROF_LEN; i++) {
+        prof_stats(i, &stats);
+        if (stats.count) {
+            fprintf(stdout, "%-12s %9.3f %9.3f %9.3f\n", prof_phases[i], stats.cur, stats.avg, stats.p99);
+        }
+    }
+
+    if (opts.save) {
+        double start = time_monotonic();
+        if (snapshot_save(state, opts.save) == 0) {
+            LOG_INFO_F("saved snapshot '%s' (%d borticles) in %.3f ms", opts.save, state->pop_len, (time_monotonic() - start) * 1e3);
+        }
+    }
+
+    trace_write();
+    trace_destroy();
+    parallel_shutdown();
+    state_destroy(state);
+
+    return 0;
+}
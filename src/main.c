@@ -19,9 +19,17 @@
 
 #include "log.h"
 #include "utils.h"
+#include "profiler.h"
+#include "trace.h"
+#include "parallel.h"
 
 #include "state.h"
 #include "borticle.h"
+#include "sim.h"
+#include "snapshot.h"
+#include "recorder.h"
+#include "replay.h"
+#include "cluster.h"
 
 #include "ui.h"
 
@@ -31,19 +39,28 @@
 #define RAYGUI_IMPLEMENTATION
 #include "external/raygui.h"
 
-static void _configure(State *state, int argc, char **argv) {
+typedef struct Options {
+    char *record;
+    unsigned int record_stride;
+    char *replay;
+    unsigned int ranks;
+} Options;
+
+static void _configure(State *state, Options *opts, int argc, char **argv) {
 
     int opt, ival;
     float fval;
     unsigned int pop_len = POP_MAX;
+    uint64_t seed = (uint64_t) time(NULL);
+    char *snapshot = NULL;
 
     // default
     state->algorithms |= ALGO_BARNES_HUT;
     // state->algorithms |= ALGO_NOMADIC;
     // state->algorithms = ALGO_NONE;
 
-    char usage[] = "usage: %s [-h] [-f fps] [-g gravity constant] [-p particles:number] [-a algorithms <int,int, ...>] [-P paused]\n";
-    while ((opt = getopt(argc, argv, "f:g:p:a:PDh")) != -1) {
+    char usage[] = "usage: %s [-h] [-f fps] [-r simulation rate (steps/sec)] [-m max simulation steps per frame] [-g gravity constant] [-s seed] [-p particles:number] [-a algorithms <int,int, ...>] [-j threads] [-M processes] [-d direct summation below population] [-q Barnes-Hut quadrupoles] [-K Barnes-Hut reuse interaction lists for steps] [-F Barnes-Hut far field every steps] [-3 3D mode] [-l load snapshot file] [-t record trajectory file] [-e record every nth step] [-R replay trajectory file] [-T trace file (chrome://tracing json)] [-P paused]\n";
+    while ((opt = getopt(argc, argv, "f:r:m:g:s:p:a:l:t:e:R:T:PDj:M:d:qK:F:3h")) != -1) {
         switch (opt) {
             case 'p':
                 ival = atoi(optarg);
@@ -65,6 +82,26 @@ static void _configure(State *state, int argc, char **argv) {
                 state->fps = ival;
             break;
 
+            case 'r':
+                ival = atoi(optarg);
+                if (!ival || ival < 0) {
+                    fprintf(stderr, "invalid 'r' option value\n");
+                    exit(1);
+                }
+
+                state->dt = 1.f / ival;
+            break;
+
+            case 'm':
+                ival = atoi(optarg);
+                if (!ival || ival < 0) {
+                    fprintf(stderr, "invalid 'm' option value\n");
+                    exit(1);
+                }
+
+                state->sim_max_steps = ival;
+            break;
+
             case 'g':
                 fval = atof(optarg);
                 if (!fval < 0.f) {
@@ -75,6 +112,10 @@ static void _configure(State *state, int argc, char **argv) {
                 state->grav_g = fval;
             break;
 
+            case 's':
+                seed = strtoull(optarg, NULL, 10);
+            break;
+
             case 'a': {
                 state->algorithms = 0; // reset
                 ival = -1;
@@ -93,6 +134,90 @@ static void _configure(State *state, int argc, char **argv) {
             }
             break;
 
+            case 'l':
+                snapshot = optarg;
+            break;
+
+            case 't':
+                opts->record = optarg;
+            break;
+
+            case 'e':
+                ival = atoi(optarg);
+                if (!ival || ival < 0) {
+                    fprintf(stderr, "invalid 'e' option value\n");
+                    exit(1);
+                }
+
+                opts->record_stride = ival;
+            break;
+
+            case 'R':
+                opts->replay = optarg;
+            break;
+
+            case 'j':
+                ival = atoi(optarg);
+                if (ival < 0) {
+                    fprintf(stderr, "invalid 'j' option value\n");
+                    exit(1);
+                }
+
+                parallel_init(ival);
+            break;
+
+            case 'M':
+                ival = atoi(optarg);
+                if (ival < 1 || ival > CLUSTER_MAX_RANKS) {
+                    fprintf(stderr, "invalid 'M' option value\n");
+                    exit(1);
+                }
+
+                opts->ranks = ival;
+            break;
+
+            case 'd':
+                ival = atoi(optarg);
+                if (ival < 0) {
+                    fprintf(stderr, "invalid 'd' option value\n");
+                    exit(1);
+                }
+
+                state->direct_max = ival;
+            break;
+
+            case 'K':
+                ival = atoi(optarg);
+                if (ival < 0) {
+                    fprintf(stderr, "invalid 'K' option value\n");
+                    exit(1);
+                }
+
+                state->bh_reuse = ival;
+            break;
+
+            case 'F':
+                ival = atoi(optarg);
+                if (ival < 1) {
+                    fprintf(stderr, "invalid 'F' option value\n");
+                    exit(1);
+                }
+
+                state->bh_far_every = ival;
+            break;
+
+            case 'q':
+                state->bh_quadrupole = true;
+            break;
+
+            case '3':
+                state->dims = 3;
+            break;
+
+            case 'T':
+                trace_init(optarg, TRACE_MAX_EVENTS);
+            break;
+
             case 'P':
                 state->paused = 1;
             break;
@@ -110,33 +235,180 @@ static void _configure(State *state, int argc, char **argv) {
         }
     }
 
-    state_set_pop_len(state, pop_len);
+    state_set_seed(state, seed);
+
+    if (snapshot) {
+        if (snapshot_load(state, snapshot) != 0) {
+            exit(1);
+        }
+    } else if (!opts->replay) {
+        state_set_pop_len(state, pop_len);
+    }
     // state_print(stdout, state);
 }
 
+/**
+ * Renders the simulation thread's frames, from here on state is owned by the simulation, changes are sent as commands
+ */
+static void _simulate(State *state, Options *opts, Cluster *cluster, ShaderInfo *bort, ShaderInfo *qt) {
+    Simulation *sim = sim_create(state);
+    Recorder *recorder = (opts->record) ? recorder_create(opts->record, state, opts->record_stride) : NULL;
+    sim->recorder = recorder;
+    sim->cluster = cluster;
+    ui_init(state, sim);
+    sim_start(sim);
+
+    Vector2 mpos = {0.f};
+    uint64_t last = time_monotonic_ns();
+
+    while (!WindowShouldClose()) {
+        uint64_t now = time_monotonic_ns();
+        prof_record(PROF_FRAME, now - last);
+        last = now;
+
+        trace_begin("frame");
+        Frame *frame = sim_frame(sim);
+
+        BeginDrawing();
+
+        ClearBackground(state->bg_color);
+
+        // update
+        ui_update(state, sim);
+
+        if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)){
+            mpos = GetMousePosition();
+            sim_send(sim, (Command) {.type = CMD_SELECT, .v = {mpos.x, mpos.y}});
+        }
+
+        // draw
+        bort_draw_2D(bort, state, frame, sim_alpha(frame));
+        qtree_draw_2D(qt, state, frame);
+
+        prof_begin(PROF_UI);
+        ui_draw(state, sim, frame);
+        prof_end(PROF_UI);
+
+        EndDrawing(); // includes waiting for the target fps
+        trace_end("frame");
+    }
+
+    sim_destroy(sim);
+    recorder_destroy(recorder); // after the simulation thread, drains the queue
+}
+
+#define REPLAY_SPEED_MIN (1.f / 16.f)
+#define REPLAY_SPEED_MAX 64.f
+
+/**
+ * Plays back a trajectory file: decoded records go straight into the vbos, no simulation or quadtree.
+ * speed is in records per rendered frame.
+ *   SPACE: pause, UP/DOWN: double/halve speed, LEFT/RIGHT: previous/next keyframe, HOME: restart
+ */
+static void _replay(State *state, Replay *replay, ShaderInfo *bort) {
+    float speed = 1.f;
+    float acc = 0.f;
+    bool paused = state->paused;
+    char status[256];
+
+    uint64_t last = time_monotonic_ns();
+
+    while (!WindowShouldClose()) {
+        uint64_t now = time_monotonic_ns();
+        prof_record(PROF_FRAME, now - last);
+        last = now;
+
+        trace_begin("frame");
+
+        // update
+        if (IsKeyPressed(KEY_SPACE)) paused = !paused;
+        if (IsKeyPressed(KEY_UP) && speed < REPLAY_SPEED_MAX) speed *= 2.f;
+        if (IsKeyPressed(KEY_DOWN) && speed > REPLAY_SPEED_MIN) speed /= 2.f;
+
+        // seek: back to the current keyframe first unless just passed it
+        if (IsKeyPressed(KEY_LEFT)) {
+            size_t key = replay->key;
+            if (key > 0 && replay->record <= replay->keys[key].record + 1) {
+                key--;
+            }
+            replay_seek(replay, key);
+        }
+        if (IsKeyPressed(KEY_RIGHT)) replay_seek(replay, replay->key + 1);
+        if (IsKeyPressed(KEY_HOME)) replay_seek(replay, 0);
+
+        if (!paused) {
+            trace_begin("decode");
+            acc += speed;
+            while (acc >= 1.f) {
+                acc -= 1.f;
+                if (replay_next(replay) != 0) {
+                    paused = 1; // end of file
+                    acc = 0.f;
+                    break;
+                }
+            }
+            trace_end("decode");
+        }
+
+        // draw
+        BeginDrawing();
+        ClearBackground(state->bg_color);
+
+        bort_draw_2D(bort, state, &replay->frame, 1.f);
+
+        snprintf(status, sizeof(status), "step %lu (%lu/%lu)  key %zu/%zu  speed %gx%s",
+            replay->frame.step, replay->record, replay->records, replay->key + 1, replay->keys_len, speed, (paused) ? "  [paused]" : "");
+        DrawText(status, 10, 10, 10, state->fg_color);
+        DrawFPS(10, 24);
+
+        EndDrawing(); // includes waiting for the target fps
+        trace_end("frame");
+    }
+}
+
 int main(int argc, char **argv) {
-    // set random seed
-    srand(time(NULL));
+    Options opts = {NULL, 1, NULL, 1};
 
     State *state = state_create();
-    _configure(state, argc, argv);
+    _configure(state, &opts, argc, argv);
+
+    // replay: the window and vbos are sized for the recording
+    Replay *replay = NULL;
+    if (opts.replay) {
+        replay = replay_open(opts.replay);
+        if (!replay) {
+            exit(1);
+        }
+        state->width = replay->header->width;
+        state->height = replay->header->height;
+        if (replay->max_len > state->pop_max) {
+            state->pop_max = replay->max_len;
+        }
+        LOG_INFO_F("replaying '%s': %lu records, %zu keyframes", opts.replay, replay->records, replay->keys_len);
+    }
+
+    // before any threads
+    Cluster *cluster = (!replay) ? cluster_create(state, opts.ranks) : NULL;
 
     // window
     InitWindow(state->width, state->height, "Borticles");
-    ui_init(state);
 
     // we will render point sizes
     glEnable(GL_PROGRAM_POINT_SIZE);
 
     // matrices
     mat4_t model = m4_identity();
-    mat4_t view = m4_identity();
-    mat4_t projection = m4_ortho(0.f, (float) state->width, (float) state->height, 0.f, 0.f, 1.f);
+    mat4_t view, projection;
+    float point_scale;
+    bort_camera(state, &view, &projection, &point_scale);
 
     // borticle shaders
     ShaderInfo bort = {0};
     bort_init_shaders(&bort);
     bort_init_matrices(&bort, model.m, view.m, projection.m);
+    glUseProgram(bort.program);
+    glUniform1f(glGetUniformLocation(bort.program, "point_scale"), point_scale);
+    glUseProgram(0);
     bort_init_shaders_data(&bort, state);
 
     // qtree shaders
@@ -144,71 +416,26 @@ int main(int argc, char **argv) {
     qtree_init_shaders(&qt);
     bort_init_matrices(&qt, model.m, view.m, projection.m);// TODO make common funcname name
 
-    // init population
-    bort_init(state, 0, state->pop_len);
-
     // fps calc
     SetTargetFPS(state->fps);
     state_print(stdout, state);
 
-    Vector2 mpos = {0.f};
-
-    while (!WindowShouldClose()) {
-
-        if (IsKeyPressed(KEY_SPACE)) {
-            state->paused = !state->paused;
-        }
-
-        if (state->paused) {
-
-            BeginDrawing();
-            ui_draw(state);
-            EndDrawing();
-
-            continue;
-        }
-
-        BeginDrawing();
-
-        ClearBackground(state->bg_color);
-
-        // update
-        state->tree = qtree_create((vec2){0.f, 0.f}, (vec2){(float) state->width, (float) state->height});
-        bort_update(state);
-        ui_update(state);
-
-        if (IsMouseButtonReleased(MOUSE_BUTTON_LEFT)){
-            mpos = GetMousePosition();
-            if (state->selected) {
-                state->selected = NULL;
-            } else {
-                QNode *nearest = qtree_find_nearest(state->tree, (vec2) {mpos.x, mpos.y});
-
-                if (nearest) {
-                    state->selected = (Borticle*) nearest->data;
-                }
-            }
-        }
-
-        // state_print(stdout, state);
-        // qtree_print(stdout, state->tree);exit(1);
-
-        // draw
-        bort_draw_2D(&bort, state);
-        qtree_draw_2D(&qt, state);
-        ui_draw(state);
-
-        // finalize
-        qtree_destroy(state->tree);
-        state->tree = NULL;
+    trace_thread_name("render");
 
-        EndDrawing();
+    if (replay) {
+        _replay(state, replay, &bort);
+    } else {
+        _simulate(state, &opts, cluster, &bort, &qt);
     }
 
-    // cleanup
+    trace_write();
+    trace_destroy();
 
     bort_cleanup_shaders(&bort);
     qtree_cleanup_shaders(&qt);
+    replay_close(replay);
+    cluster_destroy(cluster);
+    parallel_shutdown();
     state_destroy(state);
 
     CloseWindow();        // Close window and OpenGL context
@@ -0,0 +1,321 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "parallel.h"
+
+#include "log.h"
+
+////
+// Work stealing pool
+//
+// Persistent workers, each owns a deque of index ranges. parallel_for() deals [0, len) in contiguous
+// blocks to the deques and wakes the pool. A worker pops its newest range, splits off halves (pushed back)
+// until it is down to grain and runs it. Idle workers steal the oldest (largest) range of another deque,
+// so clustered, expensive regions get shared out instead of keeping one thread busy while the rest wait.
+////
+
+typedef struct Range {
+    size_t start;
+    size_t end;
+} Range;
+
+typedef struct Deque {
+    pthread_mutex_t lock;
+    Range items[PARALLEL_DEQUE_MAX];
+    size_t head; // oldest, stolen from
+    size_t tail; // newest, owner pushes and pops
+} Deque;
+
+typedef struct Pool {
+    unsigned int threads; // including the calling thread (worker 0)
+    pthread_t workers[PARALLEL_MAX_THREADS];
+    Deque deques[PARALLEL_MAX_THREADS];
+
+    pthread_mutex_t job_lock; // one parallel_for() at a time
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    unsigned long generation; // bumped per job
+    unsigned int busy;        // workers still inside the current job
+    bool quit;
+
+    // current job
+    ParallelFn fn;
+    void *ctx;
+    size_t grain;
+    atomic_size_t remaining; // items not yet processed
+} Pool;
+
+static unsigned int m_threads = 0; // 0: not yet initialized
+static Pool *m_pool = NULL;
+static _Thread_local bool m_inside = false; // nested parallel_for() runs inline
+
+static void _deque_push(Deque *dq, Range range) {
+    // callers check for space (_deque_full())
+    dq->items[dq->tail++] = range;
+}
+
+static bool _deque_full(Deque *dq) {
+    return dq->tail >= PARALLEL_DEQUE_MAX;
+}
+
+/**
+ * Owner side: newest range
+ */
+static bool _deque_pop(Deque *dq, Range *range) {
+    pthread_mutex_lock(&dq->lock);
+    bool found = dq->tail > dq->head;
+    if (found) {
+        *range = dq->items[--dq->tail];
+    }
+    if (dq->tail == dq->head) {
+        dq->head = dq->tail = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+/**
+ * Thief side: oldest range
+ */
+static bool _deque_steal(Deque *dq, Range *range) {
+    if (pthread_mutex_trylock(&dq->lock) != 0) {
+        return false;
+    }
+    bool found = dq->tail > dq->head;
+    if (found) {
+        *range = dq->items[dq->head++];
+    }
+    if (dq->tail == dq->head) {
+        dq->head = dq->tail = 0;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+/**
+ * Splits a range down to grain (upper halves go back onto the own deque), then runs it
+ */
+static void _run_range(Pool *pool, Deque *dq, Range range) {
+    while (range.end - range.start > pool->grain) {
+        size_t mid = range.start + (range.end - range.start) / 2;
+
+        pthread_mutex_lock(&dq->lock);
+        bool full = _deque_full(dq);
+        if (!full) {
+            _deque_push(dq, (Range) {mid, range.end});
+        }
+        pthread_mutex_unlock(&dq->lock);
+
+        if (full) {
+            break;
+        }
+        range.end = mid;
+    }
+
+    pool->fn(pool->ctx, range.start, range.end);
+    atomic_fetch_sub_explicit(&pool->remaining, range.end - range.start, memory_order_acq_rel);
+}
+
+/**
+ * Processes ranges of the current job until all items are done
+ */
+static void _work(Pool *pool, unsigned int id) {
+    Deque *own = &pool->deques[id];
+    Range range;
+
+    while (atomic_load_explicit(&pool->remaining, memory_order_acquire) > 0) {
+        if (_deque_pop(own, &range)) {
+            _run_range(pool, own, range);
+            continue;
+        }
+
+        bool stolen = false;
+        for (unsigned int i = 1; i < pool->threads && !stolen; i++) {
+            stolen = _deque_steal(&pool->deques[(id + i) % pool->threads], &range);
+        }
+        if (stolen) {
+            _run_range(pool, own, range);
+        } else {
+            sched_yield(); // the last ranges are in flight
+        }
+    }
+}
+
+static void *_worker(void *arg) {
+    unsigned int id = (unsigned int) (size_t) arg;
+    Pool *pool = m_pool;
+    unsigned long seen = 0;
+
+    m_inside = true;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->generation == seen && !pool->quit) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        _work(pool, id);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void _pool_start(unsigned int threads) {
+    Pool *pool = calloc(1, sizeof(Pool));
+    EXIT_IF(pool == NULL, "failed to allocate worker pool");
+
+    pool->threads = threads;
+    pthread_mutex_init(&pool->job_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    atomic_init(&pool->remaining, 0);
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+
+    m_pool = pool;
+    for (unsigned int i = 1; i < threads; i++) {
+        int err = pthread_create(&pool->workers[i], NULL, _worker, (void*) (size_t) i);
+        EXIT_IF_F(err != 0, "failed to create worker thread (%d)", err);
+    }
+}
+
+// --- public
+
+/**
+ * Sets the number of threads used by parallel_for(), 0: number of online cpus.
+ * Workers are (re)started on the next parallel_for()
+ */
+void parallel_init(unsigned int threads) {
+    parallel_shutdown();
+
+    if (!threads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = (cpus > 0) ? (unsigned int) cpus : 1;
+    }
+    m_threads = (threads > PARALLEL_MAX_THREADS) ? PARALLEL_MAX_THREADS : threads;
+}
+
+unsigned int parallel_threads() {
+    if (!m_threads) {
+        parallel_init(0);
+    }
+    return m_threads;
+}
+
+/**
+ * Stops and joins the workers, must not run concurrently with parallel_for()
+ */
+void parallel_shutdown() {
+    Pool *pool = m_pool;
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned int i = 1; i < pool->threads; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    for (unsigned int i = 0; i < pool->threads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+    }
+    pthread_mutex_destroy(&pool->job_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+
+    free(pool);
+    m_pool = NULL;
+}
+
+/**
+ * Runs fn over [0, len) in ranges of at most grain items (and at least grain / 2) on the pool.
+ * The calling thread works along and returns when all ranges are done.
+ * Runs inline when called from within fn or while another thread's parallel_for() is in progress.
+ */
+void parallel_for(size_t len, size_t grain, ParallelFn fn, void *ctx) {
+    if (!len) {
+        return;
+    }
+
+    grain = (grain) ? grain : 1;
+    unsigned int threads = parallel_threads();
+
+    if (threads <= 1 || len <= grain || m_inside) {
+        fn(ctx, 0, len);
+        return;
+    }
+
+    if (!m_pool) {
+        _pool_start(threads);
+    }
+    Pool *pool = m_pool;
+
+    if (pthread_mutex_trylock(&pool->job_lock) != 0) {
+        fn(ctx, 0, len);
+        return;
+    }
+
+    pool->fn = fn;
+    pool->ctx = ctx;
+    pool->grain = grain;
+    atomic_store_explicit(&pool->remaining, len, memory_order_release);
+
+    // deal contiguous blocks, workers split them on demand
+    size_t blocks = (len + grain - 1) / grain;
+    if (blocks > threads) {
+        blocks = threads;
+    }
+    size_t size = (len + blocks - 1) / blocks;
+    for (size_t i = 0; i < blocks; i++) {
+        size_t start = i * size;
+        if (start >= len) {
+            break;
+        }
+        Deque *dq = &pool->deques[i];
+        pthread_mutex_lock(&dq->lock);
+        _deque_push(dq, (Range) {start, (start + size < len) ? start + size : len});
+        pthread_mutex_unlock(&dq->lock);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->busy = threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    m_inside = true;
+    _work(pool, 0);
+    m_inside = false;
+
+    // barrier: no worker may still touch this job when the next one is dealt
+    pthread_mutex_lock(&pool->lock);
+    while (pool->busy > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_unlock(&pool->job_lock);
+}
@@ -0,0 +1,24 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <stddef.h>
+
+////
+// Data parallel loops over index ranges, run on a persistent work stealing pool (@see parallel.c)
+////
+
+#define PARALLEL_MAX_THREADS 64
+#define PARALLEL_DEQUE_MAX 64 // pending ranges per worker, halving keeps this at log2(len / grain)
+
+/**
+ * Processes [start, end), called concurrently for disjoint ranges
+ */
+typedef void (*ParallelFn)(void *ctx, size_t start, size_t end);
+
+void parallel_init(unsigned int threads);
+unsigned int parallel_threads();
+void parallel_shutdown();
+
+void parallel_for(size_t len, size_t grain, ParallelFn fn, void *ctx);
+
+#endif
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "profiler.h"
+#include "trace.h"
+#include "utils.h"
+
+// @see enum ProfPhase
+const char *prof_phases[PROF_LEN] = {
+    "step",
+    "tree build",
+    "mass",
+    "forces",
+    "integrate",
+    "overlay",
+    "vbo upload",
+    "ui draw",
+    "frame",
+};
+
+/**
+ * Each phase is recorded by a single thread, the ui reads the rings concurrently.
+ */
+typedef struct ProfRing {
+    atomic_uint_fast64_t samples[PROF_SAMPLES]; // ns
+    atomic_uint count;
+} ProfRing;
+
+static ProfRing m_rings[PROF_LEN];
+static _Thread_local uint64_t m_start[PROF_LEN];
+
+static int _cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Copies the recorded samples (oldest first), returns the number of samples copied.
+ */
+static size_t _copy(ProfPhase phase, uint64_t *out) {
+    ProfRing *ring = &m_rings[phase];
+    unsigned int count = atomic_load_explicit(&ring->count, memory_order_acquire);
+    size_t len = (count < PROF_SAMPLES) ? count : PROF_SAMPLES;
+
+    for (size_t i = 0; i < len; i++) {
+        size_t index = (count - len + i) & (PROF_SAMPLES - 1);
+        out[i] = atomic_load_explicit(&ring->samples[index], memory_order_relaxed);
+    }
+    return len;
+}
+
+// --- public
+
+void prof_begin(ProfPhase phase) {
+    trace_begin(prof_phases[phase]);
+    m_start[phase] = time_monotonic_ns();
+}
+
+void prof_end(ProfPhase phase) {
+    prof_record(phase, time_monotonic_ns() - m_start[phase]);
+    trace_end(prof_phases[phase]);
+}
+
+void prof_record(ProfPhase phase, uint64_t ns) {
+    ProfRing *ring = &m_rings[phase];
+    unsigned int count = atomic_load_explicit(&ring->count, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->samples[count & (PROF_SAMPLES - 1)], ns, memory_order_relaxed);
+    atomic_store_explicit(&ring->count, count + 1, memory_order_release);
+}
+
+/**
+ * Current, average and 99th percentile of the samples in the ring
+ */
+void prof_stats(ProfPhase phase, ProfStats *stats) {
+    uint64_t samples[PROF_SAMPLES];
+    size_t len = _copy(phase, samples);
+
+    memset(stats, 0, sizeof(ProfStats));
+    if (!len) {
+        return;
+    }
+
+    stats->count = len;
+    stats->cur = samples[len - 1] / 1e6;
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += samples[i];
+    }
+    stats->avg = (sum / (double) len) / 1e6;
+
+    qsort(samples, len, sizeof(uint64_t), _cmp_u64);
+    stats->p99 = samples[(len * 99) / 100] / 1e6;
+}
+
+/**
+ * Copies up to max of the latest samples in ms (oldest first), returns the number of samples copied.
+ */
+size_t prof_samples(ProfPhase phase, float *ms, size_t max) {
+    uint64_t samples[PROF_SAMPLES];
+    size_t len = _copy(phase, samples);
+    size_t off = (len > max) ? len - max : 0;
+
+    for (size_t i = off; i < len; i++) {
+        ms[i - off] = samples[i] / 1e6f;
+    }
+    return len - off;
+}
@@ -0,0 +1,43 @@
+#ifndef __PROFILER_H__
+#define __PROFILER_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+////
+// Per-phase frame profiler
+////
+
+typedef enum {
+    PROF_STEP,          // simulation step (total)
+    PROF_TREE_BUILD,
+    PROF_MASS,          // mass aggregation
+    PROF_FORCES,
+    PROF_INTEGRATE,
+    PROF_OVERLAY,       // quadtree overlay fill
+    PROF_UPLOAD,        // vbo upload
+    PROF_UI,            // ui draw
+    PROF_FRAME,         // render frame (total)
+
+    PROF_LEN
+} ProfPhase;
+
+extern const char *prof_phases[PROF_LEN];
+
+#define PROF_SAMPLES 256 // ring buffer length per phase, must be a power of 2
+
+typedef struct ProfStats {
+    double cur; // ms
+    double avg; // ms
+    double p99; // ms
+    unsigned int count;
+} ProfStats;
+
+void prof_begin(ProfPhase phase);
+void prof_end(ProfPhase phase);
+void prof_record(ProfPhase phase, uint64_t ns);
+
+void prof_stats(ProfPhase phase, ProfStats *stats);
+size_t prof_samples(ProfPhase phase, float *ms, size_t max);
+
+#endif
@@ -0,0 +1,293 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <assert.h>
+
+#include "otree.h"
+#include "log.h"
+#include "utils.h"
+
+////
+// ONode
+////
+
+static int _vec3_within(vec3_t pos, vec3_t min, vec3_t max) {
+    return pos.x >= min.x && pos.y >= min.y && pos.z >= min.z && pos.x <= max.x && pos.y <= max.y && pos.z <= max.z;
+}
+
+/**
+ * Gets the matching octant child index for a given position (inside the node)
+ */
+static int _node_octant(ONode *node, vec3_t pos) {
+    float cx = node->self_min.x + (node->self_max.x - node->self_min.x) / 2;
+    float cy = node->self_min.y + (node->self_max.y - node->self_min.y) / 2;
+    float cz = node->self_min.z + (node->self_max.z - node->self_min.z) / 2;
+
+    return (pos.x >= cx) | (pos.y >= cy) << 1 | (pos.z >= cz) << 2;
+}
+
+/**
+ * Clears data properites in a node
+ */
+static void _node_clear_data(ONode *node) {
+    node->pos = (vec3_t) {0.f, 0.f, 0.f};
+    node->data = NULL;
+    node->mass = 0.f;
+    node->com = (vec3_t) {0.f, 0.f, 0.f};
+    node->count = 0;
+}
+
+/**
+ * Gets the child nodes in visit order (child index)
+ */
+static int _node_children(ONode *node, ONode **children) {
+    int len = 0;
+    for (int i = 0; i < OCT_CHILDREN; i++) {
+        if (node->children[i]) {
+            children[len++] = node->children[i];
+        }
+    }
+    return len;
+}
+
+/**
+ * Splits the volume of a leaf into 8 child octants
+ */
+static int _node_make_children(ONode *node) {
+    vec3_t min = node->self_min;
+    vec3_t max = node->self_max;
+    vec3_t c = {
+        min.x + (max.x - min.x) / 2,
+        min.y + (max.y - min.y) / 2,
+        min.z + (max.z - min.z) / 2,
+    };
+
+    ONode *children[OCT_CHILDREN];
+    for (int i = 0; i < OCT_CHILDREN; i++) {
+        children[i] = onode_create(node);
+        if (!children[i]) {
+            while (i--) {
+                freez(children[i]);
+            }
+            return QUAD_FAILED;
+        }
+        children[i]->self_min = (vec3_t) {(i & 1) ? c.x : min.x, (i & 2) ? c.y : min.y, (i & 4) ? c.z : min.z};
+        children[i]->self_max = (vec3_t) {(i & 1) ? max.x : c.x, (i & 2) ? max.y : c.y, (i & 4) ? max.z : c.z};
+    }
+
+    // all or none
+    for (int i = 0; i < OCT_CHILDREN; i++) {
+        node->children[i] = children[i];
+    }
+    return QUAD_INSERTED;
+}
+
+static int _pos_equal(vec3_t a, vec3_t b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static vec3_t _pos_mean(vec3_t a, float wa, vec3_t b, float wb) {
+    float w = wa + wb;
+    return (vec3_t) {(a.x * wa + b.x * wb) / w, (a.y * wa + b.y * wb) / w, (a.z * wa + b.z * wb) / w};
+}
+
+// insertion, buckets and the visitor: shared with the quadtree
+
+#define TREE_NODE ONode
+#define TREE_TREE OTree
+#define TREE_VEC vec3_t
+#define TREE_CHILDREN OCT_CHILDREN
+#define TREE_VISIT_FN OVisitFn
+#define TREE_FN(name) onode_##name
+#define TREE_CHILD(node, pos) ((node)->children[_node_octant(node, pos)])
+
+#include "tree_impl.h"
+
+/**
+ * Sums up mass, center of mass and count of the pointer nodes from their children (post-order, leaves are kept, buckets are summed up from their entries)
+ */
+static int _node_aggregate(ONode *node, void *ctx) {
+    if (onode_isleaf(node) && node->bucket) {
+        _bucket_sum(node);
+        return QVISIT_CONTINUE;
+    }
+    if (!onode_ispointer(node)) {
+        return QVISIT_CONTINUE;
+    }
+
+    float mass = 0.f;
+    vec3_t com = {0.f, 0.f, 0.f};
+    unsigned int count = 0;
+
+    for (int i = 0; i < OCT_CHILDREN; i++) {
+        ONode *child = node->children[i];
+        count += child->count;
+        mass += child->mass;
+        com.x += child->com.x * child->mass;
+        com.y += child->com.y * child->mass;
+        com.z += child->com.z * child->mass;
+    }
+
+    node->count = count;
+    node->mass = mass;
+    node->com = (mass > 0.f) ? (vec3_t) {com.x / mass, com.y / mass, com.z / mass} : (vec3_t) {0.f, 0.f, 0.f};
+    return QVISIT_CONTINUE;
+}
+
+// --- public
+
+ONode *onode_create(ONode *parent) {
+    ONode *node = malloc(sizeof(ONode));
+    if (!node) {
+        LOG_ERROR("failed to allaocate memory for ONode");
+        return NULL;
+    }
+
+    node->parent = parent;
+    for (int i = 0; i < OCT_CHILDREN; i++) {
+        node->children[i] = NULL;
+    }
+
+    node->self_min = (vec3_t) {0.f, 0.f, 0.f};
+    node->self_max = (vec3_t) {0.f, 0.f, 0.f};
+
+    node->bucket = NULL;
+    node->next = NULL;
+
+    _node_clear_data(node);
+    return node;
+}
+
+void onode_destroy(ONode *node) {
+    if (!node) {
+        return;
+    }
+    for (int i = 0; i < OCT_CHILDREN; i++) {
+        onode_destroy(node->children[i]);
+    }
+
+    _bucket_destroy(node->bucket);
+
+    // We  don not manage the memory of the data item
+    freez(node);
+}
+
+int onode_isleaf(ONode *node) {
+    return node->data != NULL;
+}
+
+int onode_ispointer(ONode *node) {
+    return node->children[0] != NULL && !onode_isleaf(node);
+}
+
+int onode_isempty(ONode *node) {
+    return node->children[0] == NULL && !onode_isleaf(node);
+}
+
+////
+// OTree
+////
+
+OTree *otree_create(vec3_t min, vec3_t max) {
+    assert(min.x < max.x);
+    assert(min.y < max.y);
+    assert(min.z < max.z);
+
+    OTree *tree = malloc(sizeof(OTree));
+    if (!tree) {
+        return NULL;
+    }
+
+    tree->root = onode_create(NULL);
+    if (!tree->root) {
+        freez(tree);
+        return NULL;
+    }
+
+    tree->root->self_min = min;
+    tree->root->self_max = max;
+    tree->length = 0;
+    tree->max_depth = QTREE_MAX_DEPTH;
+
+    return tree;
+}
+
+void otree_destroy(OTree *tree) {
+    if (!tree) {
+        return;
+    }
+    onode_destroy(tree->root);
+    freez(tree);
+}
+
+int otree_insert(OTree *tree, void *data, vec3_t pos, float mass) {
+    if (!tree || !data) {
+        return QUAD_FAILED;
+    }
+
+    // check if pos is in tree bounds
+    if (!_vec3_within(pos, tree->root->self_min, tree->root->self_max)) {
+        return QUAD_FAILED;
+    }
+
+    int status = _node_insert(tree, tree->root, data, pos, mass, 0);
+    if (status == QUAD_INSERTED || status == QUAD_BUCKETED) {
+        tree->length++;
+    }
+
+    return status;
+}
+
+/**
+ * Insertion only updates a node and its parent, call this after building the tree before reading node->mass, com or count of pointer nodes
+ */
+void otree_aggregate(OTree *tree) {
+    if (!tree) {
+        return;
+    }
+    onode_visit(tree->root, NULL, _node_aggregate, NULL);
+}
+
+/**
+ * Find a leaf who matches exact a given position (the bucket entry for leaves with buckets)
+ */
+ONode *otree_find(OTree *tree, vec3_t pos) {
+    if (!tree || !_vec3_within(pos, tree->root->self_min, tree->root->self_max)) {
+        return NULL;
+    }
+
+    ONode *node = tree->root;
+    while (onode_ispointer(node)) {
+        node = node->children[_node_octant(node, pos)];
+    }
+
+    if (!onode_isleaf(node)) {
+        return NULL;
+    }
+    for (ONode *entry = onode_entries(node); entry; entry = entry->next) {
+        if (_pos_equal(entry->pos, pos)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void onode_print(FILE *fp, ONode *node) {
+    if (!node) {
+        fprintf(fp, "<NULL>");
+        return;
+    }
+
+    fprintf(fp, "{self_min: {%f, %f, %f}, self_max: {%f, %f, %f}, ",
+        node->self_min.x, node->self_min.y, node->self_min.z, node->self_max.x, node->self_max.y, node->self_max.z);
+    fprintf(fp, "parent: '%c', children: '%c', ", (node->parent) ? 'y' : '-', (node->children[0]) ? 'y' : '-');
+    fprintf(fp, "mass: %f, com: {%f, %f, %f}, ", node->mass, node->com.x, node->com.y, node->com.z);
+
+    if (node->data) {
+        fprintf(fp, "pos: {%f, %f, %f}, data: %p}", node->pos.x, node->pos.y, node->pos.z, node->data);
+    } else {
+        fprintf(fp, "data: '-'}");
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef __OTREE_H__
+#define __OTREE_H__
+
+#include <stdio.h>
+#include "external/math_3d.h"
+#include "qtree.h" // QUAD_* status codes, QTREE_MAX_DEPTH, QVISIT_*
+
+////
+//   Octants (3D variant of the quadtree)
+//
+//   child index: (x >= c.x) | (y >= c.y) << 1 | (z >= c.z) << 2, c: center of the node
+//   bounds are inclusive: min <= pos <= max
+//
+// A separate node type rather than a dimension generic QNode: Barnes-Hut, fast multipole, refit and the overlay read
+// the named quadrants, 2D quadrupole moments and area queries of QNode directly, 8 child pointers and vec3_t bounds
+// would grow every 2D node on those hot paths. Insertion, leaf buckets (entries at the same position or at max_depth,
+// QTREE_MAX_DEPTH) and the visitor are the quadtree's code: both trees instantiate tree_impl.h for their node type.
+////
+
+#define OCT_CHILDREN 8
+
+typedef struct ONode {
+    struct ONode *parent;
+    struct ONode *children[OCT_CHILDREN]; // all or none
+
+    vec3_t self_min;
+    vec3_t self_max;
+
+    // barnes- hut
+    float mass;
+    vec3_t com; // center of mass: is == pos if node is a leaf
+    unsigned int count; // leaves below, 1 for leaves (otree_aggregate())
+
+    // data
+    vec3_t pos;
+    void *data;
+
+    // bucket of a leaf at max depth or with entries at the same position (@see QNode.bucket), iterate with onode_entries()
+    struct ONode *bucket;
+    struct ONode *next; // next entry in a bucket
+} ONode;
+
+typedef struct OTree {
+    ONode *root;
+    unsigned int length;
+    unsigned int max_depth; // leaves at this depth are not split, further entries go to their bucket
+} OTree;
+
+OTree *otree_create(vec3_t min, vec3_t max);
+void otree_destroy(OTree *tree);
+
+int otree_insert(OTree *tree, void *data, vec3_t pos, float mass);
+void otree_aggregate(OTree *tree);
+
+ONode *otree_find(OTree *tree, vec3_t pos);
+
+ONode *onode_create(ONode *parent);
+void onode_destroy(ONode *node);
+
+int onode_isempty(ONode *node);
+int onode_isleaf(ONode *node);
+int onode_ispointer(ONode *node);
+
+ONode *onode_entries(ONode *leaf);
+
+// Visitor: non-recursive depth first walk in child index order, QVISIT_* return values as qnode_visit()
+typedef int (*OVisitFn)(ONode *node, void *ctx);
+
+int onode_visit(ONode *node, OVisitFn pre, OVisitFn post, void *ctx);
+
+void onode_print(FILE *fp, ONode *node);
+
+#endif
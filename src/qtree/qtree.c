@@ -1,6 +1,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <assert.h>
 
@@ -13,7 +14,6 @@
 ////
 
 // forward declarations
-static int _node_split(QTree *tree, QNode *node);
 void qnode_print(FILE *fp, QNode *node);
 
 /**
@@ -68,92 +68,41 @@ static void _node_clear_data(QNode *node) {
     node->data = NULL;
     node->mass = 0.f;
     node->com = (vec2){0.f};
-}
-
-static void _node_update_gravity(QNode *node, vec2 pos, float mass)  {
-    if (!node) {
-        return;
-    }
-
-    node->com.x = ( node->com.x * node->mass + pos.x * mass) / (node->mass + mass);
-    node->com.y = ( node->com.y * node->mass + pos.y * mass) / (node->mass + mass);
-    node->mass += mass;
+    node->qxx = node->qxy = node->qyy = 0.f;
+    node->count = 0;
 }
 
 /**
- * Inserts an entity into a tree node. The node might be split into four childs, or the  already existing entity in this node might be replaced
- * Note: The position bounds must be checked by callee (qtree_insert())
+ * Gets the child nodes in visit order: nw, ne, sw, se
  */
-static int _node_insert(QTree *tree, QNode *node, void *data, vec2 pos, float mass) {
-    if (!tree || !node || !data) {
-        return QUAD_FAILED;
-    }
-
-    // update mass and center of mass for this node
-
-    // 1. insert into THIS (empty) node (just created before)
-    if (qnode_isempty(node)) {
-        node->pos = pos;
-        node->data = data;
-        _node_update_gravity(node, pos, mass);
-        _node_update_gravity(node->parent, pos, mass);
-        return QUAD_INSERTED;
-    }
-
-    // 2. replace THIS node OR split and insert into CHILDREN
-    if (qnode_isleaf(node)) {
-        // 2.1 pos match: replace
-        if (node->pos.x == pos.x && node->pos.y == pos.y) {
-            node->pos = pos;
-            node->data = data;
-            _node_update_gravity(node, pos, mass);
-            _node_update_gravity(node->parent, pos, mass);
-            return QUAD_REPLACED;
-        }
-
-        // 2.2 split node (and also mv previous node)
-        if (_node_split(tree, node) == QUAD_FAILED) {
-            return QUAD_FAILED;
-        }
-
-        // 2.3. insertcurrent node
-        return _node_insert(tree, node, data, pos, mass);
-    }
-
-    // 3. insert into one of THIS CHILDREN
-    if (qnode_ispointer(node)) {
-        QNode *child = _node_quadrant(node, pos);
-        if (!child) {
-            return QUAD_FAILED;
+static int _node_children(QNode *node, QNode **children) {
+    QNode *all[4] = {node->nw, node->ne, node->sw, node->se};
+    int len = 0;
+    for (int i = 0; i < 4; i++) {
+        if (all[i]) {
+            children[len++] = all[i];
         }
-        return _node_insert(tree, child, data, pos, mass);
     }
-
-    return QUAD_FAILED;
+    return len;
 }
 
 /**
- * Spits a quadrant nodes into 4 child quadrants.
- * Moves a existing entity node into the matching quadrant.
+ * Splits the area of a leaf into 4 child quadrants.
  */
-static int _node_split(QTree *tree, QNode *node) {
-    if (!tree || !node) {
-        return QUAD_FAILED;
-    }
-
+static int _node_make_children(QNode *node) {
     QNode *nw = qnode_create(node);
     QNode *ne = qnode_create(node);
     QNode *sw = qnode_create(node);
     QNode *se = qnode_create(node);
 
     if (!nw || !ne || !sw || !se) {
+        freez(nw);
+        freez(ne);
+        freez(sw);
+        freez(se);
         return QUAD_FAILED;
     }
 
-    void *data = node->data;
-    vec2 pos = node->pos;
-    float mass  = node->mass;
-
     // nw(x,y)            hw
     // x────────────┬────────────┐
     // │            │            │
@@ -190,10 +139,30 @@ static int _node_split(QTree *tree, QNode *node) {
     node->sw = sw;
     node->se = se;
 
-    _node_clear_data(node);
-    return _node_insert(tree, node, data, pos, mass); // inserts into one of the children
+    return QUAD_INSERTED;
+}
+
+static int _pos_equal(vec2 a, vec2 b) {
+    return a.x == b.x && a.y == b.y;
 }
 
+static vec2 _pos_mean(vec2 a, float wa, vec2 b, float wb) {
+    return (vec2) {(a.x * wa + b.x * wb) / (wa + wb), (a.y * wa + b.y * wb) / (wa + wb)};
+}
+
+// insertion, buckets and the visitor: shared with the octree
+
+#define TREE_NODE QNode
+#define TREE_TREE QTree
+#define TREE_VEC vec2
+#define TREE_CHILDREN 4
+#define TREE_VISIT_FN QVisitFn
+#define TREE_FN(name) qnode_##name
+#define TREE_CHILD _node_quadrant
+
+#include "tree_impl.h"
+
+
 /**
  * Find the smallest qnode (leaf) who cony a given position
  */
@@ -226,9 +195,14 @@ static QNode *_node_find(QTree *tree, QNode *node, vec2 pos) {
     }
 
     if (qnode_isleaf(node)) {
-        if (node->pos.x == pos.x && node->pos.y == pos.y) {
+        if (!node->bucket && node->pos.x == pos.x && node->pos.y == pos.y) {
             return node;
         }
+        for (QNode *entry = node->bucket; entry; entry = entry->next) {
+            if (entry->pos.x == pos.x && entry->pos.y == pos.y) {
+                return entry;
+            }
+        }
     }
 
     if (qnode_ispointer(node)) {
@@ -273,10 +247,12 @@ static void _node_find_in_area(QNode *node, vec2 nw, vec2 se, QList *list) {
         return;
     }
 
-    // this is a data node (and thus without children)
+    // this is a data node (and thus without children), bucket entries are listed separately
     if (qnode_isleaf(node)) {
-        if (_vec2_within(node->pos, nw, se)) {
-            qlist_append(list, node);
+        for (QNode *entry = qnode_entries(node); entry; entry = entry->next) {
+            if (_vec2_within(entry->pos, nw, se)) {
+                qlist_append(list, entry);
+            }
         }
         return;
     }
@@ -295,6 +271,46 @@ static void _node_find_in_area(QNode *node, vec2 nw, vec2 se, QList *list) {
     }
 }
 
+typedef struct QAreaQuery {
+    vec2 nw, se;
+    QArea sum; // com: mass weighted positions (com.x|y * mass) until the walk is done
+} QAreaQuery;
+
+/**
+ * Sums count, mass and mass weighted positions of the leaves in an area (visitor),
+ * nodes fully inside are added with their aggregated values
+ */
+static int _node_sum_in_area(QNode *node, void *ctx) {
+    QAreaQuery *query = (QAreaQuery*) ctx;
+    QArea *sum = &query->sum;
+
+    if (!qnode_overlaps_area(node, query->nw, query->se)) {
+        return QVISIT_SKIP;
+    }
+
+    if (qnode_isleaf(node)) {
+        for (QNode *entry = qnode_entries(node); entry; entry = entry->next) {
+            if (_vec2_within(entry->pos, query->nw, query->se)) {
+                sum->count++;
+                sum->mass += entry->mass;
+                sum->com.x += entry->pos.x * entry->mass;
+                sum->com.y += entry->pos.y * entry->mass;
+            }
+        }
+        return QVISIT_SKIP;
+    }
+
+    if (qnode_within_area(node, query->nw, query->se)) {
+        sum->count += node->count;
+        sum->mass += node->mass;
+        sum->com.x += node->com.x * node->mass;
+        sum->com.y += node->com.y * node->mass;
+        return QVISIT_SKIP;
+    }
+
+    return QVISIT_CONTINUE;
+}
+
 // --- public
 
 QNode *qnode_create(QNode *parent) {
@@ -314,6 +330,9 @@ QNode *qnode_create(QNode *parent) {
     node->self_nw = (vec2){0};
     node->self_se = (vec2){0};
 
+    node->bucket = NULL;
+    node->next = NULL;
+
     _node_clear_data(node);
     return node;
 }
@@ -335,6 +354,8 @@ void qnode_destroy(QNode *node) {
         qnode_destroy(node->se);
     }
 
+    _bucket_destroy(node->bucket);
+
     // We  don not manage the memory of the data item
     _node_clear_data(node);
 
@@ -350,6 +371,7 @@ int qnode_ispointer(QNode *node) {
     return node->nw != NULL && node->ne != NULL && node->sw != NULL && node->se != NULL && !qnode_isleaf(node);
 }
 
+
 int qnode_isempty(QNode *node) {
     return node->nw == NULL && node->ne == NULL && node->sw == NULL && node->se == NULL && !qnode_isleaf(node);
 }
@@ -368,30 +390,6 @@ int qnode_overlaps_area(QNode *node, vec2 nw, vec2 se) {
     return node != NULL && node->self_nw.x < se.x && node->self_se.x >= nw.x && node->self_nw.y < se.y && node->self_se.y >= nw.y;
 }
 
-/**
- * recusively walk trough a quad node's children and apply on before (recusing) and on after call backs
- */
-void qnode_walk(QNode *node, void (*descent)(QNode *node), void (*ascent)(QNode *node)) {
-    if (descent) {
-        (*descent)(node);
-    }
-    if (node->nw != NULL) {
-        qnode_walk(node->nw, descent, ascent);
-    }
-    if (node->ne != NULL) {
-        qnode_walk(node->ne, descent, ascent);
-    }
-    if (node->sw != NULL) {
-        qnode_walk(node->sw, descent, ascent);
-    }
-    if (node->se != NULL) {
-        qnode_walk(node->se, descent, ascent);
-    }
-
-    if (ascent) {
-        (*ascent)(node);
-    }
-}
 
 ////
 // QTree
@@ -413,6 +411,8 @@ QTree *qtree_create(vec2 window_nw, vec2 window_se) {
 
     _set_bounds(tree->root, window_nw, window_se);
     tree->length = 0;
+    tree->refits = 0;
+    tree->max_depth = QTREE_MAX_DEPTH;
 
     return tree;
 }
@@ -435,8 +435,8 @@ int qtree_insert(QTree *tree, void *data, vec2 pos, float mass) {
         return QUAD_FAILED;
     }
 
-    int status = _node_insert(tree, tree->root, data, pos, mass);
-    if (status == QUAD_INSERTED) {
+    int status = _node_insert(tree, tree->root, data, pos, mass, 0);
+    if (status == QUAD_INSERTED || status == QUAD_BUCKETED) {
         tree->length++;
     }
 
@@ -444,7 +444,81 @@ int qtree_insert(QTree *tree, void *data, vec2 pos, float mass) {
 }
 
 /**
- * Find a qnode who matches exact a given position
+ * Sums up mass, center of mass, count and second moments of a leaf's bucket entries (moved since the insert if the tree was refit)
+ */
+static void _bucket_aggregate(QNode *node) {
+    _bucket_sum(node);
+
+    float qxx = 0.f, qxy = 0.f, qyy = 0.f;
+    for (QNode *entry = node->bucket; entry; entry = entry->next) {
+        float dx = entry->pos.x - node->com.x;
+        float dy = entry->pos.y - node->com.y;
+        qxx += entry->mass * dx * dx;
+        qxy += entry->mass * dx * dy;
+        qyy += entry->mass * dy * dy;
+    }
+
+    node->qxx = qxx;
+    node->qxy = qxy;
+    node->qyy = qyy;
+}
+
+/**
+ * Sums up mass, center of mass and second moments of the pointer nodes from their children (post-order, leaves are kept, buckets are summed up from their entries).
+ * Moments are shifted to the parent com (parallel axis): q = sum(q_child + m_child * d * d^T), d = com_child - com.
+ * Insertion only updates a node and its parent, call this after building the tree before reading node->mass, com or moments.
+ */
+static int _node_aggregate(QNode *node, void *ctx) {
+    if (qnode_isleaf(node) && node->bucket) {
+        _bucket_aggregate(node);
+        return QVISIT_CONTINUE;
+    }
+    if (!qnode_ispointer(node)) {
+        node->qxx = node->qxy = node->qyy = 0.f; // point mass
+        return QVISIT_CONTINUE;
+    }
+
+    QNode *children[4] = {node->nw, node->ne, node->sw, node->se};
+    float mass = 0.f;
+    vec2 com = {0.f, 0.f};
+    unsigned int count = 0;
+
+    for (int i = 0; i < 4; i++) {
+        count += children[i]->count;
+        mass += children[i]->mass;
+        com.x += children[i]->com.x * children[i]->mass;
+        com.y += children[i]->com.y * children[i]->mass;
+    }
+
+    node->count = count;
+    node->mass = mass;
+    node->com = (mass > 0.f) ? (vec2) {com.x / mass, com.y / mass} : (vec2) {0.f, 0.f};
+
+    float qxx = 0.f, qxy = 0.f, qyy = 0.f;
+    for (int i = 0; i < 4; i++) {
+        float dx = children[i]->com.x - node->com.x;
+        float dy = children[i]->com.y - node->com.y;
+        float m = children[i]->mass;
+        qxx += children[i]->qxx + m * dx * dx;
+        qxy += children[i]->qxy + m * dx * dy;
+        qyy += children[i]->qyy + m * dy * dy;
+    }
+
+    node->qxx = qxx;
+    node->qxy = qxy;
+    node->qyy = qyy;
+    return QVISIT_CONTINUE;
+}
+
+void qtree_aggregate(QTree *tree) {
+    if (!tree) {
+        return;
+    }
+    qnode_visit(tree->root, NULL, _node_aggregate, NULL);
+}
+
+/**
+ * Find a qnode who matches exact a given position (the bucket entry for leaves with buckets)
  */
 QNode *qtree_find(QTree *tree, vec2 pos) {
     if (!tree) {
@@ -475,19 +549,50 @@ QList *qtree_find_in_area(QTree *tree, vec2 pos, float radius, QList *list) {
     return list;
 }
 
+QArea qtree_sum_in_area(QTree *tree, vec2 pos, float radius) {
+    if (!tree) {
+        return (QArea) {0};
+    }
+
+    QAreaQuery query = {
+        .nw = {pos.x - radius, pos.y - radius},
+        .se = {pos.x + radius, pos.y + radius},
+    };
+    qnode_visit(tree->root, _node_sum_in_area, NULL, &query);
+
+    QArea sum = query.sum;
+    if (sum.mass > 0.f) {
+        sum.com.x /= sum.mass;
+        sum.com.y /= sum.mass;
+    } else {
+        sum.com = (vec2) {0.f, 0.f};
+    }
+    return sum;
+}
+
+unsigned int qtree_count_in_area(QTree *tree, vec2 pos, float radius) {
+    return qtree_sum_in_area(tree, pos, radius).count;
+}
+
+float qtree_mass_in_area(QTree *tree, vec2 pos, float radius) {
+    return qtree_sum_in_area(tree, pos, radius).mass;
+}
+
+vec2 qtree_centroid_in_area(QTree *tree, vec2 pos, float radius) {
+    return qtree_sum_in_area(tree, pos, radius).com;
+}
+
 ////
 // debug
 ////
 
-FILE *_out = NULL;
-
-static void _print_desc(QNode *node) {
-    qnode_print(_out, node);
-    fprintf(_out, "\n");
+static int _print_node(QNode *node, void *ctx) {
+    FILE *fp = (FILE*) ctx;
+    qnode_print(fp, node);
+    fprintf(fp, "\n");
+    return QVISIT_CONTINUE;
 }
 
-static void _print_asc(QNode *node) {}
-
 // --- public
 
 void qtree_print(FILE *fp, QTree *tree) {
@@ -496,9 +601,7 @@ void qtree_print(FILE *fp, QTree *tree) {
         return;
     }
 
-    _out = fp;
-    qnode_walk(tree->root, _print_asc, _print_desc);
-    _out = NULL;
+    qnode_visit(tree->root, NULL, _print_node, fp); // children first
 }
 
 void qnode_print(FILE *fp, QNode *node) {
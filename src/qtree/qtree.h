@@ -6,7 +6,9 @@
 
 #define QUAD_FAILED -1
 #define QUAD_INSERTED 0
-#define QUAD_REPLACED 2
+#define QUAD_BUCKETED 1 // added to the bucket of an existing leaf (same position or max depth)
+
+#define QTREE_MAX_DEPTH 20 // default QTree.max_depth: 800px / 2^20 < 0.001px
 
 ////
 //   Quadrants
@@ -42,21 +44,31 @@ typedef struct QNode {
     // barnes- hut
     float mass;
     vec2 com; // center of mass: is == pos if node is a leaf
+    float qxx, qxy, qyy; // second moments of mass about com: sum(m * d * d^T), 0 for leaves (qtree_aggregate())
+    unsigned int count; // leaves below, 1 for leaves (qtree_aggregate())
 
     // data
     vec2 pos;
     void *data; // this is the data position vector and not node the node pos: TODO rename
+
+    // leaves at max depth or with entries at the same position keep all of them in a bucket: a chain of entries (data, pos, mass)
+    // starting with the leaf's own, leaf mass, com and count are their sums. Iterate with qnode_entries()
+    struct QNode *bucket;
+    struct QNode *next; // next entry in a bucket
 } QNode;
 
 typedef struct QTree {
     QNode *root;
     unsigned int length;
+    unsigned int refits; // leaves moved since the tree was built, bounds may no longer contain them
+    unsigned int max_depth; // leaves at this depth are not split, further entries go to their bucket
 } QTree;
 
 QTree *qtree_create(vec2 window_nw, vec2 window_se);
 void qtree_destroy(QTree *tree);
 
 int qtree_insert(QTree *tree, void *data, vec2 pos, float mass);
+void qtree_aggregate(QTree *tree);
 
 QNode *qtree_find(QTree *tree, vec2 pos);
 QNode *qtree_find_nearest(QTree *tree, vec2 pos);
@@ -68,10 +80,26 @@ int qnode_isempty(QNode *node);
 int qnode_isleaf(QNode *node);
 int qnode_ispointer(QNode *node);
 
+QNode *qnode_entries(QNode *leaf);
+
 int qnode_within_area(QNode *node, vec2 nw, vec2 se);
 int qnode_overlaps_area(QNode *node, vec2 nw, vec2 se);
 
-void qnode_walk(QNode *node, void (*descent)(QNode *node), void (*ascent)(QNode *node));
+////
+// Visitor: non-recursive depth first walk (explicit stack) in child order nw, ne, sw, se.
+// pre is called before a node's children (pre-order), post after them (post-order), either may be NULL.
+// ctx is passed through, walks share no state and may run concurrently on a tree nobody modifies
+////
+
+#define QVISIT_CONTINUE 0 // descend into the children
+#define QVISIT_SKIP 1     // pre: do not descend into the children of this node (post is still called)
+#define QVISIT_STOP 2     // end the walk
+
+#define QVISIT_STACK 128 // entries on the call stack, deeper walks grow on the heap
+
+typedef int (*QVisitFn)(QNode *node, void *ctx);
+
+int qnode_visit(QNode *node, QVisitFn pre, QVisitFn post, void *ctx);
 
 void qtree_print(FILE *fp, QTree *tree);
 void qnode_print(FILE *fp, QNode *node);
@@ -99,4 +127,23 @@ void qlist_print(FILE *fp, QList *list);
 
 QList *qtree_find_in_area(QTree *tree, vec2 pos, float radius, QList *list);
 
+////
+// Aggregate area queries: leaves within pos +- radius (as qtree_find_in_area()), without collecting them.
+// Nodes fully inside the area count as a whole, only nodes crossing its border are descended.
+// Reads the aggregated node values: call qtree_aggregate() after building the tree.
+// On a refit tree (QTree.refits) leaves may have left their node bounds, the results are approximate
+////
+
+typedef struct QArea {
+    unsigned int count;
+    float mass;
+    vec2 com; // center of mass, {0, 0} if empty
+} QArea;
+
+QArea qtree_sum_in_area(QTree *tree, vec2 pos, float radius);
+
+unsigned int qtree_count_in_area(QTree *tree, vec2 pos, float radius);
+float qtree_mass_in_area(QTree *tree, vec2 pos, float radius);
+vec2 qtree_centroid_in_area(QTree *tree, vec2 pos, float radius);
+
 #endif
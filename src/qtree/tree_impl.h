@@ -0,0 +1,274 @@
+////
+// Shared node code of the quadtree (qtree.c) and the octree (otree.c): insertion with leaf buckets and the depth bound,
+// bucket sums and the explicit-stack visitor. Included by the tree sources after defining
+//
+//   TREE_NODE             node type, with parent, pos, com, mass, count, data, bucket, next
+//   TREE_TREE             tree type, with max_depth
+//   TREE_VEC              position type
+//   TREE_CHILDREN         children of a pointer node
+//   TREE_VISIT_FN         visitor callback type
+//   TREE_FN(name)         public node function name: create, isleaf, isempty, ispointer are called, visit and entries are defined here
+//   TREE_CHILD(node, pos) child of a pointer node containing pos, NULL if none
+//
+// and the static dimension specific helpers
+//
+//   int _pos_equal(TREE_VEC a, TREE_VEC b)
+//   TREE_VEC _pos_mean(TREE_VEC a, float wa, TREE_VEC b, float wb)       weighted mean, wa + wb > 0
+//   int _node_children(TREE_NODE *node, TREE_NODE **children)           children in visit order, returns their number
+//   int _node_make_children(TREE_NODE *node)                            allocates the bounded children of a leaf, QUAD_FAILED on error
+//   void _node_clear_data(TREE_NODE *node)
+////
+
+static int _node_split(TREE_TREE *tree, TREE_NODE *node, unsigned int depth);
+
+/**
+ * Adds a point mass to the mass and center of mass of a node
+ */
+static void _node_add_mass(TREE_NODE *node, TREE_VEC pos, float mass) {
+    if (!node) {
+        return;
+    }
+    if (node->mass + mass > 0.f) {
+        node->com = _pos_mean(node->com, node->mass, pos, mass);
+    }
+    node->mass += mass;
+}
+
+static TREE_NODE *_entry_create(TREE_NODE *leaf, void *data, TREE_VEC pos, float mass) {
+    TREE_NODE *entry = TREE_FN(create)(leaf);
+    if (!entry) {
+        return NULL;
+    }
+    entry->pos = entry->com = pos;
+    entry->data = data;
+    entry->mass = mass;
+    entry->count = 1;
+    return entry;
+}
+
+static void _bucket_destroy(TREE_NODE *bucket) {
+    while (bucket) {
+        TREE_NODE *next = bucket->next;
+        freez(bucket);
+        bucket = next;
+    }
+}
+
+/**
+ * Adds an entity to the bucket of a leaf, the leaf's own entity becomes the first entry
+ */
+static int _node_bucket_add(TREE_NODE *node, void *data, TREE_VEC pos, float mass) {
+    if (!node->bucket) {
+        node->bucket = _entry_create(node, node->data, node->pos, node->mass);
+        if (!node->bucket) {
+            return QUAD_FAILED;
+        }
+    }
+
+    TREE_NODE *entry = _entry_create(node, data, pos, mass);
+    if (!entry) {
+        return QUAD_FAILED;
+    }
+
+    // behind the leaf's own entry, the chain is not walked
+    entry->next = node->bucket->next;
+    node->bucket->next = entry;
+    node->count++;
+
+    return QUAD_BUCKETED;
+}
+
+/**
+ * Sums up count, mass and center of mass of a leaf's bucket entries (moved since the insert if the tree was refit)
+ */
+static void _bucket_sum(TREE_NODE *node) {
+    unsigned int count = 0;
+    float mass = 0.f;
+    TREE_VEC com = node->pos;
+
+    for (TREE_NODE *entry = node->bucket; entry; entry = entry->next) {
+        count++;
+        if (mass + entry->mass > 0.f) {
+            com = _pos_mean(com, mass, entry->pos, entry->mass);
+        }
+        mass += entry->mass;
+    }
+
+    node->count = count;
+    node->mass = mass;
+    node->com = com;
+}
+
+/**
+ * Inserts an entity into a tree node. The node might be split into its children, or the entity is added to the bucket of the
+ * existing leaf (same position or max depth reached)
+ * Note: The position bounds must be checked by callee (the tree's insert())
+ */
+static int _node_insert(TREE_TREE *tree, TREE_NODE *node, void *data, TREE_VEC pos, float mass, unsigned int depth) {
+    if (!tree || !node || !data) {
+        return QUAD_FAILED;
+    }
+
+    // 1. insert into THIS (empty) node (just created before)
+    if (TREE_FN(isempty)(node)) {
+        node->pos = node->com = pos;
+        node->data = data;
+        node->count = 1;
+        _node_add_mass(node, pos, mass);
+        _node_add_mass(node->parent, pos, mass);
+        return QUAD_INSERTED;
+    }
+
+    // 2. add to the bucket of THIS node OR split and insert into CHILDREN
+    if (TREE_FN(isleaf)(node)) {
+        // 2.1 pos match or max depth: bucket
+        if (_pos_equal(node->pos, pos) || depth >= tree->max_depth) {
+            if (_node_bucket_add(node, data, pos, mass) == QUAD_FAILED) {
+                return QUAD_FAILED;
+            }
+            _node_add_mass(node, pos, mass);
+            _node_add_mass(node->parent, pos, mass);
+            return QUAD_BUCKETED;
+        }
+
+        // 2.2 split node (and also mv previous node)
+        if (_node_split(tree, node, depth) == QUAD_FAILED) {
+            return QUAD_FAILED;
+        }
+
+        // 2.3. insertcurrent node
+        return _node_insert(tree, node, data, pos, mass, depth);
+    }
+
+    // 3. insert into one of THIS CHILDREN
+    if (TREE_FN(ispointer)(node)) {
+        TREE_NODE *child = TREE_CHILD(node, pos);
+        if (!child) {
+            return QUAD_FAILED;
+        }
+        return _node_insert(tree, child, data, pos, mass, depth + 1);
+    }
+
+    return QUAD_FAILED;
+}
+
+/**
+ * Splits a leaf into its children.
+ * Moves the existing entity (or the entries of its bucket) into the matching child.
+ */
+static int _node_split(TREE_TREE *tree, TREE_NODE *node, unsigned int depth) {
+    if (!tree || !node) {
+        return QUAD_FAILED;
+    }
+
+    if (_node_make_children(node) == QUAD_FAILED) {
+        return QUAD_FAILED;
+    }
+
+    void *data = node->data;
+    TREE_VEC pos = node->pos;
+    float mass = node->mass;
+    TREE_NODE *bucket = node->bucket;
+    node->bucket = NULL;
+
+    _node_clear_data(node);
+    if (!bucket) {
+        return _node_insert(tree, node, data, pos, mass, depth); // inserts into one of the children
+    }
+
+    // bucket of entries at the same position: they stay together in one child
+    int status = QUAD_INSERTED;
+    for (TREE_NODE *entry = bucket; entry && status != QUAD_FAILED; entry = entry->next) {
+        status = _node_insert(tree, node, entry->data, entry->pos, entry->mass, depth);
+    }
+    _bucket_destroy(bucket);
+    return (status == QUAD_FAILED) ? QUAD_FAILED : QUAD_INSERTED;
+}
+
+/**
+ * First entry of a leaf: the head of its bucket, or the leaf itself. Entries are chained by entry->next
+ */
+TREE_NODE *TREE_FN(entries)(TREE_NODE *leaf) {
+    return (leaf->bucket) ? leaf->bucket : leaf;
+}
+
+typedef struct TreeVisitItem {
+    TREE_NODE *node;
+    int post; // children done: post-order call
+} TreeVisitItem;
+
+/**
+ * Walks the subtree of node, returns QVISIT_STOP if a callback ended the walk, QVISIT_CONTINUE otherwise
+ */
+int TREE_FN(visit)(TREE_NODE *node, TREE_VISIT_FN pre, TREE_VISIT_FN post, void *ctx) {
+    if (!node) {
+        return QVISIT_CONTINUE;
+    }
+
+    TreeVisitItem local[QVISIT_STACK];
+    TreeVisitItem *stack = local;
+    size_t max = QVISIT_STACK;
+    size_t len = 0;
+    int status = QVISIT_CONTINUE;
+
+    stack[len++] = (TreeVisitItem) {node, 0};
+
+    while (len && status != QVISIT_STOP) {
+        TreeVisitItem item = stack[--len];
+
+        if (item.post) {
+            if (post(item.node, ctx) == QVISIT_STOP) {
+                status = QVISIT_STOP;
+            }
+            continue;
+        }
+
+        int visit = (pre) ? pre(item.node, ctx) : QVISIT_CONTINUE;
+        if (visit == QVISIT_STOP) {
+            status = QVISIT_STOP;
+            continue;
+        }
+
+        // post marker + children
+        if (len + 1 + TREE_CHILDREN > max) {
+            TreeVisitItem *grown = malloc(max * 2 * sizeof(TreeVisitItem));
+            if (!grown) {
+                LOG_ERROR("failed to allocate memory for the tree visitor");
+                status = QVISIT_STOP;
+                continue;
+            }
+            memcpy(grown, stack, len * sizeof(TreeVisitItem));
+            if (stack != local) {
+                freez(stack);
+            }
+            stack = grown;
+            max *= 2;
+        }
+
+        if (post) {
+            stack[len++] = (TreeVisitItem) {item.node, 1};
+        }
+        if (visit == QVISIT_SKIP) {
+            continue;
+        }
+
+        // reversed: the first child is popped first
+        TREE_NODE *children[TREE_CHILDREN];
+        for (int i = _node_children(item.node, children) - 1; i >= 0; i--) {
+            stack[len++] = (TreeVisitItem) {children[i], 0};
+        }
+    }
+
+    if (stack != local) {
+        freez(stack);
+    }
+    return status;
+}
+
+#undef TREE_NODE
+#undef TREE_TREE
+#undef TREE_VEC
+#undef TREE_CHILDREN
+#undef TREE_VISIT_FN
+#undef TREE_FN
+#undef TREE_CHILD
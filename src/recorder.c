@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "state.h"
+#include "recorder.h"
+
+#include "utils.h"
+#include "log.h"
+#include "trace.h"
+
+#define RECORDER_FILE_BUFFER (1 << 20)
+
+////
+// Encoding
+////
+
+static int32_t _quantize(float v) {
+    float q = roundf(v * TRAJ_SCALE);
+    // borticles flung far out of the world are clamped, not wrapped
+    if (q >= 2147483520.f) return INT32_MAX;
+    if (q <= -2147483520.f) return INT32_MIN;
+    return (int32_t) q;
+}
+
+static uint8_t _channel(float c) {
+    return (uint8_t) ((c < 0.f) ? 0 : (c > 1.f) ? 255 : roundf(c * 255.f));
+}
+
+/**
+ * zigzag + LEB128 varint, small deltas of either sign take a single byte
+ */
+static size_t _put_varint(uint8_t *buf, int32_t v) {
+    uint32_t z = ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+    size_t n = 0;
+    while (z >= 0x80) {
+        buf[n++] = (uint8_t) (z | 0x80);
+        z >>= 7;
+    }
+    buf[n++] = (uint8_t) z;
+    return n;
+}
+
+static void _reserve(Recorder *rec, size_t size) {
+    if (size <= rec->buffer_max) {
+        return;
+    }
+    rec->buffer = realloc(rec->buffer, size);
+    EXIT_IF(rec->buffer == NULL, "failed to (re)allocate for Recorder->buffer");
+    rec->buffer_max = size;
+}
+
+static size_t _encode_keyframe(Recorder *rec, RecorderSlot *slot) {
+    _reserve(rec, slot->len * sizeof(TrajKey));
+    TrajKey *keys = (TrajKey*) rec->buffer;
+
+    for (unsigned int i = 0; i < slot->len; i++) {
+        vec4 p = slot->positions[i];
+        rgba c = slot->colors[i];
+
+        keys[i].x = rec->prev[i * 2] = _quantize(p.x);
+        keys[i].y = rec->prev[i * 2 + 1] = _quantize(p.y);
+        keys[i].size = p.w;
+        keys[i].color[0] = _channel(c.r);
+        keys[i].color[1] = _channel(c.g);
+        keys[i].color[2] = _channel(c.b);
+        keys[i].color[3] = _channel(c.a);
+    }
+    return slot->len * sizeof(TrajKey);
+}
+
+static size_t _encode_delta(Recorder *rec, RecorderSlot *slot) {
+    _reserve(rec, slot->len * 2 * 5); // worst case: 5 bytes per varint
+    uint8_t *buf = rec->buffer;
+    size_t n = 0;
+
+    for (unsigned int i = 0; i < slot->len; i++) {
+        int32_t x = _quantize(slot->positions[i].x);
+        int32_t y = _quantize(slot->positions[i].y);
+
+        // wrapping difference, decodes back exactly
+        n += _put_varint(&buf[n], (int32_t) ((uint32_t) x - (uint32_t) rec->prev[i * 2]));
+        n += _put_varint(&buf[n], (int32_t) ((uint32_t) y - (uint32_t) rec->prev[i * 2 + 1]));
+
+        rec->prev[i * 2] = x;
+        rec->prev[i * 2 + 1] = y;
+    }
+    return n;
+}
+
+static void _write(Recorder *rec, RecorderSlot *slot) {
+    if (slot->len > rec->prev_len) {
+        freez(rec->prev);
+        rec->prev = malloc(slot->len * 2 * sizeof(int32_t));
+        EXIT_IF(rec->prev == NULL, "failed to allocate for Recorder->prev");
+    }
+
+    // population changes and the first record always start with a keyframe
+    bool key = (!rec->written || slot->len != rec->prev_len || rec->written % RECORDER_KEYFRAME == 0);
+
+    TrajRecord record = {0};
+    record.type = (key) ? TRAJ_KEYFRAME : TRAJ_DELTA;
+    record.len = slot->len;
+    record.step = slot->step;
+    record.size = (key) ? _encode_keyframe(rec, slot) : _encode_delta(rec, slot);
+    rec->prev_len = slot->len;
+
+    if (fwrite(&record, sizeof(TrajRecord), 1, rec->fp) != 1 || fwrite(rec->buffer, 1, record.size, rec->fp) != record.size) {
+        LOG_ERROR_F("failed to write trajectory file '%s': %s", rec->path, strerror(errno));
+        return;
+    }
+
+    rec->written++;
+    rec->keyframes += key;
+    rec->bytes += sizeof(TrajRecord) + record.size;
+}
+
+////
+// Writer thread
+////
+
+static void *_run(void *arg) {
+    Recorder *rec = (Recorder*) arg;
+
+    trace_thread_name("recorder");
+
+    for (;;) {
+        size_t head = atomic_load_explicit(&rec->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&rec->tail, memory_order_acquire);
+
+        if (head == tail) {
+            if (!atomic_load_explicit(&rec->running, memory_order_acquire)) {
+                break; // drained
+            }
+
+            // the producer signals without the lock, a missed wakeup costs at most 10ms
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 10000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_mutex_lock(&rec->lock);
+            pthread_cond_timedwait(&rec->cond, &rec->lock, &ts);
+            pthread_mutex_unlock(&rec->lock);
+            continue;
+        }
+
+        trace_begin("record");
+        _write(rec, &rec->slots[head & (RECORDER_QUEUE_LEN - 1)]);
+        trace_end("record");
+
+        atomic_store_explicit(&rec->head, head + 1, memory_order_release);
+    }
+
+    return NULL;
+}
+
+// --- public
+
+/**
+ * Opens a trajectory file and starts the writer thread. Every stride-th step is recorded.
+ */
+Recorder *recorder_create(const char *path, State *state, unsigned int stride) {
+    EXIT_IF(path == NULL, "no trajectory path");
+    EXIT_IF(state == NULL, "no state");
+
+    Recorder *rec = calloc(1, sizeof(Recorder));
+    EXIT_IF(rec == NULL, "failed to allocate for Recorder");
+
+    rec->fp = fopen(path, "wb");
+    if (!rec->fp) {
+        LOG_ERROR_F("failed to open trajectory file '%s': %s", path, strerror(errno));
+        freez(rec);
+        return NULL;
+    }
+    setvbuf(rec->fp, NULL, _IOFBF, RECORDER_FILE_BUFFER);
+
+    TrajHeader header = {0};
+    memcpy(header.magic, TRAJ_MAGIC, sizeof(header.magic));
+    header.version = TRAJ_VERSION;
+    header.width = state->width;
+    header.height = state->height;
+    header.dt = state->dt;
+    header.scale = TRAJ_SCALE;
+    fwrite(&header, sizeof(TrajHeader), 1, rec->fp);
+    rec->bytes = sizeof(TrajHeader);
+
+    rec->path = strdup(path);
+    rec->stride = (stride) ? stride : 1;
+
+    atomic_init(&rec->head, 0);
+    atomic_init(&rec->tail, 0);
+    atomic_init(&rec->running, true);
+    pthread_mutex_init(&rec->lock, NULL);
+    pthread_cond_init(&rec->cond, NULL);
+
+    int err = pthread_create(&rec->thread, NULL, _run, rec);
+    EXIT_IF_F(err != 0, "failed to create recorder thread (%d)", err);
+
+    return rec;
+}
+
+/**
+ * Queues the current vbo data of state, called from the simulation thread after bort_update().
+ * Never blocks: if the writer falls behind the frame is dropped and the recording stride doubled.
+ */
+void recorder_push(Recorder *rec, State *state) {
+    if (!rec || !state->positions || state->step % rec->stride != 0) {
+        return;
+    }
+
+    size_t tail = atomic_load_explicit(&rec->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&rec->head, memory_order_acquire);
+
+    if (tail - head >= RECORDER_QUEUE_LEN) {
+        rec->dropped++;
+        if (rec->stride < RECORDER_STRIDE_MAX) {
+            rec->stride *= 2;
+            LOG_WARN_F("recorder falling behind (%lu frames dropped), recording every %u steps", rec->dropped, rec->stride);
+        }
+        return;
+    }
+
+    RecorderSlot *slot = &rec->slots[tail & (RECORDER_QUEUE_LEN - 1)];
+    if (state->pop_len > slot->max) {
+        slot->positions = realloc(slot->positions, state->pop_len * sizeof(vec4));
+        EXIT_IF(slot->positions == NULL, "failed to (re)allocate for RecorderSlot->positions");
+        slot->colors = realloc(slot->colors, state->pop_len * sizeof(rgba));
+        EXIT_IF(slot->colors == NULL, "failed to (re)allocate for RecorderSlot->colors");
+        slot->max = state->pop_len;
+    }
+
+    memcpy(slot->positions, state->positions, state->pop_len * sizeof(vec4));
+    memcpy(slot->colors, state->colors, state->pop_len * sizeof(rgba));
+    slot->len = state->pop_len;
+    slot->step = state->step;
+
+    atomic_store_explicit(&rec->tail, tail + 1, memory_order_release);
+    rec->pushed++;
+    pthread_cond_signal(&rec->cond);
+}
+
+/**
+ * Drains the queue, closes the file and reports the recording stats
+ */
+void recorder_destroy(Recorder *rec) {
+    if (!rec) {
+        return;
+    }
+
+    atomic_store_explicit(&rec->running, false, memory_order_release);
+    pthread_cond_signal(&rec->cond);
+    pthread_join(rec->thread, NULL);
+
+    fclose(rec->fp);
+    LOG_INFO_F("recorded %lu frames (%lu keyframes, %lu dropped, stride %u) to '%s': %.2f MB",
+        rec->written, rec->keyframes, rec->dropped, rec->stride, rec->path, rec->bytes / (1024.0 * 1024.0));
+
+    for (int i = 0; i < RECORDER_QUEUE_LEN; i++) {
+        freez(rec->slots[i].positions);
+        freez(rec->slots[i].colors);
+    }
+    pthread_mutex_destroy(&rec->lock);
+    pthread_cond_destroy(&rec->cond);
+    freez(rec->prev);
+    freez(rec->buffer);
+    freez(rec->path);
+    freez(rec);
+}
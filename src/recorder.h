@@ -0,0 +1,107 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "vec.h"
+
+typedef struct State State;
+
+////
+// Trajectory file
+//
+//   [TrajHeader][TrajRecord + payload]...
+//
+// Positions are quantized to fixed point (1 / TRAJ_SCALE px). Keyframes store the absolute
+// positions, sizes and colors, delta frames the zigzag varint encoded difference to the previous record.
+////
+
+#define TRAJ_MAGIC "BORTTRAJ"
+#define TRAJ_VERSION 1
+#define TRAJ_SCALE 256.f
+
+typedef enum {
+    TRAJ_KEYFRAME = 1,  // len * TrajKey
+    TRAJ_DELTA    = 2,  // len * (varint dx, varint dy)
+} TrajRecordType;
+
+typedef struct TrajHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+    float dt;           // seconds per simulation step
+    float scale;        // TRAJ_SCALE
+    uint32_t reserved;
+} TrajHeader;
+
+typedef struct TrajRecord {
+    uint32_t type;
+    uint32_t len;       // borticles
+    uint64_t step;
+    uint64_t size;      // payload bytes following the record
+} TrajRecord;
+
+typedef struct TrajKey {
+    int32_t x, y;
+    float size;
+    uint8_t color[4]; // rgba, 0..255
+} TrajKey;
+
+////
+// Recorder
+////
+
+#define RECORDER_QUEUE_LEN 8    // must be a power of 2
+#define RECORDER_KEYFRAME 120   // records between keyframes
+#define RECORDER_STRIDE_MAX 64  // downsampling limit when the writer falls behind
+
+/**
+ * Frame copy handed over to the writer thread
+ */
+typedef struct RecorderSlot {
+    uint64_t step;
+    unsigned int len;
+    unsigned int max;
+    vec4 *positions;
+    rgba *colors;
+} RecorderSlot;
+
+typedef struct Recorder {
+    FILE *fp;
+    char *path;
+
+    pthread_t thread;
+    atomic_bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    // single producer (simulation thread), single consumer (writer thread) queue
+    RecorderSlot slots[RECORDER_QUEUE_LEN];
+    atomic_size_t head; // written by consumer
+    atomic_size_t tail; // written by producer
+
+    // producer
+    unsigned int stride; // record every nth step
+    unsigned long pushed;
+    unsigned long dropped;
+
+    // consumer
+    int32_t *prev;      // quantized x,y of the last written record
+    unsigned int prev_len;
+    uint8_t *buffer;
+    size_t buffer_max;
+    unsigned long written;
+    unsigned long keyframes;
+    uint64_t bytes;
+} Recorder;
+
+Recorder *recorder_create(const char *path, State *state, unsigned int stride);
+void recorder_push(Recorder *rec, State *state);
+void recorder_destroy(Recorder *rec);
+
+#endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+
+#include "utils.h"
+#include "log.h"
+
+static const uint8_t *_get_varint(const uint8_t *buf, const uint8_t *end, int32_t *v) {
+    uint32_t z = 0;
+    int shift = 0;
+
+    while (buf < end && shift < 35) {
+        uint8_t b = *buf++;
+        z |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = (int32_t) ((z >> 1) ^ -(z & 1));
+            return buf;
+        }
+        shift += 7;
+    }
+    return NULL; // truncated or malformed
+}
+
+/**
+ * Scans the record headers once, collects keyframe offsets and the largest population.
+ * A truncated last record (e.g. an interrupted recording) ends the index.
+ */
+static int _index(Replay *replay) {
+    size_t offset = sizeof(TrajHeader);
+    size_t keys_max = 0;
+
+    while (offset + sizeof(TrajRecord) <= replay->size) {
+        TrajRecord record;
+        memcpy(&record, replay->map + offset, sizeof(TrajRecord)); // records are not aligned in the file
+        size_t end = offset + sizeof(TrajRecord) + record.size;
+
+        if (end > replay->size || end < offset) {
+            LOG_WARN_F("trajectory file '%s' truncated after %lu records", replay->path, replay->records);
+            break;
+        }
+
+        if (record.type == TRAJ_KEYFRAME) {
+            if (record.size != record.len * sizeof(TrajKey)) {
+                LOG_ERROR_F("invalid keyframe at record %lu", replay->records);
+                return -1;
+            }
+            if (replay->keys_len >= keys_max) {
+                keys_max = (keys_max) ? keys_max * 2 : 64;
+                replay->keys = realloc(replay->keys, keys_max * sizeof(ReplayKey));
+                EXIT_IF(replay->keys == NULL, "failed to (re)allocate for Replay->keys");
+            }
+            replay->keys[replay->keys_len++] = (ReplayKey) {offset, replay->records, record.step};
+        } else if (record.type != TRAJ_DELTA || !replay->keys_len) {
+            LOG_ERROR_F("invalid record type %u at record %lu", record.type, replay->records);
+            return -1;
+        }
+
+        if (record.len > replay->max_len) {
+            replay->max_len = record.len;
+        }
+
+        replay->records++;
+        offset = end;
+    }
+
+    if (!replay->keys_len) {
+        LOG_ERROR_F("no keyframes in trajectory file '%s'", replay->path);
+        return -1;
+    }
+    return 0;
+}
+
+// --- public
+
+/**
+ * Maps a trajectory file, indexes its keyframes and decodes the first record
+ */
+Replay *replay_open(const char *path) {
+    EXIT_IF(path == NULL, "no trajectory path");
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR_F("failed to open trajectory file '%s': %s", path, strerror(errno));
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(TrajHeader)) {
+        LOG_ERROR_F("invalid trajectory file '%s'", path);
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERROR_F("failed to map trajectory file '%s': %s", path, strerror(errno));
+        return NULL;
+    }
+    // played front to back, seeks are rare
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    Replay *replay = calloc(1, sizeof(Replay));
+    EXIT_IF(replay == NULL, "failed to allocate for Replay");
+
+    replay->path = strdup(path);
+    replay->map = map;
+    replay->size = st.st_size;
+    replay->header = (const TrajHeader*) map;
+
+    if (memcmp(replay->header->magic, TRAJ_MAGIC, sizeof(replay->header->magic)) != 0 || replay->header->version != TRAJ_VERSION) {
+        LOG_ERROR_F("not a trajectory file (version %d) '%s'", TRAJ_VERSION, path);
+        replay_close(replay);
+        return NULL;
+    }
+
+    if (_index(replay) != 0 || replay_seek(replay, 0) != 0) {
+        replay_close(replay);
+        return NULL;
+    }
+
+    return replay;
+}
+
+void replay_close(Replay *replay) {
+    if (!replay) {
+        return;
+    }
+
+    munmap(replay->map, replay->size);
+    freez(replay->keys);
+    freez(replay->q);
+    freez(replay->frame.positions);
+    freez(replay->frame.colors);
+    freez(replay->path);
+    freez(replay);
+}
+
+/**
+ * Decodes the next record into replay->frame. Returns -1 at the end of the file.
+ */
+int replay_next(Replay *replay) {
+    if (replay->record >= replay->records) {
+        return -1;
+    }
+
+    TrajRecord record;
+    memcpy(&record, replay->map + replay->offset, sizeof(TrajRecord)); // records are not aligned in the file
+    const uint8_t *data = replay->map + replay->offset + sizeof(TrajRecord);
+    Frame *frame = &replay->frame;
+    float scale = 1.f / replay->header->scale;
+
+    if (record.type == TRAJ_KEYFRAME) {
+        TrajKey key;
+
+        for (unsigned int i = 0; i < record.len; i++) {
+            memcpy(&key, data + i * sizeof(TrajKey), sizeof(TrajKey));
+            replay->q[i * 2] = key.x;
+            replay->q[i * 2 + 1] = key.y;
+            frame->positions[i] = (vec4) {key.x * scale, key.y * scale, 0.f, key.size};
+            frame->colors[i] = (rgba) {key.color[0] / 255.f, key.color[1] / 255.f, key.color[2] / 255.f, key.color[3] / 255.f};
+        }
+
+        // keys are ordered by record
+        while (replay->key + 1 < replay->keys_len && replay->keys[replay->key + 1].record <= replay->record) {
+            replay->key++;
+        }
+    } else {
+        if (record.len != frame->len) {
+            LOG_ERROR_F("delta record %lu does not match the population of its keyframe", replay->record);
+            return -1;
+        }
+
+        const uint8_t *end = data + record.size;
+        for (unsigned int i = 0; i < record.len * 2; i++) {
+            int32_t d;
+            data = _get_varint(data, end, &d);
+            if (!data) {
+                LOG_ERROR_F("malformed delta record %lu", replay->record);
+                return -1;
+            }
+            replay->q[i] = (int32_t) ((uint32_t) replay->q[i] + (uint32_t) d);
+        }
+
+        for (unsigned int i = 0; i < record.len; i++) {
+            frame->positions[i].x = replay->q[i * 2] * scale;
+            frame->positions[i].y = replay->q[i * 2 + 1] * scale;
+        }
+    }
+
+    frame->len = record.len;
+    frame->step = record.step;
+
+    replay->offset += sizeof(TrajRecord) + record.size;
+    replay->record++;
+    return 0;
+}
+
+/**
+ * Moves the cursor to a keyframe (clamped to the index) and decodes it
+ */
+int replay_seek(Replay *replay, size_t key) {
+    if (key >= replay->keys_len) {
+        key = replay->keys_len - 1;
+    }
+
+    Frame *frame = &replay->frame;
+    if (replay->max_len > frame->max) {
+        frame->positions = realloc(frame->positions, replay->max_len * sizeof(vec4));
+        EXIT_IF(frame->positions == NULL, "failed to (re)allocate for Replay->frame.positions");
+        frame->colors = realloc(frame->colors, replay->max_len * sizeof(rgba));
+        EXIT_IF(frame->colors == NULL, "failed to (re)allocate for Replay->frame.colors");
+        replay->q = realloc(replay->q, replay->max_len * 2 * sizeof(int32_t));
+        EXIT_IF(replay->q == NULL, "failed to (re)allocate for Replay->q");
+        frame->max = replay->max_len;
+
+        // no interpolation between records
+        frame->prev_positions = frame->positions;
+        frame->dt = replay->header->dt;
+    }
+
+    replay->key = key;
+    replay->offset = replay->keys[key].offset;
+    replay->record = replay->keys[key].record;
+
+    return replay_next(replay);
+}
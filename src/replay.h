@@ -0,0 +1,48 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "recorder.h"
+#include "sim.h"
+
+////
+// Playback of trajectory files (see recorder.h)
+////
+
+typedef struct ReplayKey {
+    size_t offset;          // file offset of the keyframe record
+    unsigned long record;   // record index
+    uint64_t step;
+} ReplayKey;
+
+typedef struct Replay {
+    char *path;
+    uint8_t *map;
+    size_t size;
+    const TrajHeader *header;
+
+    // index, built on open
+    unsigned long records;
+    unsigned int max_len;   // largest population
+    ReplayKey *keys;
+    size_t keys_len;
+
+    // cursor
+    size_t offset;          // next record
+    unsigned long record;   // index of the next record
+    size_t key;             // last passed keyframe
+
+    // decoded positions
+    int32_t *q;
+    Frame frame;
+} Replay;
+
+Replay *replay_open(const char *path);
+void replay_close(Replay *replay);
+
+int replay_next(Replay *replay);
+int replay_seek(Replay *replay, size_t key);
+
+#endif
@@ -0,0 +1,12 @@
+#include "rng.h"
+
+/**
+ * Initializes a stream, the same (seed, stream) pair always yields the same sequence
+ */
+void rng_seed(Rng *rng, uint64_t seed, uint64_t stream) {
+    rng->state = 0U;
+    rng->inc = (stream << 1u) | 1u;
+    rng_next(rng);
+    rng->state += seed;
+    rng_next(rng);
+}
@@ -0,0 +1,41 @@
+#ifndef __RNG_H__
+#define __RNG_H__
+
+#include <stdint.h>
+
+////
+// PCG32 random number generator (pcg32_random_r)
+// @see https://www.pcg-random.org/
+//
+// Each Rng is an independent stream: (seed, stream) pairs never share state,
+// so per borticle or per thread streams give the same numbers regardless of execution order.
+////
+
+typedef struct Rng {
+    uint64_t state;
+    uint64_t inc; // stream selector, always odd
+} Rng;
+
+void rng_seed(Rng *rng, uint64_t seed, uint64_t stream);
+
+static inline uint32_t rng_next(Rng *rng) {
+    uint64_t old = rng->state;
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+
+    uint32_t xorshifted = (uint32_t) (((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = (uint32_t) (old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+/**
+ * uniform float in [0, 1)
+ */
+static inline float rng_float(Rng *rng) {
+    return (rng_next(rng) >> 8) * (1.f / 16777216.f);
+}
+
+static inline float rng_range_f(Rng *rng, float min, float max) {
+    return min + rng_float(rng) * (max - min);
+}
+
+#endif
@@ -7,6 +7,7 @@
 #include "vec.h"
 #include "state.h"
 #include "shader.h"
+#include "sim.h"
 
 #include "log.h"
 #include "utils.h"
@@ -86,8 +87,6 @@ unsigned int shader_program(unsigned int vertexShader, unsigned int fragmentShad
 // quadtree render
 ////
 
-#define QTREE_RENDER_MAX 24000 // fixed memory size required for setting up vbo
-
 void qtree_init_shaders(ShaderInfo *shader) {
     GLuint vsh = shader_load("shaders/qtree.vert", GL_VERTEX_SHADER);
     GLuint fsh = shader_load("shaders/qtree.frag", GL_FRAGMENT_SHADER);
@@ -112,104 +111,23 @@ void qtree_init_shaders(ShaderInfo *shader) {
     glUseProgram(0);
 }
 
-struct QuadArray {
-    vec2 *vertexes;
-    size_t max;
-    size_t len;
-};
-
-struct QuadArray *_create_quad_array(size_t max) {
-    struct QuadArray *quads = malloc(sizeof(struct QuadArray));
-    EXIT_IF(quads == NULL, "could not allocate for QuadArray");
-
-    quads->vertexes = malloc(max * sizeof(vec2));
-    EXIT_IF_F(quads->vertexes == NULL, "could not allocate for max %ld vertexes in QuadArray", max);
-
-    quads->max = max;
-    quads->len = 0;
-
-    return quads;
-}
-
-static void _fill_quad_array(QNode *root, struct QuadArray *quads) {
-
-    if (quads->len >= QTREE_RENDER_MAX - 1) {
-        return;
-    }
-
-    if (quads->len >= quads->max - 1) {
-        quads->max += 16; // 4* 4
-        quads->vertexes = realloc(quads->vertexes, quads->max * sizeof(struct QuadArray));
-        EXIT_IF_F(quads->vertexes == NULL, "could not reallocate for max %ld vertexes in QuadArray", quads->max);
-    }
-
-    vec2 nw = root->self_nw;
-
-
-    vec2 ne = (vec2) {
-        root->self_se.x,
-        root->self_nw.y
-    };
-
-    vec2 se = root->self_se;
-
-    vec2 sw = (vec2) {
-        root->self_nw.x,
-        root->self_se.y
-    };
-
-    // nw -> ne
-    quads->vertexes[quads->len] = nw;
-    quads->len++;
-    quads->vertexes[quads->len] = ne;
-    quads->len++;
-
-    // ne -> se
-    quads->vertexes[quads->len] = ne;
-    quads->len++;
-    quads->vertexes[quads->len] = se;
-    quads->len++;
-
-    if(root->nw != NULL) _fill_quad_array(root->nw, quads);
-    if(root->ne != NULL) _fill_quad_array(root->ne, quads);
-    if(root->sw != NULL) _fill_quad_array(root->sw, quads);
-    if(root->se != NULL) _fill_quad_array(root->se, quads);
-}
-
-void _print_quad_array(FILE *fp, struct QuadArray *quads) {
-    if (!fp) {
-        return;
-    }
-    if (!quads) {
-        fprintf(fp, "[]\n");
-        return;
-    }
-    fprintf(fp, "[");
-    for (size_t i = 0; i < quads->len; i++){
-        if (i % 4 == 0){
-            fprintf(fp, "\n    ");
-        }
-        fprintf(fp, "{#:%ld, x:%f, y:%f}%s", i, quads->vertexes[i].x, quads->vertexes[i].y, (i < quads->len -1) ? ", " : "");
-    }
-    fprintf(fp, "\n]\n");
-}
-
 /**
- * qnode_walk(state->tree->root, _qtree_draw_quad, NULL);
+ * qnode_visit(state->tree->root, _qtree_draw_quad, NULL, NULL);
 */
-static void _qtree_draw_quad(QNode *node) {
+static int _qtree_draw_quad(QNode *node, void *ctx) {
    DrawRectangleLinesEx((Rectangle) {
         (int) node->self_nw.x,
         (int) node->self_nw.y,
         (int) (node->self_se.x - node->self_nw.x),
         (int) (node->self_se.y - node->self_nw.y)
     }, 0.5f, GRAY);
+   return QVISIT_CONTINUE;
 }
 /**
- * prepares drawing to window
+ * prepares drawing to window, the quad vertexes are filled by the simulation thread (see sim.c)
  */
-void qtree_draw_2D(ShaderInfo *shader, State *state) {
-    if (!state->tree) {
+void qtree_draw_2D(ShaderInfo *shader, State *state, Frame *frame) {
+    if (!frame || !frame->quads_len) {
         return;
     }
 
@@ -217,28 +135,20 @@ void qtree_draw_2D(ShaderInfo *shader, State *state) {
         return;
     }
 
-    //qnode_walk(state->tree->root, _qtree_draw_quad, NULL);
-    //return;
-    // update
-
-    struct QuadArray *quads = _create_quad_array(state->tree->length * 4);
-    _fill_quad_array(state->tree->root, quads);
-    // _print_quad_array(stderr, quads);
-
     // draw
     glUseProgram(shader->program);
     glBindVertexArray(shader->vao[0]);
 
     // positions
     glBindBuffer(GL_ARRAY_BUFFER, shader->vbo[0]);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vec2) * quads->len, &quads->vertexes[0]);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vec2) * frame->quads_len, &frame->quads[0]);
 
     GLenum mode = GL_LINES;
     size_t stride = 0;
     glEnableVertexAttribArray(0);
     glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void*)0);
 
-    glDrawArrays(mode, 0, quads->len);
+    glDrawArrays(mode, 0, frame->quads_len);
 
     glDisableVertexAttribArray(0);
     glBindVertexArray(0);
@@ -4,6 +4,7 @@
 #include <glad/glad.h>
 
 typedef struct State State;
+typedef struct Frame Frame;
 
 typedef struct ShaderInfo {
     GLuint program;
@@ -14,6 +15,7 @@ typedef struct ShaderInfo {
     GLint loc_model;
     GLint loc_view;
     GLint loc_projection;
+    GLint loc_alpha;
 
     float mat_model[4][4];
     float mat_view[4][4];
@@ -26,8 +28,10 @@ int shader_set_uniform_mat4(unsigned int program, char *name, float mat[4][4]);
 unsigned int shader_program(unsigned int vertexShader, unsigned int fragmentShader, unsigned int geometryShader);
 
 // rendering
+#define QTREE_RENDER_MAX 24000 // fixed memory size required for setting up vbo
+
 void qtree_init_shaders(ShaderInfo *shader);
-void qtree_draw_2D(ShaderInfo *shader, State *state);
+void qtree_draw_2D(ShaderInfo *shader, State *state, Frame *frame);
 void qtree_cleanup_shaders(ShaderInfo *shader);
 
 #endif
@@ -0,0 +1,418 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "qtree/qtree.h"
+
+#include "vec.h"
+#include "state.h"
+#include "borticle.h"
+#include "shader.h"
+#include "sim.h"
+#include "snapshot.h"
+#include "recorder.h"
+#include "cluster.h"
+
+#include "utils.h"
+#include "log.h"
+#include "profiler.h"
+#include "trace.h"
+
+#define SIM_FRAME_FRESH 0x10 // flag on sim->ready: frame was published but not yet consumed
+
+////
+// CommandQueue
+////
+
+/**
+ * Pushes a command, called from the render thread only. Returns -1 if the queue is full.
+ */
+int cmdq_push(CommandQueue *queue, Command cmd) {
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+    if (tail - head >= CMD_QUEUE_LEN) {
+        return -1;
+    }
+
+    queue->cmds[tail & (CMD_QUEUE_LEN - 1)] = cmd;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+/**
+ * Pops a command, called from the simulation thread only. Returns -1 if the queue is empty.
+ */
+int cmdq_pop(CommandQueue *queue, Command *cmd) {
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+    if (head == tail) {
+        return -1;
+    }
+
+    *cmd = queue->cmds[head & (CMD_QUEUE_LEN - 1)];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return 0;
+}
+
+////
+// Frames
+////
+
+static void _frame_reserve(Frame *frame, unsigned int len) {
+    if (len <= frame->max) {
+        return;
+    }
+
+    frame->positions = realloc(frame->positions, len * sizeof(vec4));
+    EXIT_IF(frame->positions == NULL, "failed to (re)allocate for Frame->positions");
+
+    frame->prev_positions = realloc(frame->prev_positions, len * sizeof(vec4));
+    EXIT_IF(frame->prev_positions == NULL, "failed to (re)allocate for Frame->prev_positions");
+
+    frame->colors = realloc(frame->colors, len * sizeof(rgba));
+    EXIT_IF(frame->colors == NULL, "failed to (re)allocate for Frame->colors");
+
+    frame->max = len;
+}
+
+static void _frame_push_quad(Frame *frame, vec2 a, vec2 b) {
+    if (frame->quads_len + 2 > frame->quads_max) {
+        frame->quads_max = (frame->quads_max) ? frame->quads_max * 2 : 1024;
+        frame->quads = realloc(frame->quads, frame->quads_max * sizeof(vec2));
+        EXIT_IF(frame->quads == NULL, "failed to (re)allocate for Frame->quads");
+    }
+    frame->quads[frame->quads_len++] = a;
+    frame->quads[frame->quads_len++] = b;
+}
+
+/**
+ * Fills the north and east edges of each quad as GL_LINES vertexes (visitor, ctx: Frame)
+ */
+static int _frame_fill_quad(QNode *node, void *ctx) {
+    Frame *frame = (Frame*) ctx;
+    if (frame->quads_len >= QTREE_RENDER_MAX - 4) {
+        return QVISIT_STOP;
+    }
+
+    vec2 nw = node->self_nw;
+    vec2 ne = (vec2) {node->self_se.x, node->self_nw.y};
+    vec2 se = node->self_se;
+
+    _frame_push_quad(frame, nw, ne);
+    _frame_push_quad(frame, ne, se);
+    return QVISIT_CONTINUE;
+}
+
+static void _frame_destroy(Frame *frame) {
+    freez(frame->positions);
+    freez(frame->prev_positions);
+    freez(frame->colors);
+    freez(frame->quads);
+}
+
+////
+// Simulation thread
+////
+
+static void _apply(Simulation *sim, Command cmd) {
+    State *state = sim->state;
+
+    switch (cmd.type) {
+        case CMD_PAUSED:
+            state->paused = cmd.u;
+        break;
+
+        case CMD_PARAM:
+            *algo_param(state, cmd.param) = cmd.f;
+        break;
+
+        case CMD_BH_QUADRUPOLE:
+            state->bh_quadrupole = cmd.u;
+        break;
+
+        case CMD_BH_FAR_EVERY:
+            state->bh_far_every = cmd.u;
+        break;
+
+        case CMD_POP_LEN:
+            state_set_pop_len(state, cmd.u);
+        break;
+
+        case CMD_ALGORITHMS:
+            state->algorithms = cmd.u;
+        break;
+
+        case CMD_OVERLAY:
+            sim->overlay = cmd.u;
+        break;
+
+        case CMD_SELECT:
+            if (state->selected) {
+                state->selected = NULL;
+            } else if (state->dims == 2) { // 3D: window positions are projected, no picking
+                if (!state->tree) {
+                    bort_build_tree(state); // no active algorithm needs it
+                }
+                QNode *nearest = qtree_find_nearest(state->tree, cmd.v);
+                if (nearest) {
+                    state->selected = (Borticle*) nearest->data;
+                }
+            }
+        break;
+
+        case CMD_SNAPSHOT: {
+            char path[256];
+            snprintf(path, sizeof(path), "snapshot-%lu.bort", state->step);
+            if (snapshot_save(state, path) == 0) {
+                LOG_INFO_F("saved snapshot '%s'", path);
+            }
+        }
+        break;
+
+        default:
+            LOG_WARN_F("unknown command type %d", cmd.type);
+        break;
+    }
+}
+
+static void _step(Simulation *sim) {
+    State *state = sim->state;
+
+    prof_begin(PROF_STEP);
+
+    // keep the vbo positions of the previous step for render interpolation
+    if (state->pop_len > sim->last_max) {
+        sim->last = realloc(sim->last, state->pop_len * sizeof(vec4));
+        EXIT_IF(sim->last == NULL, "failed to (re)allocate for Simulation->last");
+        sim->last_max = state->pop_len;
+    }
+    if (state->positions) {
+        memcpy(sim->last, state->positions, state->pop_len * sizeof(vec4));
+    }
+    sim->last_len = state->pop_len;
+
+    if (sim->cluster) {
+        cluster_step(sim->cluster, state);
+    } else {
+        bort_update(state);
+    }
+    recorder_push(sim->recorder, state);
+
+    prof_end(PROF_STEP);
+}
+
+/**
+ * Copies the vbo data of the last step into the back frame and swaps it with the ready frame
+ */
+static void _publish(Simulation *sim) {
+    State *state = sim->state;
+    Frame *frame = &sim->frames[sim->back];
+
+    _frame_reserve(frame, state->pop_len);
+    memcpy(frame->positions, state->positions, state->pop_len * sizeof(vec4));
+    memcpy(frame->colors, state->colors, state->pop_len * sizeof(rgba));
+
+    // population changed in between: nothing to interpolate from
+    vec4 *prev = (sim->last_len == state->pop_len) ? sim->last : state->positions;
+    memcpy(frame->prev_positions, prev, state->pop_len * sizeof(vec4));
+
+    frame->len = state->pop_len;
+    frame->step = state->step;
+    frame->due = sim->due;
+    frame->dt = state->dt;
+
+    frame->quads_len = 0;
+    if (sim->overlay && state->dims == 2) {
+        if (!state->tree) {
+            bort_build_tree(state); // no active algorithm needs it
+        }
+        prof_begin(PROF_OVERLAY);
+        qnode_visit(state->tree->root, _frame_fill_quad, NULL, frame);
+        prof_end(PROF_OVERLAY);
+    }
+
+    frame->has_selected = (state->selected != NULL);
+    if (state->selected) {
+        frame->selected = *state->selected;
+    }
+
+    int ready = atomic_exchange_explicit(&sim->ready, sim->back | SIM_FRAME_FRESH, memory_order_acq_rel);
+    sim->back = ready & ~SIM_FRAME_FRESH;
+}
+
+static void _sleep_until(double t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t) t;
+    ts.tv_nsec = (long) ((t - (double) ts.tv_sec) * 1e9);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/**
+ * Fixed timestep loop: real time is accumulated and consumed in steps of state->dt,
+ * at most state->sim_max_steps per iteration. Any remaining backlog is dropped, the simulation slows down instead of spiraling.
+ */
+static void *_run(void *arg) {
+    Simulation *sim = (Simulation*) arg;
+    State *state = sim->state;
+    Command cmd;
+
+    trace_thread_name("simulation");
+
+    double prev = time_monotonic();
+    double acc = 0.0;
+
+    while (atomic_load_explicit(&sim->running, memory_order_acquire)) {
+        bool applied = false;
+        while (cmdq_pop(&sim->commands, &cmd) == 0) {
+            _apply(sim, cmd);
+            applied = true;
+        }
+
+        double now = time_monotonic();
+
+        // paused: poll commands every 10ms, don't catch up afterwards
+        if (state->paused) {
+            prev = now;
+            acc = 0.0;
+            if (applied) {
+                // show the changes right away, fully interpolated to the current positions
+                sim->due = now - state->dt;
+                _publish(sim);
+            }
+            _sleep_until(now + 0.01);
+            continue;
+        }
+
+        acc += now - prev;
+        prev = now;
+
+        unsigned int steps = 0;
+        while (acc >= state->dt && steps < state->sim_max_steps) {
+            _step(sim);
+            acc -= state->dt;
+            steps++;
+        }
+
+        if (acc >= state->dt) {
+            acc = fmod(acc, state->dt);
+        }
+
+        if (steps) {
+            // the latest state is displayed one step behind real time (interpolated from the previous one)
+            sim->due = now - acc;
+            trace_begin("publish");
+            _publish(sim);
+            trace_end("publish");
+        }
+
+        _sleep_until(now + (state->dt - acc));
+    }
+
+    return NULL;
+}
+
+// --- public
+
+Simulation *sim_create(State *state) {
+    EXIT_IF(state == NULL, "no state");
+
+    Simulation *sim = calloc(1, sizeof(Simulation));
+    EXIT_IF(sim == NULL, "failed to allocate for Simulation");
+
+    sim->state = state;
+    atomic_init(&sim->running, false);
+    atomic_init(&sim->commands.head, 0);
+    atomic_init(&sim->commands.tail, 0);
+
+    sim->back = 0;
+    atomic_init(&sim->ready, 1);
+    sim->front = 2;
+
+    sim->overlay = state->ui_qtree;
+
+    return sim;
+}
+
+void sim_destroy(Simulation *sim) {
+    if (!sim) {
+        return;
+    }
+    sim_stop(sim);
+
+    for (int i = 0; i < SIM_FRAMES; i++) {
+        _frame_destroy(&sim->frames[i]);
+    }
+    freez(sim->last);
+    freez(sim);
+}
+
+void sim_start(Simulation *sim) {
+    if (!sim || atomic_load(&sim->running)) {
+        return;
+    }
+
+    // publish the initial population before the thread takes over state
+    _step(sim);
+    sim->due = time_monotonic();
+    _publish(sim);
+
+    atomic_store(&sim->running, true);
+    int err = pthread_create(&sim->thread, NULL, _run, sim);
+    EXIT_IF_F(err != 0, "failed to create simulation thread (%d)", err);
+}
+
+void sim_stop(Simulation *sim) {
+    if (!sim || !atomic_load(&sim->running)) {
+        return;
+    }
+    atomic_store(&sim->running, false);
+    pthread_join(sim->thread, NULL);
+}
+
+/**
+ * Sends a command to the simulation thread, called from the render thread only.
+ */
+int sim_send(Simulation *sim, Command cmd) {
+    if (!sim) {
+        return -1;
+    }
+
+    if (cmdq_push(&sim->commands, cmd) != 0) {
+        LOG_WARN_F("command queue full, dropping command type %d", cmd.type);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns the latest completed frame, called from the render thread only.
+ * The frame stays valid until the next call.
+ */
+Frame *sim_frame(Simulation *sim) {
+    if (!sim) {
+        return NULL;
+    }
+
+    if (atomic_load_explicit(&sim->ready, memory_order_acquire) & SIM_FRAME_FRESH) {
+        int prev = atomic_exchange_explicit(&sim->ready, sim->front, memory_order_acq_rel);
+        sim->front = prev & ~SIM_FRAME_FRESH;
+    }
+
+    Frame *frame = &sim->frames[sim->front];
+    return (frame->positions) ? frame : NULL;
+}
+
+/**
+ * Returns the interpolation factor between frame->prev_positions (0.f) and frame->positions (1.f) for the current time
+ */
+float sim_alpha(Frame *frame) {
+    if (!frame || frame->dt <= 0.f) {
+        return 1.f;
+    }
+
+    float alpha = (float) ((time_monotonic() - frame->due) / frame->dt);
+    return (alpha < 0.f) ? 0.f : (alpha > 1.f) ? 1.f : alpha;
+}
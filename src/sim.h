@@ -0,0 +1,125 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "vec.h"
+#include "borticle.h"
+#include "algorithm.h"
+
+typedef struct State State;
+typedef struct Recorder Recorder;
+typedef struct Cluster Cluster;
+
+////
+// Commands (render thread -> simulation thread)
+////
+
+typedef enum {
+    CMD_NONE,
+    CMD_PAUSED,     // .u: 0|1
+    CMD_PARAM,      // .param, .f: algorithm parameter
+    CMD_BH_QUADRUPOLE, // .u: 0|1
+    CMD_BH_FAR_EVERY, // .u: steps
+    CMD_POP_LEN,    // .u
+    CMD_ALGORITHMS, // .u: bitflag
+    CMD_OVERLAY,    // .u: 0|1, fill qtree overlay vertexes into frames
+    CMD_SELECT,     // .v: window position, toggles selection of the nearest borticle
+    CMD_SNAPSHOT,   // writes a snapshot to snapshot-<step>.bort
+} CommandType;
+
+typedef struct Command {
+    CommandType type;
+    const AlgoParam *param;
+    union {
+        float f;
+        unsigned int u;
+        vec2 v;
+    };
+} Command;
+
+#define CMD_QUEUE_LEN 64 // must be a power of 2
+
+/**
+ * Lock-free single producer (render thread), single consumer (simulation thread) ring buffer
+ */
+typedef struct CommandQueue {
+    Command cmds[CMD_QUEUE_LEN];
+    atomic_size_t head; // written by consumer
+    atomic_size_t tail; // written by producer
+} CommandQueue;
+
+int cmdq_push(CommandQueue *queue, Command cmd);
+int cmdq_pop(CommandQueue *queue, Command *cmd);
+
+////
+// Frames (simulation thread -> render thread)
+////
+
+#define SIM_FRAMES 3 // triple buffer: back (simulation), ready, front (render)
+
+typedef struct Frame {
+    unsigned long step;
+
+    // interpolation: the frame is displayed from prev_positions to positions over [due, due + dt]
+    double due;
+    float dt;
+
+    // vbo data
+    unsigned int len;
+    unsigned int max;
+    vec4 *positions;
+    vec4 *prev_positions;
+    rgba *colors;
+
+    // qtree overlay (GL_LINES vertexes)
+    size_t quads_len;
+    size_t quads_max;
+    vec2 *quads;
+
+    // copy of state->selected
+    bool has_selected;
+    Borticle selected;
+} Frame;
+
+////
+// Simulation
+////
+
+typedef struct Simulation {
+    State *state;
+
+    pthread_t thread;
+    atomic_bool running;
+
+    CommandQueue commands;
+
+    Frame frames[SIM_FRAMES];
+    atomic_int ready;   // index of the latest completed frame, | SIM_FRAME_FRESH if not yet consumed
+    int back;           // owned by simulation thread
+    int front;          // owned by render thread
+
+    bool overlay;       // simulation thread copy of state->ui_qtree
+    Recorder *recorder; // optional, fed after each step
+    Cluster *cluster;   // optional, steps run over the cluster ranks
+    double due;         // monotonic time the latest step belongs to
+
+    // vbo positions of the previous step
+    vec4 *last;
+    unsigned int last_len;
+    unsigned int last_max;
+} Simulation;
+
+Simulation *sim_create(State *state);
+void sim_destroy(Simulation *sim);
+
+void sim_start(Simulation *sim);
+void sim_stop(Simulation *sim);
+
+int sim_send(Simulation *sim, Command cmd);
+Frame *sim_frame(Simulation *sim);
+float sim_alpha(Frame *frame);
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "state.h"
+#include "borticle.h"
+#include "snapshot.h"
+
+#include "utils.h"
+#include "log.h"
+
+static uint32_t _data_offset() {
+    return ((sizeof(SnapshotHeader) + SNAPSHOT_ALIGN - 1) / SNAPSHOT_ALIGN) * SNAPSHOT_ALIGN;
+}
+
+/**
+ * writev() until all iovecs are written, returns -1 on error
+ */
+static int _writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        // advance over the written bytes
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// --- public
+
+/**
+ * Writes the state with a single (gathering) write to a temporary file which is then renamed to path.
+ */
+int snapshot_save(State *state, const char *path) {
+    if (!state || !path) {
+        return -1;
+    }
+
+    SnapshotHeader header = {0};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(SnapshotHeader);
+    header.borticle_size = sizeof(Borticle);
+    header.data_offset = _data_offset();
+
+    header.width = state->width;
+    header.height = state->height;
+    header.algorithms = state->algorithms;
+    header.grav_g = state->grav_g;
+    header.bh_theta = state->bh_theta;
+    header.dt = state->dt;
+    header.softening = state->softening;
+    header.dims = state->dims;
+
+    header.seed = state->seed;
+    header.rng = state->rng;
+    header.step = state->step;
+    header.pop_len = state->pop_len;
+
+    char padding[SNAPSHOT_ALIGN] = {0};
+    struct iovec iov[3] = {
+        {&header, sizeof(SnapshotHeader)},
+        {padding, header.data_offset - sizeof(SnapshotHeader)},
+        {state->population, state->pop_len * sizeof(Borticle)},
+    };
+
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        LOG_ERROR_F("failed to open snapshot file '%s': %s", tmp, strerror(errno));
+        return -1;
+    }
+
+    if (_writev_all(fd, iov, 3) != 0) {
+        LOG_ERROR_F("failed to write snapshot file '%s': %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    close(fd);
+
+    if (rename(tmp, path) != 0) {
+        LOG_ERROR_F("failed to rename snapshot file '%s': %s", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Maps a snapshot file and replaces the state's simulation fields and population.
+ * pop_max is raised if the snapshot population exceeds it.
+ */
+int snapshot_load(State *state, const char *path) {
+    if (!state || !path) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOG_ERROR_F("failed to open snapshot file '%s': %s", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(SnapshotHeader)) {
+        LOG_ERROR_F("invalid snapshot file '%s'", path);
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_ERROR_F("failed to map snapshot file '%s': %s", path, strerror(errno));
+        return -1;
+    }
+
+    const SnapshotHeader *header = (const SnapshotHeader*) map;
+    const char *err = NULL;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        err = "not a snapshot file";
+    } else if (header->version != SNAPSHOT_VERSION) {
+        err = "unsupported version";
+    } else if (header->header_size != sizeof(SnapshotHeader) || header->borticle_size != sizeof(Borticle)) {
+        err = "incompatible layout";
+    } else if (header->dims != 2 && header->dims != 3) {
+        err = "invalid dims";
+    } else if (!header->pop_len) {
+        err = "empty population";
+    } else if ((size_t) st.st_size < header->data_offset + (size_t) header->pop_len * sizeof(Borticle)) {
+        err = "truncated file";
+    }
+
+    if (err) {
+        LOG_ERROR_F("failed to load snapshot file '%s': %s", path, err);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    state->width = header->width;
+    state->height = header->height;
+    state->algorithms = header->algorithms;
+    state->grav_g = header->grav_g;
+    state->bh_theta = header->bh_theta;
+    state->dt = header->dt;
+    state->softening = header->softening;
+    state->dims = header->dims;
+
+    state->seed = header->seed;
+    state->rng = header->rng;
+    state->step = header->step;
+
+    if (header->pop_len > state->pop_max) {
+        state->pop_max = header->pop_len;
+    }
+    state_resize(state, header->pop_len);
+    memcpy(state->population, (const char*) map + header->data_offset, header->pop_len * sizeof(Borticle));
+
+    // vbo data is refreshed by the next bort_update(), fill it for renderers reading it before
+    for (unsigned int i = 0; i < state->pop_len; i++) {
+        Borticle *bort = &state->population[i];
+        state->positions[i] = (vec4) {bort->pos.x, bort->pos.y, bort->pos.z, bort->size};
+        state->colors[i] = bort->color;
+    }
+
+    munmap(map, st.st_size);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdint.h>
+
+#include "rng.h"
+
+typedef struct State State;
+
+////
+// Binary snapshot of the full simulation state
+//
+//   [SnapshotHeader][padding to data_offset][Borticle * pop_len]
+//
+// The population is stored as raw Borticle structs (host byte order and layout, all three axes of pos, vel and acc),
+// so a snapshot is loaded with a single memcpy from the mapped file.
+////
+
+#define SNAPSHOT_MAGIC "BORTSNAP"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_ALIGN 64
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;   // sizeof(SnapshotHeader)
+    uint32_t borticle_size; // sizeof(Borticle), rejects snapshots of a different struct layout
+    uint32_t data_offset;   // byte offset of the population
+
+    int32_t width;
+    int32_t height;
+    uint32_t algorithms;
+    float grav_g;
+    float bh_theta;
+    float dt;
+
+    uint64_t seed;
+    Rng rng;
+    uint64_t step;
+    uint32_t pop_len;
+    float softening;
+    uint32_t dims;
+} SnapshotHeader;
+
+int snapshot_save(State *state, const char *path);
+int snapshot_load(State *state, const char *path);
+
+#endif
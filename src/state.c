@@ -5,6 +5,7 @@
 #include "vec.h"
 #include "state.h"
 #include "borticle.h"
+#include "algorithm.h"
 
 #include "utils.h"
 #include "log.h"
@@ -12,7 +13,7 @@
 #include "ui.h"
 
 // @see enum Algotithm
-const char *algorithms[ALGO_LEN] = {"ALGO_NONE", "ALGO_NOMADIC", "ALGO_BARNES_HUT"};
+const char *algorithms[ALGO_LEN] = {"ALGO_NONE", "ALGO_NOMADIC", "ALGO_BARNES_HUT", "ALGO_DIRECT", "ALGO_FMM"};
 
 ////
 // State
@@ -24,23 +25,40 @@ State *state_create() {
 
     state->width = WORLD_WIDTH;
     state->height = WORLD_HEIGHT;
+    state->dims = 2;
 
     state->fps = 32;
     state->paused = 0;
 
+    state->dt = 1.f / SIM_RATE;
+    state->sim_max_steps = 4;
+
     state->bg_color = (Color) {51, 77, 77, 255};
     state->fg_color = (Color) {255, 255, 255, 255};
 
+    state_set_seed(state, 0);
+
+    algo_register_builtin();
     state->algorithms = ALGO_NONE;
 
     state->grav_g = 9.81f;
     state->bh_theta = 1.f;
+    state->bh_quadrupole = false;
+    state->bh_reuse = 0;
+    state->bh_reuse_drift = 1.f;
+    state->bh_far_every = 1;
+    state->fmm_theta = .5f;
+    state->softening = 2.f;
+    state->direct_max = DIRECT_MAX;
 
     state->pop_max = POP_MAX;
     state->pop_len = 0;
+    state->step = 0;
 
     state->population = NULL;
     state->tree = NULL;
+    state->otree = NULL;
+    state->tree_refit = false;
 
     state->selected = NULL;
 
@@ -56,6 +74,17 @@ State *state_create() {
     return state;
 }
 
+/**
+ * Sets the seed for all random streams, call before initializing the population
+ */
+void state_set_seed(State *state, uint64_t seed) {
+    if (!state) {
+        return;
+    }
+    state->seed = seed;
+    rng_seed(&state->rng, seed, RNG_STREAM_STATE);
+}
+
 void state_set_pop_len(State *state, unsigned int len) {
     if (!state || len <= 0) {
         return;
@@ -72,13 +101,25 @@ void state_set_pop_len(State *state, unsigned int len) {
         return;
     }
 
+    unsigned int prev = state->pop_len;
+    len = state_resize(state, len);
+
+    // fill borticles
+    if (len > prev) {
+        bort_init(state, prev, len);
+    }
+}
+
+/**
+ * (Re)allocates the population buffers without initializing new borticles, returns the (capped) length.
+ * Destroys the current trees.
+ */
+unsigned int state_resize(State *state, unsigned int len) {
     if (len > state->pop_max) {
         LOG_ERROR_F("State: length '%d' exceeds map pop_max, value capped to '%d'", len, state->pop_max);
         len = state->pop_max;
     }
 
-    unsigned int prev = state->pop_len;
-
     state->population = realloc(state->population, len * sizeof(Borticle));
     EXIT_IF(state->population == NULL, "failed to (re)allocate for State->population");
 
@@ -90,15 +131,16 @@ void state_set_pop_len(State *state, unsigned int len) {
 
     state->pop_len = len;
 
-    // fill borticles
-    if (len > prev) {
-        bort_init(state, prev, len);
-    }
+    // realloc might have moved the population
+    state->selected = NULL;
 
-    // also destroy the actual qtree
+    // also destroy the actual trees
     qtree_destroy(state->tree);
     state->tree = NULL;
+    otree_destroy(state->otree);
+    state->otree = NULL;
 
+    return len;
 }
 
 void state_destroy(State *state) {
@@ -110,6 +152,7 @@ void state_destroy(State *state) {
     freez(state->positions);
     freez(state->colors);
     qtree_destroy(state->tree);
+    otree_destroy(state->otree);
 
     freez(state);
 }
@@ -127,15 +170,27 @@ void state_print(FILE *fp, State *state) {
         "{\n"
         "  width: %d\n"
         "  height: %d\n"
+        "  dims: %d\n"
         "  fps: %d\n"
         "  paused: %d\n"
+        "  dt: %f\n"
+        "  sim_max_steps: %d\n"
         "  fg_color: {%d,%d,%d,%d}\n"
         "  bg_color: {%d,%d,%d,%d}\n"
+        "  seed: %lu\n"
         "  algorithms: %d\n"
         "  grav_g: %.2f\n"
         "  bh_theta: %.2f\n"
+        "  bh_quadrupole: %d\n"
+        "  bh_reuse: %d\n"
+        "  bh_reuse_drift: %.2f\n"
+        "  bh_far_every: %d\n"
+        "  fmm_theta: %.2f\n"
+        "  softening: %.2f\n"
+        "  direct_max: %d\n"
         "  pop_max: %d\n"
         "  pop_len: %d\n"
+        "  step: %lu\n"
         "  population: %s\n"
         "  tree: %d\n"
         "  selected: %d\n"
@@ -149,15 +204,27 @@ void state_print(FILE *fp, State *state) {
 
         state->width,
         state->height,
+        state->dims,
         state->fps,
         state->paused,
+        state->dt,
+        state->sim_max_steps,
         state->fg_color.r, state->fg_color.g, state->fg_color.b, state->fg_color.a,
         state->bg_color.r, state->bg_color.g, state->bg_color.b, state->bg_color.a,
+        state->seed,
         state->algorithms,
         state->grav_g,
         state->bh_theta,
+        state->bh_quadrupole,
+        state->bh_reuse,
+        state->bh_reuse_drift,
+        state->bh_far_every,
+        state->fmm_theta,
+        state->softening,
+        state->direct_max,
         state->pop_max,
         state->pop_len,
+        state->step,
         (state->population) ? "[...]" : "<NULL>",
         (state->tree) ? state->tree->length : -1,
         (state->selected) ? state->selected->id : -1,
@@ -5,8 +5,10 @@
 #include "raylib.h"
 
 #include "qtree/qtree.h"
+#include "qtree/otree.h"
 
 #include "vec.h"
+#include "rng.h"
 #include "borticle.h"
 
 ////
@@ -17,16 +19,28 @@
 #define WORLD_HEIGHT 600
 
 #define POP_MAX 10000
+#define SIM_RATE 60 // default simulation steps per second
+#define DIRECT_MAX 4096 // default state->direct_max
+#define RNG_STREAM_STATE (1ULL << 62) // stream of state->rng, borticle streams use their index
 
 typedef struct State {
     int width, height;
+    unsigned int dims; // 2: quadtree, 3: octree and perspective view (set on startup)
 
     unsigned int fps;
     bool paused;
 
+    // fixed timestep
+    float dt;                   // seconds per simulation step
+    unsigned int sim_max_steps; // max catch-up steps per simulation loop iteration
+
     Color bg_color;
     Color fg_color;
 
+    // random streams: state->rng for the simulation thread, per borticle streams (seed, index) for init
+    uint64_t seed;
+    Rng rng;
+
     // algorithms
     unsigned int algorithms; // bitflag
 
@@ -34,13 +48,32 @@ typedef struct State {
     float grav_g;
     // Threshold for using center of mass approximation vs direct summation
     float bh_theta;
+    // Barnes-Hut adds the quadrupole term of accepted nodes (monopole only otherwise)
+    bool bh_quadrupole;
+    // Barnes-Hut walks the tree once per group of nearby borticles and reuses the interaction lists
+    // (on a refit tree) for up to bh_reuse steps, 0: per borticle walks on every step
+    unsigned int bh_reuse;
+    // A borticle moving further (px) since the lists were built ends the reuse
+    float bh_reuse_drift;
+    // Barnes-Hut sums the accepted nodes (far field) every bh_far_every steps and caches them per borticle,
+    // the leaves (near field) on every step, 1: everything on every step (per borticle walks only)
+    unsigned int bh_far_every;
+    // Fast multipole: cells interact by their expansions if (r_a + r_b) / distance < fmm_theta
+    float fmm_theta;
+    // Softening length (px), bounds the force of close encounters
+    float softening;
+    // Barnes-Hut and fast multipole run as direct summation below this population (0: never)
+    unsigned int direct_max;
 
     // population
     unsigned int pop_max;
     unsigned int pop_len;
+    unsigned long step;
 
     Borticle *population;
-    QTree *tree;
+    QTree *tree;   // 2D
+    OTree *otree;  // 3D
+    bool tree_refit; // set by an algorithm on every step to keep the tree topology for the next one
 
     // sngle borticle to track
     Borticle *selected;
@@ -49,7 +82,7 @@ typedef struct State {
     vec4 *positions;
     rgba *colors;
 
-    // ui
+    // ui (owned by the render thread, changes are sent as commands to the simulation thread)
     bool ui_minimized;
 
     bool ui_debug;
@@ -61,7 +94,9 @@ typedef struct State {
 State *state_create();
 void state_destroy(State *state);
 
+void state_set_seed(State *state, uint64_t seed);
 void state_set_pop_len(State *state, unsigned int len);
+unsigned int state_resize(State *state, unsigned int len);
 Borticle *state_get_borticle(State *state, int index);
 
 void state_print(FILE *fp, State *state);
@@ -74,18 +109,12 @@ typedef enum {
     ALGO_NONE       = 1 << 0, // 1
     ALGO_NOMADIC    = 1 << 1, // 2
     ALGO_BARNES_HUT = 1 << 2, // 4
+    ALGO_DIRECT     = 1 << 3, // 8
+    ALGO_FMM        = 1 << 4, // 16
 } Algotithm;
-#define ALGO_LEN 3
+#define ALGO_LEN 5
 extern const char *algorithms[ALGO_LEN];
 
-// algorithm handlers
-
-void bort_init_default(State *state, Borticle *bort, size_t index);
-void bort_update_default(State *state, Borticle *bort, size_t index);
-
-void bort_init_nomadic(State *state, Borticle *bort, size_t index);
-void bort_update_nomadic(State *state, Borticle *bort, size_t index);
+// handlers: @see algorithm.h
 
-void bort_init_barnes_hut(State *state, Borticle *bort, size_t index);
-void bort_update_barnes_hut(State *state, Borticle *bort, size_t index);
 #endif
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+#include "log.h"
+
+/**
+ * name must be a string literal (or otherwise outlive the trace), only the pointer is stored
+ */
+typedef struct TraceEvent {
+    const char *name;
+    uint64_t ts;        // ns, relative to trace_init()
+    unsigned int tid;
+    char ph;            // 'B'egin, 'E'nd, 'M'etadata (thread name)
+} TraceEvent;
+
+static struct {
+    bool enabled;
+    char *path;
+    uint64_t start;
+
+    TraceEvent *events;
+    size_t max;
+    atomic_size_t len;
+    atomic_uint threads;
+} m_trace = {0};
+
+static _Thread_local unsigned int m_tid = 0; // 0: not yet assigned
+
+static unsigned int _tid() {
+    if (!m_tid) {
+        m_tid = atomic_fetch_add(&m_trace.threads, 1) + 1;
+    }
+    return m_tid;
+}
+
+static void _record(const char *name, char ph) {
+    if (!m_trace.enabled) {
+        return;
+    }
+
+    size_t index = atomic_fetch_add_explicit(&m_trace.len, 1, memory_order_relaxed);
+    if (index >= m_trace.max) {
+        return; // full, counted on write
+    }
+
+    TraceEvent *event = &m_trace.events[index];
+    event->name = name;
+    event->ts = time_monotonic_ns() - m_trace.start;
+    event->tid = _tid();
+    event->ph = ph;
+}
+
+// --- public
+
+/**
+ * Enables tracing, the events are written to path on trace_write()
+ */
+void trace_init(const char *path, size_t max_events) {
+    EXIT_IF(path == NULL, "no trace path");
+
+    m_trace.events = malloc(max_events * sizeof(TraceEvent));
+    EXIT_IF_F(m_trace.events == NULL, "failed to allocate for %ld trace events", max_events);
+
+    m_trace.path = strdup(path);
+    m_trace.max = max_events;
+    m_trace.start = time_monotonic_ns();
+    atomic_init(&m_trace.len, 0);
+    atomic_init(&m_trace.threads, 0);
+    m_trace.enabled = 1;
+}
+
+bool trace_enabled() {
+    return m_trace.enabled;
+}
+
+void trace_thread_name(const char *name) {
+    _record(name, 'M');
+}
+
+void trace_begin(const char *name) {
+    _record(name, 'B');
+}
+
+void trace_end(const char *name) {
+    _record(name, 'E');
+}
+
+/**
+ * Writes the recorded events as chrome trace json, call after all traced threads have stopped.
+ */
+int trace_write() {
+    if (!m_trace.enabled) {
+        return 0;
+    }
+
+    FILE *fp = fopen(m_trace.path, "w");
+    if (!fp) {
+        LOG_ERROR_F("failed to open trace file '%s'", m_trace.path);
+        return -1;
+    }
+
+    size_t len = atomic_load(&m_trace.len);
+    if (len > m_trace.max) {
+        LOG_WARN_F("trace buffer full, dropped %ld events", len - m_trace.max);
+        len = m_trace.max;
+    }
+
+    int pid = getpid();
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (size_t i = 0; i < len; i++) {
+        TraceEvent *event = &m_trace.events[i];
+        if (event->ph == 'M') {
+            fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", pid, event->tid, event->name);
+        } else {
+            fprintf(fp, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u}", event->name, event->ph, event->ts / 1e3, pid, event->tid);
+        }
+        fprintf(fp, "%s\n", (i < len - 1) ? "," : "");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+
+    LOG_INFO_F("wrote %ld trace events to '%s'", len, m_trace.path);
+    return 0;
+}
+
+void trace_destroy() {
+    m_trace.enabled = 0;
+    freez(m_trace.events);
+    m_trace.events = NULL;
+    freez(m_trace.path);
+    m_trace.path = NULL;
+}
@@ -0,0 +1,23 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+////
+// Chrome trace (chrome://tracing, ui.perfetto.dev) event recorder
+////
+
+#define TRACE_MAX_EVENTS (1 << 20) // preallocated, events beyond are dropped
+
+void trace_init(const char *path, size_t max_events);
+bool trace_enabled();
+
+void trace_thread_name(const char *name);
+void trace_begin(const char *name);
+void trace_end(const char *name);
+
+int trace_write();
+void trace_destroy();
+
+#endif
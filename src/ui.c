@@ -3,6 +3,8 @@
 
 #include "log.h"
 #include "state.h"
+#include "sim.h"
+#include "profiler.h"
 
 struct GuiDialogState {
     Rectangle rect;
@@ -11,11 +13,16 @@ struct GuiDialogState {
 
 static struct GuiDialogState m_window = {{0}};
 const char *algo_options = NULL;
-int algo_active = 0; //TODO active
+int algo_selected = 0; // toggle index, state->algorithms bit
 
-// caches
-float grav_g = 0.f;
-float bh_theta = 0.f;
+// caches, the simulation thread owns the state values
+static State m_params; // algorithm parameters, only the fields addressed by AlgoParam are used
+bool bh_quadrupole = 0;
+float bh_far_every = 0.f;
+float pop_len = 0.f;
+unsigned int pop_len_seen = 0; // last population published by the simulation
+bool paused = 0;
+bool ui_qtree = 0;
 
 int grav_edit = 0;
 
@@ -35,7 +42,50 @@ static Rectangle _grid(struct GuiDialogState window, unsigned int col, unsigned
     };
 };
 
-void ui_init(State *state) {
+/**
+ * Debug panel: current/avg/p99 per profiler phase and a frame time graph
+ */
+static void _draw_profiler(State *state) {
+    int w = 250;
+    int x = state->width - w - 10;
+    int y = 10;
+    int lh = 12;
+    int gh = 60; // graph height
+
+    Rectangle panel = {x, y, w, 30 + (PROF_LEN * lh) + gh + 10};
+    GuiPanel(panel, "Profiler (ms)");
+
+    y += 28;
+    DrawText(TextFormat("%-12s %7s %7s %7s", "phase", "cur", "avg", "p99"), x + 5, y, 10, DARKGRAY);
+    y += lh;
+
+    ProfStats stats;
+    for (int i = 0; i < PROF_LEN; i++) {
+        prof_stats(i, &stats);
+        if (!stats.count) {
+            DrawText(TextFormat("%-12s %7s %7s %7s", prof_phases[i], "-", "-", "-"), x + 5, y, 10, GRAY);
+        } else {
+            DrawText(TextFormat("%-12s %7.2f %7.2f %7.2f", prof_phases[i], stats.cur, stats.avg, stats.p99), x + 5, y, 10, DARKGRAY);
+        }
+        y += lh;
+    }
+
+    // frame time graph, scaled to 2x the target frame time
+    float samples[PROF_SAMPLES];
+    size_t len = prof_samples(PROF_FRAME, samples, w - 10);
+    float target = 1000.f / state->fps;
+    float scale = gh / (2.f * target);
+    int base = y + gh;
+
+    for (size_t i = 0; i < len; i++) {
+        float h = samples[i] * scale;
+        h = (h > gh) ? gh : h;
+        DrawLine(x + 5 + i, base, x + 5 + i, base - (int) h, (samples[i] > target * 1.5f) ? RED : DARKGREEN);
+    }
+    DrawLine(x + 5, base - (int) (target * scale), x + w - 5, base - (int) (target * scale), GRAY);
+}
+
+void ui_init(State *state, Simulation *sim) {
     EXIT_IF(state == NULL, "no state");
 
     m_window.rect.x = 10;
@@ -46,26 +96,50 @@ void ui_init(State *state) {
     m_window.line_height = 20;
     m_window.line_spacing = 5;
 
-    m_window.rect.height = 30 + (10 * (m_window.line_height + m_window.line_spacing )) + (2 * m_window.padding);
+    m_window.rect.height = 30 + ((6 + 2 * ALGO_PARAMS_MAX) * (m_window.line_height + m_window.line_spacing )) + (2 * m_window.padding);
 
     // Note @see raylib rtext.c currently (v 5.5) TextJoin() is using stack memory
     // and should not be freed: static char buffer[MAX_TEXT_BUFFER_LENGTH]
     algo_options = TextJoin(algorithms, ALGO_LEN, "\n");
 
-    grav_g =  state->grav_g;
-    bh_theta =  state->bh_theta;
+    m_params = *state;
+    algo_selected = (state->algorithms) ? __builtin_ctz(state->algorithms) : 0; // lowest enabled
+    bh_quadrupole = state->bh_quadrupole;
+    bh_far_every = state->bh_far_every;
+    pop_len = (float) state->pop_len;
+    pop_len_seen = state->pop_len;
+    paused = state->paused;
+    ui_qtree = state->ui_qtree;
 }
 
-void ui_update(State *state) {
+/**
+ * Handles key input and sends the changes of the last ui_draw() to the simulation thread
+ */
+void ui_update(State *state, Simulation *sim) {
     EXIT_IF(state == NULL, "no state");
+
+    if (IsKeyPressed(KEY_SPACE)) {
+        paused = !paused;
+        sim_send(sim, (Command) {.type = CMD_PAUSED, .u = paused});
+    }
+
+    if (IsKeyPressed(KEY_F5)) {
+        sim_send(sim, (Command) {.type = CMD_SNAPSHOT});
+    }
+
+    if (state->ui_qtree != ui_qtree) {
+        ui_qtree = state->ui_qtree;
+        sim_send(sim, (Command) {.type = CMD_OVERLAY, .u = ui_qtree});
+    }
 }
 
-void ui_draw(State *state) {
+void ui_draw(State *state, Simulation *sim, Frame *frame) {
     EXIT_IF(state == NULL, "no state");
     // GuiPanel((Rectangle){ 320, 25, 225, 140 },NULL);
 
     if(state->ui_debug) {
         DrawFPS(10, 10);
+        _draw_profiler(state);
     }
 
     if (GuiButton((Rectangle){ 10, state->height - 25, 20, 20 }, GuiIconText(ICON_GEAR, ""))) {
@@ -78,7 +152,11 @@ void ui_draw(State *state) {
         /* first column */
 
         // paused
-        GuiCheckBox(_grid(m_window, 0, 0, m_window.line_height, 0), "Paused", &state->paused);
+        bool was_paused = paused;
+        GuiCheckBox(_grid(m_window, 0, 0, m_window.line_height, 0), "Paused", &paused);
+        if (paused != was_paused) {
+            sim_send(sim, (Command) {.type = CMD_PAUSED, .u = paused});
+        }
 
         // ui_debug
         GuiCheckBox(_grid(m_window, 0, 1, m_window.line_height, 0), "Show debug", &state->ui_debug);
@@ -90,54 +168,75 @@ void ui_draw(State *state) {
         GuiCheckBox(_grid(m_window, 0, 3, m_window.line_height, 0), "Show quadtree", &state->ui_qtree);
 
         // pop_len
-        float pop_len = (float) state->pop_len;
-        GuiLabel(_grid(m_window, 0, 4, 0, 0), "Population");
-        GuiSliderBar(_grid(m_window, 0, 5, 0, 0), NULL, TextFormat("%d (max:%d)", state->pop_len, state->pop_max), &pop_len, 0, state->pop_max);
-        if (pop_len > 0.f && pop_len != state->pop_len) {
-            state_set_pop_len(state, (int) round(pop_len));
+        unsigned int len = (frame) ? frame->len : 0;
+        if (len != pop_len_seen) {
+            // changed by the simulation (or a previous command arrived)
+            pop_len_seen = len;
+            pop_len = (float) len;
         }
-
-        // grav_g
-        GuiLabel(_grid(m_window, 0, 6, 0, 0), "Gravitational constant");
-        GuiSlider(_grid(m_window, 0, 7, 0, 0), NULL, TextFormat("%2.f (max:%2.f)", state->grav_g, 20.f), &grav_g, 0.f, 20.f);
-        if (grav_g != state->grav_g) {
-            state->grav_g = grav_g;
+        float prev_len = pop_len;
+        GuiLabel(_grid(m_window, 0, 4, 0, 0), "Population");
+        GuiSliderBar(_grid(m_window, 0, 5, 0, 0), NULL, TextFormat("%d (max:%d)", len, state->pop_max), &pop_len, 0, state->pop_max);
+        if (pop_len > 0.f && (unsigned int) round(pop_len) != (unsigned int) round(prev_len)) {
+            sim_send(sim, (Command) {.type = CMD_POP_LEN, .u = (unsigned int) round(pop_len)});
         }
 
-        // bh_theta
-        GuiLabel(_grid(m_window, 0, 8, 0, 0), "Barnes Hut: theta");
-        GuiSlider(_grid(m_window, 0, 9, 0, 0), NULL, TextFormat("%2.f (max:%2.f)", state->bh_theta, 2.f), &bh_theta, .5f, 2.f);
-        if (bh_theta != state->bh_theta) {
-            state->bh_theta = bh_theta;
+        // parameters of the selected algorithm, @see Algorithm.params
+        const Algorithm *algo = algo_get(1 << algo_selected);
+        for (size_t i = 0; algo && i < algo->params_len; i++) {
+            const AlgoParam *param = &algo->params[i];
+            float *value = algo_param(&m_params, param);
+            float prev = *value;
+            GuiLabel(_grid(m_window, 0, 6 + (i * 2), 0, 0), param->name);
+            GuiSlider(_grid(m_window, 0, 7 + (i * 2), 0, 0), NULL, TextFormat("%.2f (max:%.2f)", *value, param->max), value, param->min, param->max);
+            if (*value != prev) {
+                sim_send(sim, (Command) {.type = CMD_PARAM, .param = param, .f = *value});
+            }
         }
 
         /* second column */
 
         // algorithms
-        int old = algo_active;
-        GuiToggleGroup(_grid(m_window, 1, 0, 0 ,0), algo_options, &algo_active); // fn currently always returns 0, so checks are useless
-        if (algo_active != old) {
-            state->algorithms = (1 << algo_active); // singl assignment not stacking algorithms (yet)
+        int old = algo_selected;
+        GuiToggleGroup(_grid(m_window, 1, 0, 0 ,0), algo_options, &algo_selected); // fn currently always returns 0, so checks are useless
+        if (algo_selected != old) {
+            sim_send(sim, (Command) {.type = CMD_ALGORITHMS, .u = (1 << algo_selected)}); // singl assignment not stacking algorithms (yet)
+        }
+
+        // bh_quadrupole
+        bool was_quadrupole = bh_quadrupole;
+        GuiCheckBox(_grid(m_window, 1, 5, m_window.line_height, 0), "Barnes Hut: quadrupoles", &bh_quadrupole);
+        if (bh_quadrupole != was_quadrupole) {
+            sim_send(sim, (Command) {.type = CMD_BH_QUADRUPOLE, .u = bh_quadrupole});
+        }
+
+        // bh_far_every
+        unsigned int far_every = (unsigned int) round(bh_far_every);
+        GuiLabel(_grid(m_window, 1, 8, 0, 0), "Barnes Hut: far field every");
+        GuiSlider(_grid(m_window, 1, 9, 0, 0), NULL, TextFormat("%d (max:%d)", far_every, 16), &bh_far_every, 1.f, 16.f);
+        if ((unsigned int) round(bh_far_every) != far_every) {
+            sim_send(sim, (Command) {.type = CMD_BH_FAR_EVERY, .u = (unsigned int) round(bh_far_every)});
         }
     }
 
-    if (state->selected) {
+    if (frame && frame->has_selected) {
+        Borticle *selected = &frame->selected;
         snprintf(sel_txt, 1024,
             "id: %d\n"
             "pos: {%.2f, %.2f}\n"
             "vel: {%.2f, %.2f}\n"
             "acc: {%.2f, %.2f}\n"
             "size: %.2f\n",
-            state->selected->id,
-            state->selected->pos.x, state->selected->pos.y,
-            state->selected->vel.x, state->selected->vel.y,
-            state->selected->acc.x, state->selected->acc.y,
-            state->selected->size
+            selected->id,
+            selected->pos.x, selected->pos.y,
+            selected->vel.x, selected->vel.y,
+            selected->acc.x, selected->acc.y,
+            selected->size
         );
 
         Rectangle cont = (Rectangle){
-            state->selected->pos.x + 10,
-            state->selected->pos.y + 10,
+            selected->pos.x + 10,
+            selected->pos.y + 10,
             150,
             100
         };
@@ -1,8 +1,12 @@
 #ifndef __UI_H__
 #define __UI_H__
 
-void ui_init(State *state);
-void ui_update(State *state);
-void ui_draw(State *state);
+typedef struct State State;
+typedef struct Simulation Simulation;
+typedef struct Frame Frame;
+
+void ui_init(State *state, Simulation *sim);
+void ui_update(State *state, Simulation *sim);
+void ui_draw(State *state, Simulation *sim, Frame *frame);
 void ui_destroy(State *state);
 #endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 
 #include "log.h"
 #include "utils.h"
@@ -12,11 +13,6 @@ void freez(void *ptr) {
     }
 }
 
-float rand_range_f(float min, float max) {
-    float scale = rand() / (float)RAND_MAX;
-    return min + scale * (max - min);
-}
-
 char *load_file_alloc(const char *path) {
     FILE *fp = fopen(path, "rb");
     if (!fp) {
@@ -45,3 +41,19 @@ char *load_file_alloc(const char *path) {
 
     return buffer;
 }
+
+/**
+ * Returns the monotonic clock time in seconds
+ */
+double time_monotonic() {
+    return (double) time_monotonic_ns() / 1e9;
+}
+
+/**
+ * Returns the monotonic clock time in nanoseconds
+ */
+uint64_t time_monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
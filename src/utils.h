@@ -1,8 +1,11 @@
 #ifndef __UTILS_H__
 #define __UTILS_H__
 
+#include <stdint.h>
+
 void freez(void *ptr);
-float rand_range_f(float min, float max);
 char *load_file_alloc(const char *path);
+double time_monotonic();
+uint64_t time_monotonic_ns();
 
 #endif
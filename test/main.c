@@ -22,6 +22,7 @@ enum Sections {
     TEST_NONE,
     TEST_QTREE,
     TEST_QLIST,
+    TEST_OTREE,
 
     TEST_MAX
 };
@@ -30,6 +31,7 @@ char sections[][256] = {
     "TEST_NONE",
     "TEST_QTREE",
     "TEST_QLIST",
+    "TEST_OTREE",
     "TEST_MAX"
 };
 
@@ -135,6 +137,11 @@ int main(int argc, char **argv) {
             SECTION(sections[TEST_QLIST]);
             test_qlist(argc, argv);
         }
+
+        if (section == TEST_OTREE || section == TEST_MAX) {
+            SECTION(sections[TEST_OTREE]);
+            test_otree(argc, argv);
+        }
     }
 
     fprintf(stderr,
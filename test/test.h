@@ -17,5 +17,6 @@ extern unsigned int gcount;
 
 void test_qtree(int argc, char **argv);
 void test_qlist(int argc, char **argv);
+void test_otree(int argc, char **argv);
 
 #endif
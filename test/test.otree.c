@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <assert.h>
+
+#include "test.h"
+#include "qtree/otree.h"
+#include "state.h"
+#include "borticle.h"
+
+typedef struct TestItem {
+    int id;
+    vec3_t pos; // control data, will not be queried within otree.h
+    float mass;
+} TestItem;
+
+static void test_otree_create() {
+    DESCRIBE("tree");
+    OTree *tree = otree_create((vec3_t) {0.f, 0.f, 0.f}, (vec3_t) {600.f, 400.f, 200.f});
+    assert(tree->length == 0);
+
+    ONode *root = tree->root;
+    assert(!onode_isleaf(root));
+    assert(onode_isempty(root));
+    assert(!onode_ispointer(root));
+
+    assert(root->self_max.x == 600.f);
+    assert(root->self_max.y == 400.f);
+    assert(root->self_max.z == 200.f);
+
+    otree_destroy(tree);
+    DONE();
+}
+
+static void test_otree_insert() {
+    OTree *tree = otree_create((vec3_t) {0.f, 0.f, 0.f}, (vec3_t) {16.f, 16.f, 16.f});
+
+    TestItem itm1 = {111, {12.f, 2.f, 2.f}, 1.f};
+    TestItem itm2 = {222, {1.f, 1.f, 14.f}, 2.f};
+    TestItem itm3 = {333, {20.f, 1.f, 1.f}, 1.f};
+
+    {
+        DESCRIBE("otree_insert(first node)");
+        assert(otree_insert(tree, &itm1, itm1.pos, itm1.mass) == QUAD_INSERTED);
+        assert(tree->length == 1);
+        assert(onode_isleaf(tree->root));
+        assert(tree->root->mass == itm1.mass);
+        DONE();
+    } {
+        DESCRIBE("otree_insert(second node)");
+        assert(otree_insert(tree, &itm2, itm2.pos, itm2.mass) == QUAD_INSERTED);
+        assert(tree->length == 2);
+        assert(onode_ispointer(tree->root));
+
+        // octant index: x | y << 1 | z << 2
+        assert(tree->root->children[1]->data == &itm1);
+        assert(tree->root->children[4]->data == &itm2);
+        assert(onode_isempty(tree->root->children[0]));
+        DONE();
+    } {
+        DESCRIBE("otree_insert(outside)");
+        assert(otree_insert(tree, &itm3, itm3.pos, itm3.mass) == QUAD_FAILED);
+        assert(tree->length == 2);
+        DONE();
+    } {
+        DESCRIBE("otree_find()");
+        ONode *node = otree_find(tree, itm2.pos);
+        assert(node != NULL);
+        assert(((TestItem*) node->data)->id == itm2.id);
+        assert(otree_find(tree, (vec3_t) {1.f, 1.f, 1.f}) == NULL);
+        DONE();
+    }
+
+    otree_destroy(tree);
+}
+
+static void test_otree_insert_duplicate() {
+    DESCRIBE("bucket if (n2.pos == n1.pos)");
+    OTree *tree = otree_create((vec3_t) {0.f, 0.f, 0.f}, (vec3_t) {16.f, 16.f, 16.f});
+
+    TestItem itm1 = {111, {3.f, 3.f, 3.f}, 1.f};
+    TestItem itm2 = {222, {3.f, 3.f, 3.f}, 2.f};
+    TestItem itm3 = {333, {12.f, 3.f, 3.f}, 1.f};
+
+    assert(otree_insert(tree, &itm1, itm1.pos, itm1.mass) == QUAD_INSERTED);
+    assert(otree_insert(tree, &itm2, itm2.pos, itm2.mass) == QUAD_BUCKETED);
+    assert(tree->length == 2);
+
+    // the leaf keeps the first entity, both are entries
+    assert(tree->root->data == &itm1);
+    ONode *entry = onode_entries(tree->root);
+    assert(entry == tree->root->bucket);
+    assert(entry->data == &itm1);
+    assert(entry->next != NULL && entry->next->data == &itm2);
+    assert(entry->next->next == NULL);
+    ASSERT_FLOAT(tree->root->mass, (itm1.mass + itm2.mass), 0.0001);
+
+    // a different position splits the leaf, the bucket moves into one child
+    assert(otree_insert(tree, &itm3, itm3.pos, itm3.mass) == QUAD_INSERTED);
+    assert(tree->length == 3);
+    assert(onode_ispointer(tree->root));
+
+    ONode *leaf = tree->root->children[0];
+    assert(onode_isleaf(leaf));
+    assert(leaf->bucket != NULL && leaf->bucket->next != NULL);
+    assert(otree_find(tree, itm2.pos) == leaf->bucket); // first entry at the position
+    assert(otree_find(tree, itm3.pos)->data == &itm3);
+
+    otree_aggregate(tree);
+    ASSERT_FLOAT(tree->root->mass, (itm1.mass + itm2.mass + itm3.mass), 0.0001);
+    ASSERT_FLOAT(leaf->mass, (itm1.mass + itm2.mass), 0.0001);
+
+    otree_destroy(tree);
+    DONE();
+}
+
+static void test_otree_insert_max_depth() {
+    DESCRIBE("bucket at max depth");
+    OTree *tree = otree_create((vec3_t) {0.f, 0.f, 0.f}, (vec3_t) {16.f, 16.f, 16.f});
+    tree->max_depth = 3;
+
+    // near-coincident: would split down to float precision
+    TestItem items[3] = {
+        {1, {1.f, 1.f, 1.f}, 1.f},
+        {2, {1.f + 1e-5f, 1.f, 1.f}, 2.f},
+        {3, {1.f, 1.f, 1.f + 1e-5f}, 3.f},
+    };
+
+    assert(otree_insert(tree, &items[0], items[0].pos, items[0].mass) == QUAD_INSERTED);
+    for (int i = 1; i < 3; i++) {
+        assert(otree_insert(tree, &items[i], items[i].pos, items[i].mass) == QUAD_BUCKETED);
+    }
+    assert(tree->length == 3);
+
+    // one leaf at depth 3, holding all entries
+    ONode *leaf = tree->root;
+    unsigned int depth = 0;
+    while (onode_ispointer(leaf)) {
+        leaf = leaf->children[0];
+        depth++;
+    }
+    assert(depth == 3);
+
+    int ids = 0;
+    for (ONode *entry = onode_entries(leaf); entry; entry = entry->next) {
+        ids += ((TestItem*) entry->data)->id;
+    }
+    assert(ids == 1 + 2 + 3);
+
+    otree_aggregate(tree);
+    ASSERT_FLOAT(tree->root->mass, 6.f, 0.0001);
+    ASSERT_FLOAT(leaf->com.z, ((1.f * 1.f + 1.f * 2.f + (1.f + 1e-5f) * 3.f) / 6.f), 0.0001);
+
+    otree_destroy(tree);
+    DONE();
+}
+
+typedef struct OVisitCtx {
+    int pre, post, leaves;
+    int order[8];
+    int stop_at; // QVISIT_STOP after this many leaves, 0: never
+} OVisitCtx;
+
+static int _visit_pre(ONode *node, void *ctx) {
+    OVisitCtx *visit = (OVisitCtx*) ctx;
+    visit->pre++;
+    if (onode_isleaf(node)) {
+        visit->order[visit->leaves++] = ((TestItem*) node->data)->id;
+        if (visit->stop_at && visit->leaves >= visit->stop_at) {
+            return QVISIT_STOP;
+        }
+    }
+    return QVISIT_CONTINUE;
+}
+
+static int _visit_post(ONode *node, void *ctx) {
+    ((OVisitCtx*) ctx)->post++;
+    return QVISIT_CONTINUE;
+}
+
+static int _visit_skip_root(ONode *node, void *ctx) {
+    ((OVisitCtx*) ctx)->pre++;
+    return (node->parent == NULL) ? QVISIT_SKIP : QVISIT_CONTINUE;
+}
+
+static void test_onode_visit() {
+    DESCRIBE("onode_visit(pre, post, skip, stop)");
+    OTree *tree = otree_create((vec3_t) {0.f, 0.f, 0.f}, (vec3_t) {16.f, 16.f, 16.f});
+
+    // octants 4, 1, 7: visited in child index order
+    TestItem items[3] = {
+        {1, {2.f, 2.f, 12.f}, 1.f},
+        {2, {12.f, 2.f, 2.f}, 1.f},
+        {3, {12.f, 12.f, 12.f}, 1.f},
+    };
+    for (int i = 0; i < 3; i++) {
+        assert(otree_insert(tree, &items[i], items[i].pos, items[i].mass) == QUAD_INSERTED);
+    }
+
+    {
+        OVisitCtx visit = {0};
+        assert(onode_visit(tree->root, _visit_pre, _visit_post, &visit) == QVISIT_CONTINUE);
+        assert(visit.pre == 1 + OCT_CHILDREN);
+        assert(visit.post == visit.pre);
+        assert(visit.leaves == 3);
+        assert(visit.order[0] == 2 && visit.order[1] == 1 && visit.order[2] == 3);
+    } {
+        OVisitCtx visit = {0};
+        onode_visit(tree->root, _visit_skip_root, NULL, &visit);
+        assert(visit.pre == 1);
+    } {
+        OVisitCtx visit = {.stop_at = 2};
+        assert(onode_visit(tree->root, _visit_pre, _visit_post, &visit) == QVISIT_STOP);
+        assert(visit.leaves == 2);
+        assert(visit.post < visit.pre);
+    }
+
+    otree_destroy(tree);
+    DONE();
+}
+
+static void test_otree_aggregate() {
+    DESCRIBE("otree_aggregate(nested nodes)");
+    OTree *tree = otree_create((vec3_t) {0.f, 0.f, 0.f}, (vec3_t) {16.f, 16.f, 16.f});
+
+    // itm2 and itm3 share the first octant on several levels
+    TestItem itm1 = {111, {12.f, 12.f, 12.f}, 1.f};
+    TestItem itm2 = {222, {1.f, 1.f, 1.f}, 2.f};
+    TestItem itm3 = {333, {1.5f, 1.5f, 2.f}, 3.f};
+
+    otree_insert(tree, &itm1, itm1.pos, itm1.mass);
+    otree_insert(tree, &itm2, itm2.pos, itm2.mass);
+    otree_insert(tree, &itm3, itm3.pos, itm3.mass);
+    assert(tree->length == 3);
+
+    otree_aggregate(tree);
+
+    float mass = itm1.mass + itm2.mass + itm3.mass;
+    ASSERT_FLOAT(tree->root->mass, mass, 0.0001);
+    ASSERT_FLOAT(tree->root->com.x, ((12.f * 1.f + 1.f * 2.f + 1.5f * 3.f) / mass), 0.0001);
+    ASSERT_FLOAT(tree->root->com.z, ((12.f * 1.f + 1.f * 2.f + 2.f * 3.f) / mass), 0.0001);
+
+    ASSERT_FLOAT(tree->root->children[0]->mass, (itm2.mass + itm3.mass), 0.0001);
+    assert(tree->root->children[2]->mass == 0.f);
+
+    otree_destroy(tree);
+    DONE();
+}
+
+static void test_camera_3d() {
+    DESCRIBE("3D view of the z = 0 plane matches the 2D view");
+    State state = {0};
+    state.width = 800;
+    state.height = 600;
+
+    float w = (float) state.width;
+    float h = (float) state.height;
+    mat4_t view, projection;
+    float point_scale;
+
+    for (unsigned int dims = 2; dims <= 3; dims++) {
+        state.dims = dims;
+        bort_camera(&state, &view, &projection, &point_scale);
+        mat4_t vp = m4_mul(projection, view);
+
+        // normalized device coordinates: x right, y up
+        vec3_t right = m4_mul_pos(vp, vec3(w, h / 2, 0.f));
+        ASSERT_FLOAT(right.x, 1.f, 0.001);
+        ASSERT_FLOAT(right.y, 0.f, 0.001);
+
+        vec3_t left = m4_mul_pos(vp, vec3(0.f, h / 2, 0.f));
+        ASSERT_FLOAT(left.x, -1.f, 0.001);
+
+        vec3_t top = m4_mul_pos(vp, vec3(w / 2, 0.f, 0.f));
+        ASSERT_FLOAT(top.x, 0.f, 0.001);
+        ASSERT_FLOAT(top.y, 1.f, 0.001);
+    }
+
+    DONE();
+}
+
+void test_otree(int argc, char **argv) {
+    test_otree_create();
+    test_otree_insert();
+    test_otree_insert_duplicate();
+    test_otree_insert_max_depth();
+    test_otree_aggregate();
+    test_onode_visit();
+    test_camera_3d();
+}
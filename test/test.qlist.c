@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include <assert.h>
 
@@ -250,10 +251,67 @@ static void test_find_in_area() {
     DONE();
 }
 
+static void test_sum_in_area() {
+    DESCRIBE("aggregate area queries match the leaves found in the area");
+    QTree *tree = qtree_create((vec2){0.f, 0.f}, (vec2) {64.f, 64.f});
+
+    // 16 x 16 grid with varying masses
+    TestItem items[256];
+    for (int i = 0; i < 256; i++) {
+        items[i] = (TestItem) {i, {2.f + (i % 16) * 4.f, 2.f + (i / 16) * 4.f}, 1.f + (i % 5)};
+        assert(qtree_insert(tree, &items[i], items[i].pos, items[i].mass) == QUAD_INSERTED);
+    }
+    qtree_aggregate(tree);
+    assert(tree->root->count == 256);
+
+    struct {vec2 pos; float radius;} areas[] = {
+        {{32.f, 32.f}, 64.f}, // whole tree
+        {{16.f, 16.f}, 16.f}, // nw quadrant
+        {{20.f, 37.f}, 9.5f}, // crossing node borders
+        {{6.f, 6.f}, 4.f},    // leaves on the area border
+        {{33.f, 33.f}, .5f},  // empty
+    };
+
+    QList *list = qlist_create(16);
+    for (size_t a = 0; a < sizeof(areas) / sizeof(areas[0]); a++) {
+        qlist_reset(list);
+        qtree_find_in_area(tree, areas[a].pos, areas[a].radius, list);
+
+        float mass = 0.f;
+        vec2 com = {0.f, 0.f};
+        for (size_t i = 0; i < list->len; i++) {
+            mass += list->nodes[i]->mass;
+            com.x += list->nodes[i]->pos.x * list->nodes[i]->mass;
+            com.y += list->nodes[i]->pos.y * list->nodes[i]->mass;
+        }
+
+        QArea sum = qtree_sum_in_area(tree, areas[a].pos, areas[a].radius);
+        assert(sum.count == list->len);
+        assert(qtree_count_in_area(tree, areas[a].pos, areas[a].radius) == list->len);
+        ASSERT_FLOAT(sum.mass, mass, 0.001);
+        ASSERT_FLOAT(qtree_mass_in_area(tree, areas[a].pos, areas[a].radius), mass, 0.001);
+
+        vec2 centroid = qtree_centroid_in_area(tree, areas[a].pos, areas[a].radius);
+        if (mass > 0.f) {
+            ASSERT_FLOAT(centroid.x, com.x / mass, 0.001);
+            ASSERT_FLOAT(centroid.y, com.y / mass, 0.001);
+        } else {
+            assert(centroid.x == 0.f && centroid.y == 0.f);
+        }
+    }
+    assert(qtree_count_in_area(tree, (vec2) {32.f, 32.f}, 64.f) == 256);
+    assert(qtree_count_in_area(tree, (vec2) {33.f, 33.f}, .5f) == 0);
+
+    qlist_destroy(list);
+    qtree_destroy(tree);
+    DONE();
+}
+
 void test_qlist(int argc, char **argv) {
     test_qlist_core();
     test_qnode_within_area();
     test_qnode_overlaps_area();
 
     test_find_in_area();
+    test_sum_in_area();
 }
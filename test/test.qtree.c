@@ -6,6 +6,8 @@
 
 #include "test.h"
 #include "qtree/qtree.h"
+#include "state.h"
+#include "borticle.h"
 
 typedef struct TestItem {
     int id;
@@ -134,12 +136,12 @@ static void test_tree_insert_outside() {
     DONE();
 }
 
-static void test_tree_insert_replace() {
-    DESCRIBE("replace if (n2.pos == n1.pos)");
+static void test_tree_insert_duplicate() {
+    DESCRIBE("bucket if (n2.pos == n1.pos)");
     QTree *tree = qtree_create((vec2) {1.f, 1.f}, (vec2) {10.f, 10.f});
 
     TestItem itm1 = {111, {8.f, 2.f}, 1.f};
-    TestItem itm2 = {222, {8.f, 2.f}, 1.f};
+    TestItem itm2 = {222, {8.f, 2.f}, 2.f};
 
     int res;
     TestItem *item;
@@ -154,24 +156,42 @@ static void test_tree_insert_replace() {
         assert(tree->root->data != NULL);
         assert(tree->root->pos.x == itm1.pos.x);
         assert(tree->root->pos.y == itm1.pos.y);
+        assert(tree->root->bucket == NULL);
+        assert(qnode_entries(tree->root) == tree->root);
 
         item = (TestItem*) tree->root->data;
         assert(item->id == itm1.id);
     } {
-        // second node replaces first
+        // second node joins first in a bucket
         res = qtree_insert(tree, &itm2, itm2.pos, itm2.mass);
 
-        assert(res == QUAD_REPLACED);
-        assert(tree->length == 1);
+        assert(res == QUAD_BUCKETED);
+        assert(tree->length == 2);
 
+        // the leaf keeps the first entity
         assert(tree->root->data != NULL);
-        assert(tree->root->pos.x == itm2.pos.x);
-        assert(tree->root->pos.y == itm2.pos.y);
-
         item = (TestItem*) tree->root->data;
+        assert(item->id == itm1.id);
+
+        // both entries, the leaf's own first
+        QNode *entry = qnode_entries(tree->root);
+        assert(entry == tree->root->bucket);
+        item = (TestItem*) entry->data;
+        assert(item->id == itm1.id);
+        assert(entry->mass == itm1.mass);
+
+        entry = entry->next;
+        assert(entry != NULL);
+        item = (TestItem*) entry->data;
         assert(item->id == itm2.id);
+        assert(entry->mass == itm2.mass);
+        assert(entry->next == NULL);
 
-        // splitting
+        // no mass lost
+        ASSERT_FLOAT(tree->root->mass, (itm1.mass + itm2.mass), 0.0001);
+        assert(tree->root->count == 2);
+
+        // no splitting
         {
             assert(tree->root->nw == NULL);
             assert(tree->root->ne == NULL);
@@ -180,6 +200,80 @@ static void test_tree_insert_replace() {
         }
     }
 
+    {
+        // a third, different position splits the leaf, the bucket moves into one child
+        TestItem itm3 = {333, {2.f, 8.f}, 1.f};
+        res = qtree_insert(tree, &itm3, itm3.pos, itm3.mass);
+
+        assert(res == QUAD_INSERTED);
+        assert(tree->length == 3);
+        assert(qnode_ispointer(tree->root));
+
+        QNode *leaf = tree->root->ne;
+        assert(qnode_isleaf(leaf));
+        assert(leaf->bucket != NULL && leaf->bucket->next != NULL);
+        ASSERT_FLOAT(leaf->mass, (itm1.mass + itm2.mass), 0.0001);
+
+        qtree_aggregate(tree);
+        ASSERT_FLOAT(tree->root->mass, (itm1.mass + itm2.mass + itm3.mass), 0.0001);
+        assert(tree->root->count == 3);
+    }
+
+    qtree_destroy(tree);
+    DONE();
+}
+
+static void test_tree_insert_max_depth() {
+    DESCRIBE("bucket at max depth");
+    QTree *tree = qtree_create((vec2) {0.f, 0.f}, (vec2) {16.f, 16.f});
+    tree->max_depth = 3;
+
+    // near-coincident: would split down to float precision
+    TestItem items[4] = {
+        {1, {1.f, 1.f}, 1.f},
+        {2, {1.f + 1e-5f, 1.f}, 2.f},
+        {3, {1.f, 1.f + 1e-5f}, 3.f},
+        {4, {1.f + 1e-5f, 1.f + 1e-5f}, 4.f},
+    };
+
+    assert(qtree_insert(tree, &items[0], items[0].pos, items[0].mass) == QUAD_INSERTED);
+    for (int i = 1; i < 4; i++) {
+        assert(qtree_insert(tree, &items[i], items[i].pos, items[i].mass) == QUAD_BUCKETED);
+    }
+    assert(tree->length == 4);
+
+    // one leaf at depth 3, holding all entries
+    QNode *leaf = tree->root;
+    unsigned int depth = 0;
+    while (qnode_ispointer(leaf)) {
+        leaf = leaf->nw;
+        depth++;
+    }
+    assert(depth == 3);
+    assert(qnode_isleaf(leaf));
+
+    // the leaf's own entry leads
+    assert(((TestItem*) qnode_entries(leaf)->data)->id == items[0].id);
+    int len = 0;
+    int ids = 0;
+    for (QNode *entry = qnode_entries(leaf); entry; entry = entry->next) {
+        ids += ((TestItem*) entry->data)->id;
+        len++;
+    }
+    assert(len == 4);
+    assert(ids == 1 + 2 + 3 + 4);
+
+    // entries are found by their position
+    QNode *found = qtree_find(tree, items[2].pos);
+    assert(found != NULL);
+    assert(((TestItem*) found->data)->id == items[2].id);
+
+    qtree_aggregate(tree);
+    ASSERT_FLOAT(tree->root->mass, 10.f, 0.0001);
+    assert(tree->root->count == 4);
+    assert(leaf->count == 4);
+    assert(leaf->qxx > 0.f); // entries are spread
+
     qtree_destroy(tree);
     DONE();
 }
@@ -370,13 +464,199 @@ static void test_node_mass() {
     qtree_destroy(tree);
 }
 
+static void test_tree_aggregate() {
+    DESCRIBE("qtree_aggregate(nested nodes)");
+    QTree *tree =  qtree_create((vec2) {0.f, 0.f}, (vec2) {16.f, 16.f});
+
+    // itm2 and itm3 share the nw quadrant on several levels
+    TestItem itm1 = {111, {12.f, 12.f}, 1.f};
+    TestItem itm2 = {222, {1.f, 1.f}, 2.f};
+    TestItem itm3 = {333, {1.5f, 1.5f}, 3.f};
+
+    qtree_insert(tree, &itm1, itm1.pos, itm1.mass);
+    qtree_insert(tree, &itm2, itm2.pos, itm2.mass);
+    qtree_insert(tree, &itm3, itm3.pos, itm3.mass);
+    assert(tree->length == 3);
+
+    qtree_aggregate(tree);
+
+    float mass = itm1.mass + itm2.mass + itm3.mass;
+    ASSERT_FLOAT(tree->root->mass, mass, 0.0001);
+    ASSERT_FLOAT(tree->root->com.x, ((12.f * 1.f + 1.f * 2.f + 1.5f * 3.f) / mass), 0.0001);
+    ASSERT_FLOAT(tree->root->com.y, ((12.f * 1.f + 1.f * 2.f + 1.5f * 3.f) / mass), 0.0001);
+
+    ASSERT_FLOAT(tree->root->nw->mass, (itm2.mass + itm3.mass), 0.0001);
+    ASSERT_FLOAT(tree->root->nw->com.x, ((1.f * 2.f + 1.5f * 3.f) / (itm2.mass + itm3.mass)), 0.0001);
+
+    // empty quadrants
+    assert(tree->root->ne->mass == 0.f);
+    assert(tree->root->sw->mass == 0.f);
+
+    // second moments about the root com, sum(m * d * d^T)
+    TestItem *items[3] = {&itm1, &itm2, &itm3};
+    float qxx = 0.f, qxy = 0.f, qyy = 0.f;
+    for (int i = 0; i < 3; i++) {
+        float dx = items[i]->pos.x - tree->root->com.x;
+        float dy = items[i]->pos.y - tree->root->com.y;
+        qxx += items[i]->mass * dx * dx;
+        qxy += items[i]->mass * dx * dy;
+        qyy += items[i]->mass * dy * dy;
+    }
+    ASSERT_FLOAT(tree->root->qxx, qxx, 0.001);
+    ASSERT_FLOAT(tree->root->qxy, qxy, 0.001);
+    ASSERT_FLOAT(tree->root->qyy, qyy, 0.001);
+
+    // leaves are point masses
+    QNode *leaf = qtree_find(tree, itm1.pos);
+    assert(leaf != NULL);
+    assert(leaf->qxx == 0.f && leaf->qxy == 0.f && leaf->qyy == 0.f);
+
+    qtree_destroy(tree);
+    DONE();
+}
+
+typedef struct VisitCtx {
+    int pre;
+    int post;
+    int leaves;
+    int order[8]; // TestItem ids of the leaves in visiting order
+    int stop_at;  // leaves until QVISIT_STOP, 0: never
+} VisitCtx;
+
+static int _visit_pre(QNode *node, void *ctx) {
+    VisitCtx *visit = (VisitCtx*) ctx;
+    visit->pre++;
+    if (qnode_isleaf(node)) {
+        visit->order[visit->leaves++] = ((TestItem*) node->data)->id;
+        if (visit->stop_at && visit->leaves == visit->stop_at) {
+            return QVISIT_STOP;
+        }
+    }
+    return QVISIT_CONTINUE;
+}
+
+static int _visit_post(QNode *node, void *ctx) {
+    VisitCtx *visit = (VisitCtx*) ctx;
+    visit->post++;
+    return QVISIT_CONTINUE;
+}
+
+static int _visit_skip_nw(QNode *node, void *ctx) {
+    VisitCtx *visit = (VisitCtx*) ctx;
+    visit->pre++;
+    if (node->parent && node->parent->nw == node) {
+        return QVISIT_SKIP;
+    }
+    return QVISIT_CONTINUE;
+}
+
+static void test_node_visit() {
+    DESCRIBE("qnode_visit(pre, post, skip, stop)");
+    QTree *tree = qtree_create((vec2) {0.f, 0.f}, (vec2) {16.f, 16.f});
+
+    // one item per quadrant, two in the nw of nw
+    TestItem items[5] = {
+        {1, {1.f, 1.f}, 1.f},
+        {2, {3.f, 3.f}, 1.f},
+        {3, {12.f, 4.f}, 1.f},
+        {4, {4.f, 12.f}, 1.f},
+        {5, {12.f, 12.f}, 1.f},
+    };
+    for (int i = 0; i < 5; i++) {
+        assert(qtree_insert(tree, &items[i], items[i].pos, items[i].mass) == QUAD_INSERTED);
+    }
+
+    int nodes = 0;
+    {
+        VisitCtx visit = {0};
+        assert(qnode_visit(tree->root, _visit_pre, _visit_post, &visit) == QVISIT_CONTINUE);
+        nodes = visit.pre;
+        assert(visit.post == visit.pre);
+        assert(visit.leaves == 5);
+
+        // nw, ne, sw, se
+        int order[5] = {1, 2, 3, 4, 5};
+        for (int i = 0; i < 5; i++) {
+            assert(visit.order[i] == order[i]);
+        }
+    } {
+        // skipped children of the nw quadrants
+        VisitCtx visit = {0};
+        qnode_visit(tree->root, _visit_skip_nw, NULL, &visit);
+        assert(visit.pre < nodes);
+        assert(visit.pre == 1 + 4); // root, its quadrants (nw skipped)
+    } {
+        // stop after the second leaf: no further pre or post calls
+        VisitCtx visit = {.stop_at = 2};
+        assert(qnode_visit(tree->root, _visit_pre, _visit_post, &visit) == QVISIT_STOP);
+        assert(visit.leaves == 2);
+        assert(visit.pre < nodes);
+        assert(visit.post < visit.pre);
+    } {
+        // no callbacks, empty subtree
+        assert(qnode_visit(tree->root, NULL, NULL, NULL) == QVISIT_CONTINUE);
+        assert(qnode_visit(NULL, _visit_pre, _visit_post, NULL) == QVISIT_CONTINUE);
+    }
+
+    qtree_destroy(tree);
+    DONE();
+}
+
+static void test_tree_coincident_forces() {
+    DESCRIBE("Barnes-Hut on bucket entries at the same position without softening");
+
+    // monopole, quadrupole, multi-rate far field, grouped lists, octree
+    struct { bool quadrupole; unsigned int far_every, reuse, dims; } runs[5] = {
+        {false, 1, 0, 2},
+        {true, 1, 0, 2},
+        {false, 4, 0, 2},
+        {false, 1, 4, 2},
+        {false, 1, 0, 3},
+    };
+
+    for (int r = 0; r < 5; r++) {
+        State *state = state_create();
+        state->pop_max = 200;
+        state->dims = runs[r].dims;
+        state->algorithms = ALGO_BARNES_HUT;
+        state->direct_max = 0;
+        state->softening = 0.f;
+        state->bh_quadrupole = runs[r].quadrupole;
+        state->bh_far_every = runs[r].far_every;
+        state->bh_reuse = runs[r].reuse;
+        state_set_seed(state, 1);
+        state_set_pop_len(state, 200);
+
+        // two pairs share their positions: same leaf bucket, in each other's interaction lists
+        state->population[1].pos = state->population[0].pos;
+        state->population[3].pos = state->population[2].pos;
+
+        for (int step = 0; step < 8; step++) {
+            bort_update(state);
+        }
+        for (unsigned int i = 0; i < state->pop_len; i++) {
+            Borticle *bort = &state->population[i];
+            assert(isfinite(bort->pos.x) && isfinite(bort->pos.y) && isfinite(bort->pos.z));
+            assert(isfinite(bort->acc.x) && isfinite(bort->acc.y) && isfinite(bort->acc.z));
+        }
+
+        state_destroy(state);
+    }
+
+    DONE();
+}
+
 void test_qtree(int argc, char **argv) {
     test_tree();
     test_node();
     test_tree_insert();
     test_tree_insert_outside();
-    test_tree_insert_replace();
+    test_tree_insert_duplicate();
+    test_tree_insert_max_depth();
     test_tree_find();
     test_node_parent();
     test_node_mass();
+    test_tree_aggregate();
+    test_node_visit();
+    test_tree_coincident_forces();
 }